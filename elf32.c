@@ -1,3 +1,4 @@
+#ifndef __NANOCC__
 #include <stdio.h>
 #include <stdlib.h>
 #ifdef _MSC_VER
@@ -6,21 +7,24 @@
 #else
 #include <unistd.h>
 #endif
+#endif
 
-// nanocc treats all # lines as comments
 #include "nanocc-itf.h"
+#ifndef __NANOCC__
 #define _sys_read  read
 #define _sys_write write
 #define _sys_exit  exit
+#endif
 
 // elf32 binary generator
 
 enum P_FLAGS { PF_R = 4, PF_W = 2, PF_X = 1 };
 enum SH_FLAGS { SHF_WRITE = 1, SHF_ALLOC = 2, SHF_EXECINSTR = 4 };
-enum SH_TYPE { SHT_PROGBITS = 1, SHT_STRTAB = 3, SHT_NOBITS = 8 };
-
-int gen_write_pad(int count);
-void gen_backpatching(int string_base, int idata_base, int data_base);
+enum SH_TYPE { SHT_PROGBITS = 1, SHT_SYMTAB = 2, SHT_STRTAB = 3, SHT_NOBITS = 8, SHT_REL = 9 };
+enum E_TYPE { ET_REL = 1, ET_EXEC = 2 };
+enum ST_INFO { STB_GLOBAL = 0x10, STT_OBJECT = 1, STT_FUNC = 2, STT_SECTION = 3 };
+enum SH_INDEX { SHN_UNDEF = 0, SHN_COMMON = 0xfff2 };
+enum R_TYPE { R_386_32 = 1, R_386_PC32 = 2 };
 
 int write_bytes(int count, int b1, int b2, int b3, int b4)
 {
@@ -29,86 +33,106 @@ int write_bytes(int count, int b1, int b2, int b3, int b4)
     buffer[1] = b2;
     buffer[2] = b3;
     buffer[3] = b4;
-    _sys_write(1, buffer, count);
-    return count;
+    return gen_image_bytes(buffer, count);
 }
 
-int write_elf_header(int e_entry, int e_shoff, char e_phnum, char e_shnum)
+int write_elf_header(int e_type, int e_entry, int e_shoff, char e_phnum, char e_shnum)
 {
-    char a[4];
-    int null;
-
-    null = 0;
-
-    a[0] = 0; a[1] = 0; a[2] = 0; a[3] = 0;
-
     write_bytes(4, 0x7f, 'E', 'L', 'F');   // e_ident
     write_bytes(4, 0x01, 0x01, 0x01, 0);
-    _sys_write(1, &null, 4);
-    _sys_write(1, &null, 4);
-    write_bytes(2, 0x02, 0x00, 0, 0);      // e_type
+    gen_image_dword(0);
+    gen_image_dword(0);
+    write_bytes(2, e_type, 0x00, 0, 0);    // e_type
     write_bytes(2, 0x03, 0x00, 0, 0);      // e_machine
     write_bytes(4, 0x01, 0x00, 0x00, 0x00);// e_version
-    _sys_write(1, &e_entry, 4);            // e_entry
-    write_bytes(4, 0x34, 0x00, 0x00, 0x00);// e_phoff: offset to program header (= size of elf header)
-
-    _sys_write(1, &e_shoff, 4);            // e_shoff
-    _sys_write(1, &null, 4);               // e_flags
+    gen_image_dword(e_entry);              // e_entry
+    if (e_phnum)
+        write_bytes(4, 0x34, 0x00, 0x00, 0x00);// e_phoff: offset to program header (= size of elf header)
+    else
+        gen_image_dword(0);                // no program header in an object
+
+    gen_image_dword(e_shoff);              // e_shoff
+    gen_image_dword(0);                    // e_flags
     write_bytes(2, 0x34, 0x00, 0, 0);      // e_ehsize ELF header size
     write_bytes(2, 0x20, 0x00, 0, 0);      // e_phentsize: size of one program header table entry
-    a[0] = e_phnum;
-    _sys_write(1, a, 2);                   // e_phnum
+    write_bytes(2, e_phnum, 0, 0, 0);      // e_phnum
     write_bytes(2, 0x28, 0x00, 0, 0);      // e_shentsize: size of one section header table entry
-    a[0] = e_shnum;
-    _sys_write(1, a, 2);                   // e_shnum
-    a[0] = e_shnum-1;                      // e_shstrndx is the last section
-    _sys_write(1, a, 2);                   // e_shstrndx
+    write_bytes(2, e_shnum, 0, 0, 0);      // e_shnum
+    write_bytes(2, e_shnum-1, 0, 0, 0);    // e_shstrndx is the last section
 
     return 0x34;  // 52 bytes
 }
 
 int write_elf_ph(int p_offset, int p_vaddr, int p_filesz, int p_memsz, int p_flags, char p_align)
 {
-    char a[4];
-    int null, one;
-
-    null = 0;
-    one = 1;
-    a[0] = 0; a[1] = 0; a[2] = 0; a[3] = 0;
-
-    _sys_write(1, &one, 4);                 // p_type: type of segment
-    _sys_write(1, &p_offset, 4);            // p_offset
-    _sys_write(1, &p_vaddr, 4);             // p_vaddr
-    _sys_write(1, &null, 4);                // p_paddr (= 0)
-    _sys_write(1, &p_filesz, 4);            // p_filesz
-    _sys_write(1, &p_memsz, 4);             // p_memsz
-    _sys_write(1, &p_flags, 4);             // p_flags
-    a[0] = p_align;
-    _sys_write(1, a, 4);                    // p_align
+    gen_image_dword(1);                     // p_type: type of segment
+    gen_image_dword(p_offset);              // p_offset
+    gen_image_dword(p_vaddr);               // p_vaddr
+    gen_image_dword(0);                     // p_paddr (= 0)
+    gen_image_dword(p_filesz);              // p_filesz
+    gen_image_dword(p_memsz);               // p_memsz
+    gen_image_dword(p_flags);               // p_flags
+    gen_image_dword(p_align);               // p_align
 
     return 0x20;
 }
 
-int write_elf_sh(int sh_name, int sh_type, int sh_flags, int sh_addr, int sh_offset, int sh_size, int sh_align)
+int write_elf_sh(int sh_name, int sh_type, int sh_flags, int sh_addr, int sh_offset, int sh_size, int sh_link, int sh_info, int sh_align, int sh_entsize)
 {
-    int null;
-
-    null = 0;
-    _sys_write(1, &sh_name, 4);            // sh_name
-    _sys_write(1, &sh_type, 4);            // sh_type
-    _sys_write(1, &sh_flags, 4);           // sh_flags
-    _sys_write(1, &sh_addr, 4);            // sh_addr
-    _sys_write(1, &sh_offset, 4);          // sh_offset
-    _sys_write(1, &sh_size, 4);            // sh_size
-    _sys_write(1, &null, 4);               // sh_link
-    _sys_write(1, &null, 4);               // sh_info
-    _sys_write(1, &sh_align, 4);           // sh_align
-    _sys_write(1, &null, 4);  // sh_entsize
+    gen_image_dword(sh_name);              // sh_name
+    gen_image_dword(sh_type);              // sh_type
+    gen_image_dword(sh_flags);             // sh_flags
+    gen_image_dword(sh_addr);              // sh_addr
+    gen_image_dword(sh_offset);            // sh_offset
+    gen_image_dword(sh_size);              // sh_size
+    gen_image_dword(sh_link);              // sh_link
+    gen_image_dword(sh_info);              // sh_info
+    gen_image_dword(sh_align);             // sh_align
+    gen_image_dword(sh_entsize);           // sh_entsize
 
     return 4 * 10;
 }
 
-void gen_library(int emit_pos, char *symbol_name[], int *symbol_type, int *symbol_address, int symbol_count)
+int write_elf_sym(int st_name, int st_value, int st_size, int st_info, int st_shndx)
+{
+    gen_image_dword(st_name);              // st_name
+    gen_image_dword(st_value);             // st_value
+    gen_image_dword(st_size);              // st_size
+    write_bytes(4, st_info, 0, st_shndx & 0xff, st_shndx >> 8);  // st_info, st_other, st_shndx
+
+    return 16;
+}
+
+int elf_strlen(char *s)
+{
+    int n;
+
+    n = 0;
+    while (s[n])
+        ++n;
+    return n;
+}
+
+int gen_syscall3(int nr)
+{
+    // int nr(int ebx, int ecx, int edx) with cdecl arguments
+    int n, temp;
+
+    n = gen_emitbytes(3, 0x55, 0x89, 0xe5, 0);              // push ebp  / mov ebp, esp
+    n += gen_emitbytes(3, 0x52, 0x51, 0x53, 0);             // push edx / push ecx / push ebx
+    n += gen_emitbytes(3, 0x8b, 0x5d, 0x08, 0);             // mov    ebx,DWORD PTR [ebp+8]
+    n += gen_emitbytes(3, 0x8b, 0x4d, 0x0c, 0);             // mov    ecx,DWORD PTR [ebp+12]
+    n += gen_emitbytes(3, 0x8b, 0x55, 0x10, 0);             // mov    edx,DWORD PTR [ebp+16]
+    n += gen_emitbyte(0xb8);
+    temp = nr;
+    n += gen_emitdword(temp);                               // mov    eax, nr
+    n += gen_emitbytes(2, 0xcd, 0x80, 0, 0);                // int    0x80      ; syscall
+    n += gen_emitbytes(3, 0x5b, 0x59, 0x5a, 0);             // pop ebx / pop ecx / pop edx
+    n += gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3);          // mov esp, ebp   / pop ebp  /  ret
+    return n;
+}
+
+void gen_library(int emit_pos, int *symbol_type, int *symbol_address, int symbol_count)
 {
     int symidx;
 
@@ -127,72 +151,385 @@ void gen_library(int emit_pos, char *symbol_name[], int *symbol_type, int *symbo
 
     symidx = parse_lookup_symbol("_sys_write");
     if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(4);                            // write
+    }
+
+    symidx = parse_lookup_symbol("_sys_read");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(3);                            // read
+    }
+
+    symidx = parse_lookup_symbol("_sys_lseek");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(19);                           // lseek
+    }
+
+    symidx = parse_lookup_symbol("_sys_open");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(5);                            // open
+    }
+
+    symidx = parse_lookup_symbol("_sys_close");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(6);                            // close
+    }
+
+    symidx = parse_lookup_symbol("_sys_fork");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(2);                            // fork
+    }
+
+    symidx = parse_lookup_symbol("_sys_pipe");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(42);                           // pipe
+    }
+
+    symidx = parse_lookup_symbol("_sys_waitpid");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(7);                            // waitpid
+    }
+
+    symidx = parse_lookup_symbol("_sys_mmap");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        // char *_sys_mmap(int fd, int size): read-only private mapping of the whole file, 0 on failure
         int temp;
 
         symbol_address[symidx] = emit_pos;
 
-        emit_pos += gen_emitbytes(3, 0x55, 0x89, 0xe5, 0);          // push ebp  / mov ebp, esp
-        emit_pos += gen_emitbytes(3, 0x52, 0x51, 0x53, 0);          // push edx / push ecx / push ebx
-        emit_pos += gen_emitbytes(3, 0x8b, 0x5d, 0x08, 0);          // mov    ebx,DWORD PTR [ebp+8]
-        emit_pos += gen_emitbytes(3, 0x8b, 0x4d, 0x0c, 0);          // mov    ecx,DWORD PTR [ebp+12]
-        emit_pos += gen_emitbytes(3, 0x8b, 0x55, 0x10, 0);          // mov    edx,DWORD PTR [ebp+16]
+        emit_pos += gen_emitbytes(3, 0x55, 0x89, 0xe5, 0);      // push ebp  / mov ebp, esp
+        emit_pos += gen_emitbytes(3, 0x52, 0x51, 0x53, 0);      // push edx / push ecx / push ebx
+        emit_pos += gen_emitbytes(2, 0x56, 0x57, 0, 0);         // push esi / push edi
+        emit_pos += gen_emitbytes(2, 0x31, 0xdb, 0, 0);         // xor    ebx,ebx                   ; addr
+        emit_pos += gen_emitbytes(3, 0x8b, 0x4d, 0x0c, 0);      // mov    ecx,DWORD PTR [ebp+12]    ; length
+        emit_pos += gen_emitbyte(0xba);
+        temp = 1;
+        emit_pos += gen_emitdword(temp);                        // mov    edx, PROT_READ
+        emit_pos += gen_emitbyte(0xbe);
+        temp = 2;
+        emit_pos += gen_emitdword(temp);                        // mov    esi, MAP_PRIVATE
+        emit_pos += gen_emitbytes(3, 0x8b, 0x7d, 0x08, 0);      // mov    edi,DWORD PTR [ebp+8]     ; fd
+        emit_pos += gen_emitbytes(3, 0x55, 0x31, 0xed, 0);      // push ebp / xor ebp,ebp           ; page offset
         emit_pos += gen_emitbyte(0xb8);
-        temp = 4;
-        emit_pos += gen_emitdword(temp);                            // mov    eax, 4
-        emit_pos += gen_emitbytes(2, 0xcd, 0x80, 0, 0);             // int    0x80      ; syscall
-        emit_pos += gen_emitbytes(3, 0x5b, 0x59, 0x5a, 0);          // pop ebx / pop ecx / pop edx
-        emit_pos += gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3);       // mov esp, ebp   / pop ebp  /  ret
+        temp = 192;
+        emit_pos += gen_emitdword(temp);                        // mov    eax, 192                  ; mmap2
+        emit_pos += gen_emitbytes(3, 0xcd, 0x80, 0x5d, 0);      // int    0x80 / pop ebp
+        emit_pos += gen_emitbyte(0x3d);
+        temp = -4096;
+        emit_pos += gen_emitdword(temp);                        // cmp    eax, 0xfffff000
+        emit_pos += gen_emitbytes(4, 0x76, 0x02, 0x31, 0xc0);   // jbe +2 / xor eax,eax             ; -errno
+        emit_pos += gen_emitbytes(2, 0x5f, 0x5e, 0, 0);         // pop edi / pop esi
+        emit_pos += gen_emitbytes(3, 0x5b, 0x59, 0x5a, 0);      // pop ebx / pop ecx / pop edx
+        emit_pos += gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3);   // mov esp, ebp   / pop ebp  /  ret
     }
 
-    symidx = parse_lookup_symbol("_sys_read");
+    symidx = parse_lookup_symbol("_sys_munmap");
     if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_syscall3(91);                           // munmap
+    }
+
+    symidx = parse_lookup_symbol("_sys_realloc");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        // void *_sys_realloc(void *p, int size, int new_size): mremap of p, or a new
+        // anonymous mapping when p is 0. the pages that are added are 0. 0 on failure
         int temp;
 
         symbol_address[symidx] = emit_pos;
 
-        emit_pos += gen_emitbytes(3, 0x55, 0x89, 0xe5, 0);          // push ebp  / mov ebp, esp
-        emit_pos += gen_emitbytes(3, 0x52, 0x51, 0x53, 0);          // push edx / push ecx / push ebx
-        emit_pos += gen_emitbytes(3, 0x8b, 0x5d, 0x08, 0);          // mov    ebx,DWORD PTR [ebp+8]
-        emit_pos += gen_emitbytes(3, 0x8b, 0x4d, 0x0c, 0);          // mov    ecx,DWORD PTR [ebp+12]
-        emit_pos += gen_emitbytes(3, 0x8b, 0x55, 0x10, 0);          // mov    edx,DWORD PTR [ebp+16]
+        emit_pos += gen_emitbytes(3, 0x55, 0x89, 0xe5, 0);      // push ebp  / mov ebp, esp
+        emit_pos += gen_emitbytes(3, 0x52, 0x51, 0x53, 0);      // push edx / push ecx / push ebx
+        emit_pos += gen_emitbytes(2, 0x56, 0x57, 0, 0);         // push esi / push edi
+        emit_pos += gen_emitbytes(3, 0x8b, 0x5d, 0x08, 0);      // mov    ebx,DWORD PTR [ebp+8]     ; p
+        emit_pos += gen_emitbytes(3, 0x8b, 0x4d, 0x0c, 0);      // mov    ecx,DWORD PTR [ebp+12]    ; size
+        emit_pos += gen_emitbytes(3, 0x8b, 0x55, 0x10, 0);      // mov    edx,DWORD PTR [ebp+16]    ; new_size
+        emit_pos += gen_emitbyte(0xbe);
+        temp = 1;
+        emit_pos += gen_emitdword(temp);                        // mov    esi, MREMAP_MAYMOVE
         emit_pos += gen_emitbyte(0xb8);
+        temp = 163;
+        emit_pos += gen_emitdword(temp);                        // mov    eax, 163                  ; mremap
+        emit_pos += gen_emitbytes(2, 0x09, 0xdb, 0, 0);         // or     ebx,ebx
+        emit_pos += gen_emitbytes(2, 0x75, 0x1e, 0, 0);         // jne    +30
+        emit_pos += gen_emitbytes(2, 0x89, 0xd1, 0, 0);         // mov    ecx,edx                   ; length
+        emit_pos += gen_emitbyte(0xba);
         temp = 3;
-        emit_pos += gen_emitdword(temp);                            // mov    eax, 3
-        emit_pos += gen_emitbytes(2, 0xcd, 0x80, 0, 0);             // int    0x80      ; syscall
-        emit_pos += gen_emitbytes(3, 0x5b, 0x59, 0x5a, 0);          // pop ebx / pop ecx / pop edx
-        emit_pos += gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3);       // mov esp, ebp   / pop ebp  /  ret
+        emit_pos += gen_emitdword(temp);                        // mov    edx, PROT_READ | PROT_WRITE
+        emit_pos += gen_emitbyte(0xbe);
+        temp = 0x22;
+        emit_pos += gen_emitdword(temp);                        // mov    esi, MAP_PRIVATE | MAP_ANONYMOUS
+        emit_pos += gen_emitbyte(0xbf);
+        temp = -1;
+        emit_pos += gen_emitdword(temp);                        // mov    edi, -1                   ; no fd
+        emit_pos += gen_emitbytes(3, 0x55, 0x31, 0xed, 0);      // push ebp / xor ebp,ebp           ; page offset
+        emit_pos += gen_emitbyte(0xb8);
+        temp = 192;
+        emit_pos += gen_emitdword(temp);                        // mov    eax, 192                  ; mmap2
+        emit_pos += gen_emitbytes(3, 0xcd, 0x80, 0x5d, 0);      // int    0x80 / pop ebp
+        emit_pos += gen_emitbytes(2, 0xeb, 0x02, 0, 0);         // jmp    +2
+        emit_pos += gen_emitbytes(2, 0xcd, 0x80, 0, 0);         // int    0x80                      ; mremap
+        emit_pos += gen_emitbyte(0x3d);
+        temp = -4096;
+        emit_pos += gen_emitdword(temp);                        // cmp    eax, 0xfffff000
+        emit_pos += gen_emitbytes(4, 0x76, 0x02, 0x31, 0xc0);   // jbe +2 / xor eax,eax             ; -errno
+        emit_pos += gen_emitbytes(2, 0x5f, 0x5e, 0, 0);         // pop edi / pop esi
+        emit_pos += gen_emitbytes(3, 0x5b, 0x59, 0x5a, 0);      // pop ebx / pop ecx / pop edx
+        emit_pos += gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3);   // mov esp, ebp   / pop ebp  /  ret
+    }
+
+    symidx = parse_lookup_symbol("_sys_pwrite");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        // int _sys_pwrite(int fd, char *s, int n, int offset)
+        int temp;
+
+        symbol_address[symidx] = emit_pos;
+
+        emit_pos += gen_emitbytes(3, 0x55, 0x89, 0xe5, 0);      // push ebp  / mov ebp, esp
+        emit_pos += gen_emitbytes(3, 0x52, 0x51, 0x53, 0);      // push edx / push ecx / push ebx
+        emit_pos += gen_emitbytes(2, 0x56, 0x57, 0, 0);         // push esi / push edi
+        emit_pos += gen_emitbytes(3, 0x8b, 0x5d, 0x08, 0);      // mov    ebx,DWORD PTR [ebp+8]
+        emit_pos += gen_emitbytes(3, 0x8b, 0x4d, 0x0c, 0);      // mov    ecx,DWORD PTR [ebp+12]
+        emit_pos += gen_emitbytes(3, 0x8b, 0x55, 0x10, 0);      // mov    edx,DWORD PTR [ebp+16]
+        emit_pos += gen_emitbytes(3, 0x8b, 0x75, 0x14, 0);      // mov    esi,DWORD PTR [ebp+20]    ; offset
+        emit_pos += gen_emitbytes(2, 0x31, 0xff, 0, 0);         // xor    edi,edi                   ; offset high
+        emit_pos += gen_emitbyte(0xb8);
+        temp = 181;
+        emit_pos += gen_emitdword(temp);                        // mov    eax, 181                  ; pwrite64
+        emit_pos += gen_emitbytes(2, 0xcd, 0x80, 0, 0);         // int    0x80
+        emit_pos += gen_emitbytes(2, 0x5f, 0x5e, 0, 0);         // pop edi / pop esi
+        emit_pos += gen_emitbytes(3, 0x5b, 0x59, 0x5a, 0);      // pop ebx / pop ecx / pop edx
+        emit_pos += gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3);   // mov esp, ebp   / pop ebp  /  ret
     }
 }
 
+int gen_code_offset(void)
+{
+    return 0x80;
+}
+
 void gen_write_binary(char *emit_buffer, int emit_pos, char *string_table_buffer, int string_table_size)
 {
     int n;
     int e_shoff, code_size;
-    int string_base, e_entry;
+    int string_base, e_entry, bss_base;
 
     e_entry = 0x400080;
     n = 0;
     code_size = emit_pos + string_table_size;
     e_shoff = 0x80 + code_size + 28;
     e_shoff += (16 - e_shoff%16);
+    bss_base = (e_entry + code_size + 0xfff) & ~0xfff;  // the page after the code
 
-    n += write_elf_header(e_entry, e_shoff, 2, 4);
-    n += write_elf_ph(0x80, e_entry, code_size, 0x10000+0x80, PF_R+PF_X, 16);
-    n += write_elf_ph(0x80, 0x413000, 0, 0x800000, PF_R+PF_W, 16);
+    n += write_elf_header(ET_EXEC, e_entry, e_shoff, 2, 4);
+    n += write_elf_ph(0x80, e_entry, code_size, code_size, PF_R+PF_X, 16);
+    n += write_elf_ph(0x80, bss_base, 0, 0x800000, PF_R+PF_W, 16);
     n += gen_write_pad(16-n%16);
 
     string_base = e_entry + code_size - string_table_size;
-    gen_backpatching(string_base, 0, 0x413000);
-
-    n += _sys_write(1, emit_buffer, emit_pos);
-    n += _sys_write(1, string_table_buffer, string_table_size);
-    n += _sys_write(1, "\0.shstrtab", 10);
-    n += _sys_write(1, "\0.text", 6);
-    n += _sys_write(1, "\0.bss", 5);
-    n += _sys_write(1, "\0.data\0", 7);
+    gen_backpatching(string_base, 0, bss_base);
+
+    n += gen_image_code(emit_buffer, emit_pos);
+    n += gen_image_bytes(string_table_buffer, string_table_size);
+    n += gen_image_bytes("\0.shstrtab", 10);
+    n += gen_image_bytes("\0.text", 6);
+    n += gen_image_bytes("\0.bss", 5);
+    n += gen_image_bytes("\0.data\0", 7);
     n += gen_write_pad(16-n%16);
     n += gen_write_pad(40);
-    n += write_elf_sh(11, SHT_PROGBITS, SHF_EXECINSTR+SHF_ALLOC, e_entry, 0x80, code_size, 16);  // .text
-    n += write_elf_sh(17, SHT_NOBITS, SHF_ALLOC+SHF_WRITE, 0x413000, 0x80, 0x800000, 16); // .bss
-    n += write_elf_sh(1, SHT_STRTAB, 0, 0, 0x80+code_size, 28, 1); // .shstrtab
+    n += write_elf_sh(11, SHT_PROGBITS, SHF_EXECINSTR+SHF_ALLOC, e_entry, 0x80, code_size, 0, 0, 16, 0);  // .text
+    n += write_elf_sh(17, SHT_NOBITS, SHF_ALLOC+SHF_WRITE, bss_base, 0x80, 0x800000, 0, 0, 16, 0); // .bss
+    n += write_elf_sh(1, SHT_STRTAB, 0, 0, 0x80+code_size, 28, 0, 0, 1, 0); // .shstrtab
+}
+
+int gen_write_object(char *emit_buffer, int emit_pos, char *string_table_buffer, int string_table_size,
+                     int *object_name, int *object_kind, int *object_value, int object_count,
+                     int *backpatch, int *backpatch_type, int *backpatch_symbol, int backpatch_count)
+{
+    // sections: .text, .rodata (the string table), .rel.text, .symtab, .strtab and .shstrtab.
+    // symbol 1 and 2 are the section symbols of .text and .rodata, the global ones follow.
+    int n, i, name;
+    int rel_offset, symtab_offset, strtab_offset, strtab_size, shstrtab_offset, e_shoff;
+
+    strtab_size = 1;
+    i = 0;
+    while (i < object_count)
+        strtab_size += elf_strlen(parse_name(object_name[i++])) + 1;
+
+    rel_offset = 0x40 + emit_pos + string_table_size;
+    rel_offset += (4 - rel_offset%4) % 4;
+    symtab_offset = rel_offset + 8 * backpatch_count;
+    strtab_offset = symtab_offset + 16 * (3 + object_count);
+    shstrtab_offset = strtab_offset + strtab_size;
+    e_shoff = shstrtab_offset + 51;
+    e_shoff += (16 - e_shoff%16) % 16;
+
+    n = write_elf_header(ET_REL, 0, e_shoff, 0, 7);
+    n += gen_write_pad(0x40 - n);
+    n += gen_image_bytes(emit_buffer, emit_pos);
+    n += gen_image_bytes(string_table_buffer, string_table_size);
+    n += gen_write_pad(rel_offset - n);
+
+    i = 0;
+    while (i < backpatch_count) {
+        n += gen_image_dword(backpatch[i]);     // r_offset
+        if (backpatch_type[i] == OBJ_CALL)      // r_info
+            n += gen_image_dword(((3 + backpatch_symbol[i]) << 8) + R_386_PC32);
+        else if (backpatch_type[i] == OBJ_DATA)
+            n += gen_image_dword(((3 + backpatch_symbol[i]) << 8) + R_386_32);
+        else
+            n += gen_image_dword((2 << 8) + R_386_32);
+        ++i;
+    }
+
+    n += write_elf_sym(0, 0, 0, 0, SHN_UNDEF);
+    n += write_elf_sym(0, 0, 0, STT_SECTION, 1);
+    n += write_elf_sym(0, 0, 0, STT_SECTION, 2);
+    name = 1;
+    i = 0;
+    while (i < object_count) {
+        if (object_kind[i] == OBJ_FUNCTION)
+            n += write_elf_sym(name, object_value[i], 0, STB_GLOBAL+STT_FUNC, 1);
+        else if (object_kind[i] == OBJ_COMMON)
+            n += write_elf_sym(name, 4, object_value[i], STB_GLOBAL+STT_OBJECT, SHN_COMMON);
+        else
+            n += write_elf_sym(name, 0, 0, STB_GLOBAL, SHN_UNDEF);
+        name += elf_strlen(parse_name(object_name[i])) + 1;
+        ++i;
+    }
+
+    n += gen_write_pad(1);
+    i = 0;
+    while (i < object_count) {
+        n += gen_image_bytes(parse_name(object_name[i]), elf_strlen(parse_name(object_name[i])) + 1);
+        ++i;
+    }
+    n += gen_image_bytes("\0.text\0.rodata\0.rel.text\0.symtab\0.strtab\0.shstrtab\0", 51);
+    n += gen_write_pad(e_shoff - n);
+
+    n += gen_write_pad(40);
+    n += write_elf_sh(1, SHT_PROGBITS, SHF_EXECINSTR+SHF_ALLOC, 0, 0x40, emit_pos, 0, 0, 1, 0);  // .text
+    n += write_elf_sh(7, SHT_PROGBITS, SHF_ALLOC, 0, 0x40+emit_pos, string_table_size, 0, 0, 1, 0);  // .rodata
+    n += write_elf_sh(15, SHT_REL, 0, 0, rel_offset, 8 * backpatch_count, 4, 1, 4, 8);  // .rel.text
+    n += write_elf_sh(25, SHT_SYMTAB, 0, 0, symtab_offset, 16 * (3 + object_count), 5, 3, 4, 16);  // .symtab
+    n += write_elf_sh(33, SHT_STRTAB, 0, 0, strtab_offset, strtab_size, 0, 0, 1, 0);  // .strtab
+    n += write_elf_sh(41, SHT_STRTAB, 0, 0, shstrtab_offset, 51, 0, 0, 1, 0);  // .shstrtab
+
+    return 0;
+}
+
+int elf_section(char *object, char *name)
+{
+    // index of the named section, 0 if there is none
+    int e_shoff, e_shnum, shstrtab, i;
+
+    e_shoff = gen_read_dword_from_buffer(object, 0x20);
+    e_shnum = gen_read_dword_from_buffer(object, 0x30) & 0xffff;
+    shstrtab = e_shoff + 40 * (gen_read_dword_from_buffer(object, 0x32) & 0xffff);
+    shstrtab = gen_read_dword_from_buffer(object, shstrtab + 16);
+
+    i = 1;
+    while (i < e_shnum) {
+        if (streq(object + shstrtab + gen_read_dword_from_buffer(object, e_shoff + 40 * i), name))
+            return i;
+        ++i;
+    }
+    return 0;
+}
+
+int gen_read_object(char *object, int size)
+{
+    // hands code, symbols and relocations of an object written by gen_write_object to the linker
+    int e_shoff, text, rodata, symtab, strtab, rel, sh, i, count;
+    int sym, info, shndx, type;
+
+    if (size < 0x34 || gen_read_dword_from_buffer(object, 0) != 0x464c457f)
+        return -1;
+    if (gen_read_dword_from_buffer(object, 0x10) != 0x00030000 + ET_REL)  // e_type and e_machine
+        return -1;
+
+    e_shoff = gen_read_dword_from_buffer(object, 0x20);
+    text = elf_section(object, ".text");
+    rodata = elf_section(object, ".rodata");
+    symtab = elf_section(object, ".symtab");
+    rel = elf_section(object, ".rel.text");
+    if (text == 0 || symtab == 0)
+        return -1;
+
+    sh = e_shoff + 40 * text;
+    if (rodata == 0)
+        link_add_code(object + gen_read_dword_from_buffer(object, sh + 16), gen_read_dword_from_buffer(object, sh + 20), object, 0);
+    else {
+        i = e_shoff + 40 * rodata;
+        link_add_code(object + gen_read_dword_from_buffer(object, sh + 16), gen_read_dword_from_buffer(object, sh + 20),
+                      object + gen_read_dword_from_buffer(object, i + 16), gen_read_dword_from_buffer(object, i + 20));
+    }
+
+    sh = e_shoff + 40 * symtab;
+    strtab = e_shoff + 40 * gen_read_dword_from_buffer(object, sh + 24);
+    strtab = gen_read_dword_from_buffer(object, strtab + 16);
+    symtab = gen_read_dword_from_buffer(object, sh + 16);
+    count = gen_read_dword_from_buffer(object, sh + 20) / 16;
+
+    // global symbols: functions in .text, common variables and undefined ones
+    i = 1;
+    while (i < count) {
+        sym = symtab + 16 * i;
+        info = object[sym + 12] & 0xff;
+        shndx = (gen_read_dword_from_buffer(object, sym + 12) >> 16) & 0xffff;
+        if (info & STB_GLOBAL) {
+            if (shndx == SHN_UNDEF)
+                link_add_symbol(object + strtab + gen_read_dword_from_buffer(object, sym), OBJ_UNDEFINED, 0);
+            else if (shndx == SHN_COMMON)
+                link_add_symbol(object + strtab + gen_read_dword_from_buffer(object, sym), OBJ_COMMON, gen_read_dword_from_buffer(object, sym + 8));
+            else if (shndx == text)
+                link_add_symbol(object + strtab + gen_read_dword_from_buffer(object, sym), OBJ_FUNCTION, gen_read_dword_from_buffer(object, sym + 4));
+            else
+                return -1;
+        }
+        ++i;
+    }
+
+    if (rel == 0)
+        return 0;
+
+    sh = e_shoff + 40 * rel;
+    i = gen_read_dword_from_buffer(object, sh + 16);
+    count = i + gen_read_dword_from_buffer(object, sh + 20);
+    while (i < count) {
+        info = gen_read_dword_from_buffer(object, i + 4);
+        type = info & 0xff;
+        sym = symtab + 16 * (info >> 8);
+        shndx = (gen_read_dword_from_buffer(object, sym + 12) >> 16) & 0xffff;
+        if ((object[sym + 12] & 0xf) == STT_SECTION) {
+            if (shndx != rodata || type != R_386_32)
+                return -1;
+            link_add_relocation(OBJ_STRING, gen_read_dword_from_buffer(object, i), 0);
+        }
+        else if (type == R_386_PC32)
+            link_add_relocation(OBJ_CALL, gen_read_dword_from_buffer(object, i), object + strtab + gen_read_dword_from_buffer(object, sym));
+        else if (type == R_386_32)
+            link_add_relocation(OBJ_DATA, gen_read_dword_from_buffer(object, i), object + strtab + gen_read_dword_from_buffer(object, sym));
+        else
+            return -1;
+        i += 8;
+    }
+    return 0;
+}
+
+int gen_push_args(void)
+{
+    // the kernel leaves argc and argv on the stack: pass them on to main
+    int n;
+
+    n = gen_emitbytes(3, 0x8b, 0x04, 0x24, 0);              // mov    eax,DWORD PTR [esp]
+    n += gen_emitbytes(4, 0x8d, 0x4c, 0x24, 0x04);          // lea    ecx,[esp+4]
+    n += gen_emitbytes(2, 0x51, 0x50, 0, 0);                // push ecx / push eax
+    return n;
 }
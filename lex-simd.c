@@ -0,0 +1,50 @@
+// vectorized scanning kernels for the gcc built compiler. nanocc.c has the
+// scalar versions that the self-hosted compiler uses; both return the offset
+// of the first stop char in s[0..n), or n. loads never go past s+n, which
+// may be the end of the memory mapped source file.
+
+#include "nanocc-itf.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VEC_SIZE 32
+typedef __m256i vec;
+#define vec_splat(c)  _mm256_set1_epi8(c)
+#define vec_load(p)   _mm256_loadu_si256((const __m256i *) (p))
+#define vec_eq(a, b)  _mm256_cmpeq_epi8(a, b)
+#define vec_or(a, b)  _mm256_or_si256(a, b)
+#define vec_mask(a)   ((unsigned) _mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC_SIZE 16
+typedef __m128i vec;
+#define vec_splat(c)  _mm_set1_epi8(c)
+#define vec_load(p)   _mm_loadu_si128((const __m128i *) (p))
+#define vec_eq(a, b)  _mm_cmpeq_epi8(a, b)
+#define vec_or(a, b)  _mm_or_si128(a, b)
+#define vec_mask(a)   ((unsigned) _mm_movemask_epi8(a))
+#endif
+
+static int scan3(const char *s, int n, char c1, char c2, char c3)
+{
+    int i = 0;
+
+#ifdef VEC_SIZE
+    vec v1 = vec_splat(c1), v2 = vec_splat(c2), v3 = vec_splat(c3);
+
+    for (; i + VEC_SIZE <= n; i += VEC_SIZE) {
+        vec x = vec_load(s + i);
+        unsigned m = vec_mask(vec_or(vec_or(vec_eq(x, v1), vec_eq(x, v2)), vec_eq(x, v3)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+#endif
+    // tail, or the whole run on hosts without SSE2
+    while (i < n && s[i] != c1 && s[i] != c2 && s[i] != c3)
+        ++i;
+    return i;
+}
+
+int lex_scan_line(char *s, int n)              { return scan3(s, n, '\n', 0, 0); }
+int lex_scan_comment(char *s, int n)           { return scan3(s, n, '*', '\n', 0); }
+int lex_scan_string(char *s, int n, int delim) { return scan3(s, n, delim, '\\', 0); }
@@ -0,0 +1,111 @@
+// libnanocc: nanocc.c built with NANOCC_LIB, where the compiler state is
+// thread local and parse_error comes back here instead of ending the process
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libnanocc.h"
+
+struct nanocc_context {
+    char *image;
+    int image_size;
+    int error;
+    int line;
+};
+
+// nanocc.c
+extern __thread char *image_buffer;
+extern __thread int image_size, compile_error, compile_quiet, lineno;
+void compile_init(void);
+void compile_source(int object);
+void lex_open_memory(char *source, int size);
+void pp_close_files(void);
+void compile_free(void);
+
+static __thread jmp_buf compile_exit;
+
+// the tables of a thread are freed when it ends, by the destructor of this key
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread int thread_key_set;
+
+static void thread_end(void *unused)
+{
+    nanocc_thread_cleanup();
+}
+
+static void thread_key_create(void)
+{
+    pthread_key_create(&thread_key, thread_end);
+}
+
+void nanocc_thread_cleanup(void)
+{
+    compile_free();
+}
+
+int nanocc_lib_exit(int code)
+{
+    longjmp(compile_exit, 1);
+}
+
+nanocc_context *nanocc_create(void)
+{
+    return calloc(1, sizeof(nanocc_context));
+}
+
+void nanocc_destroy(nanocc_context *ctx)
+{
+    if (ctx) {
+        nanocc_reset(ctx);
+        free(ctx);
+    }
+}
+
+void nanocc_reset(nanocc_context *ctx)
+{
+    free(ctx->image);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int nanocc_compile(nanocc_context *ctx, const char *source, int size, int flags)
+{
+    nanocc_reset(ctx);
+    if (!thread_key_set) {
+        pthread_once(&thread_key_once, thread_key_create);
+        pthread_setspecific(thread_key, ctx);  // any value but 0 runs the destructor
+        thread_key_set = 1;
+    }
+
+    if (setjmp(compile_exit) == 0) {
+        compile_init();
+        compile_quiet = 1;
+        lex_open_memory((char *) source, size);
+        compile_source(flags & NANOCC_OBJECT);
+
+        ctx->image = malloc(image_size);
+        if (ctx->image == 0)
+            return ctx->error = -1;
+        memcpy(ctx->image, image_buffer, image_size);
+        ctx->image_size = image_size;
+        return 0;
+    }
+
+    // an error: the included files that were being read are unmapped now
+    pp_close_files();
+    ctx->error = compile_error;
+    ctx->line = lineno;
+    return ctx->error;
+}
+
+const char *nanocc_image(nanocc_context *ctx, int *size)
+{
+    *size = ctx->image_size;
+    return ctx->image;
+}
+
+int nanocc_error_line(nanocc_context *ctx)
+{
+    return ctx->line;
+}
@@ -0,0 +1,34 @@
+#ifndef _LIBNANOCC_H
+#define _LIBNANOCC_H
+
+// the compiler as a library. a context holds the result of one compile;
+// the compiler state itself belongs to the calling thread, so several
+// threads can compile at the same time, each with its own contexts.
+
+typedef struct nanocc_context nanocc_context;
+
+enum NanoccFlags {
+    NANOCC_OBJECT = 1  // relocatable object instead of an executable, like nanocc -c
+};
+
+nanocc_context *nanocc_create(void);
+void nanocc_destroy(nanocc_context *ctx);
+
+// compile size bytes of source: 0 or the error code of nanocc.c, see
+// nanocc_error_line() for where it happened, -1 when out of memory
+int nanocc_compile(nanocc_context *ctx, const char *source, int size, int flags);
+
+// the executable or object file of the last compile, valid until the
+// next compile or reset of the context
+const char *nanocc_image(nanocc_context *ctx, int *size);
+int nanocc_error_line(nanocc_context *ctx);
+
+// drop the image and the error of the last compile
+void nanocc_reset(nanocc_context *ctx);
+
+// free the compiler tables of the calling thread. this happens by itself when
+// a thread that compiled ends, call it to get the memory back earlier. the
+// thread can compile again afterwards
+void nanocc_thread_cleanup(void);
+
+#endif
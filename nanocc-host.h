@@ -0,0 +1,65 @@
+#ifndef _NANOCC_HOST_H
+#define _NANOCC_HOST_H
+
+// host implementations of the _sys_ primitives that have no direct
+// counterpart in the C library. nanocc generated executables get
+// them from gen_library() instead.
+
+#include <string.h>
+
+#ifdef _MSC_VER
+
+static char *host_mmap(int fd, int size) { return 0; }  // not supported: read in chunks
+static int host_munmap(char *p, int size) { return 0; }
+
+static int host_write(int fd, char *buf, int n)
+{
+    setmode(fd, _O_BINARY);  // no 0xa->0xd 0xa conv
+    return write(fd, buf, n);
+}
+
+static int host_pwrite(int fd, char *buf, int n, int offset)
+{
+    lseek(fd, offset, SEEK_SET);
+    return host_write(fd, buf, n);
+}
+
+static int host_open(char *path, int flags, int mode)
+{
+    if (flags != 0)
+        flags = _O_WRONLY | _O_CREAT | _O_TRUNC;  // the linux flags nanocc passes
+    return open(path, flags | _O_BINARY, mode);
+}
+
+// no fork: -j compiles serially
+static int host_fork(void) { return -1; }
+static int host_pipe(int *fds) { return -1; }
+static int host_waitpid(int pid, int *status, int options) { return -1; }
+
+#else
+#include <sys/mman.h>
+
+static char *host_mmap(int fd, int size)
+{
+    char *p;
+
+    p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    return p;
+}
+
+static int host_munmap(char *p, int size) { return munmap(p, size); }
+#endif
+
+static void *host_realloc(void *p, int size, int new_size)
+{
+    char *q;
+
+    q = realloc(p, new_size);
+    if (q != 0)
+        memset(q + size, 0, new_size - size);
+    return q;
+}
+
+#endif
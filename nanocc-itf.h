@@ -4,15 +4,55 @@
 int _sys_read(int fd, char *buf, int count);
 int _sys_write(int fd, char *s, int n);
 int _sys_exit(int code);
+int _sys_lseek(int fd, int offset, int whence);
+char *_sys_mmap(int fd, int size);
+int _sys_munmap(char *p, int size);
+int _sys_pwrite(int fd, char *s, int n, int offset);
+int _sys_open(char *path, int flags, int mode);
+int _sys_close(int fd);
+int _sys_fork(void);
+int _sys_pipe(int *fds);
+int _sys_waitpid(int pid, int *status, int options);
+void *_sys_realloc(void *p, int size, int new_size);  // new bytes are 0, 0: out of memory
+
+// kinds of object file symbols and relocations, see gen_object_tables()
+enum ObjectKind {
+    OBJ_UNDEFINED = 1,  // symbol of another object
+    OBJ_FUNCTION,       // value is the offset in the code
+    OBJ_COMMON,         // global variable, value is its size
+    OBJ_CALL,           // rel32 of a call
+    OBJ_DATA,           // address of a global variable plus the addend in place
+    OBJ_STRING          // address in the string table
+};
 
 int gen_write_pad(int count);
+int gen_image_bytes(char *s, int n);
+int gen_image_dword(int dword);
+int gen_image_code(char *code, int size);
+int gen_read_dword_from_buffer(char *buffer, int pos);
 void gen_backpatching(int string_base, int idata_base, int data_base);
 void gen_add_backpatch(int type, int offset);
 
 int parse_lookup_symbol(char *name);
+char *parse_name(int nameid);
+int streq(char *s, char *t);
+
+int lex_scan_line(char *s, int n);
+int lex_scan_comment(char *s, int n);
+int lex_scan_string(char *s, int n, int delim);
 
+int gen_code_offset(void);  // file offset of the code in an executable
 void gen_write_binary(char *emit_buffer, int emit_pos, char *string_table_buffer, int string_table_size);
-void gen_library(int emit_pos, char *symbol_name[], int *symbol_type, int *symbol_address, int symbol_count);
+void gen_library(int emit_pos, int *symbol_type, int *symbol_address, int symbol_count);
+int gen_push_args(void);
+int gen_write_object(char *emit_buffer, int emit_pos, char *string_table_buffer, int string_table_size,
+                     int *object_name, int *object_kind, int *object_value, int object_count,
+                     int *backpatch, int *backpatch_type, int *backpatch_symbol, int backpatch_count);
+int gen_read_object(char *object, int size);
+
+void link_add_code(char *code, int code_size, char *strings, int strings_size);
+void link_add_symbol(char *name, int kind, int value);
+void link_add_relocation(int kind, int offset, char *name);
 
 int gen_emitbyte(int byte);
 int gen_emitbytes(int count, int b1, int b2, int b3, int b4);
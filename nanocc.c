@@ -1,44 +1,111 @@
+#ifndef __NANOCC__
 #include <stdio.h>
 #include <stdlib.h>
+#endif
 
-// nanocc treats all # lines as comments
 #include "nanocc-itf.h"
-int _sys_read(int fd, char *buf, int count);
-int _sys_write(int fd, char *s, int n);
-int _sys_exit(int code);
-void gen_write_binary(char *emit_buffer, int emit_pos, char *string_table_buffer, int string_table_size);
-void gen_library(int emit_pos, char *symbol_name[], int *symbol_type, int *symbol_address, int symbol_count);
+void parse_error(int err);
+void parse_error_name(int err, char *name);
+int mystrlen(char *p);
 
+#ifndef __NANOCC__
+// host build: the _sys_ primitives come from the C library
 #ifdef _MSC_VER
 #include <io.h>
 #include <fcntl.h>
 #define ssize_t int
 #define _sys_read  read
-#define _sys_write(fd, buf, cnt) do { setmode(fd, _O_BINARY); /* no 0xa->0xd 0xa conv */ write(fd, buf, cnt); } while (0)
+#define _sys_write host_write
 #define _sys_exit  exit
+#define _sys_pwrite host_pwrite
+#define _sys_open  host_open
+#define _sys_close close
+#define _sys_fork  host_fork
+#define _sys_pipe  host_pipe
+#define _sys_waitpid host_waitpid
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #define _sys_read  read
 #define _sys_write write
 #define _sys_exit  exit
+#define _sys_pwrite pwrite
+#define _sys_open  open
+#define _sys_close close
+#define _sys_fork  fork
+#define _sys_pipe  pipe
+#define _sys_waitpid waitpid
+#endif
+#define _sys_lseek lseek
+#define _sys_mmap  host_mmap
+#define _sys_munmap host_munmap
+#define _sys_realloc host_realloc
+#include "nanocc-host.h"
+#endif
+
+#ifdef NANOCC_LIB
+// libnanocc.c: an error returns from nanocc_compile() instead of ending the process
+#undef  _sys_exit
+#define _sys_exit nanocc_lib_exit
+int nanocc_lib_exit(int code);
 #endif
 
 enum Sizes {
-    MAX_SYMBOLS             = 1024,
-    MAX_STRING_TABLE_BUFFER = 64*1024,
-    EMIT_BUFFER_SIZE        = 2*1024*1024,
-    EXPR_STACK_SIZE         = 128,
-    MAX_BACKPATCH           = 1024,
-    MAX_POSTFIX             = 10
+    INPUT_CHUNK_SIZE        = 64*1024,
+    MAX_JOBS                = 64,
+    MAX_EXPANSION           = 64,       // macros expanded within each other
+    MAX_INCLUDE             = 32,       // depth of nested includes
+    CACHE_MAGIC             = 0x3443436e, // "nCC4"
+    INLINE_TOKENS           = 48,       // the longest function body that is inlined
+    INLINE_NODES            = 16,       // and its expression tree
+    INLINE_SOURCE_SIZE      = 512,      // parallel compiles read ahead bodies up to this size only
+    INLINE_DEPTH            = 4         // inlined calls within each other
+};
+
+// first sizes of the growable tables, they double when they are full
+enum ArenaSizes {
+    SYMBOLS_INITIAL         = 1024,
+    NAMES_INITIAL           = 1024,      // power of 2, the name hash has twice as many slots
+    NAME_TEXT_INITIAL       = 16*1024,
+    STRINGS_INITIAL         = 16*1024,
+    BACKPATCH_INITIAL       = 1024,
+    LABELS_INITIAL          = 256,
+    STACK_INITIAL           = 64,        // the stack_ stacks of the expression parser
+    EXPR_NODES_INITIAL      = 256,
+    GEN_FRAMES_INITIAL      = 64,
+    GEN_VALUES_INITIAL      = 64,
+    INLINE_NODES_INITIAL    = 1024,
+    REPLAY_INITIAL          = 4*1024,    // tokens of a function body
+    REPLAY_TEXT_INITIAL     = 16*1024,
+    TOKEN_TEXT_INITIAL      = 256,
+    MACROS_INITIAL          = 64,
+    MACRO_TOKENS_INITIAL    = 256,
+    MACRO_TEXT_INITIAL      = 1024,      // string literals in macros
+    FILES_INITIAL           = 64,
+    FUNCTIONS_INITIAL       = 256,       // the cache and -j tables, one entry per function
+    CACHE_RELOCS_INITIAL    = 1024,
+    CACHE_SLOTS_INITIAL     = 1024,      // power of 2, twice as many as the entries of the cache file
+    PATH_TEXT_INITIAL       = 4*1024,
+    CODE_INITIAL            = 64*1024,
+    IMAGE_INITIAL           = 64*1024,
+    JOB_READ_SIZE           = 64*1024,   // room for each read from a worker
+    STREAM_FLUSH_SIZE       = 32*1024,   // streamed code is written out in pieces of about this size
+    ARENA_MAX               = 0x40000000
 };
 
+enum Whence { LSEEK_SET = 0, LSEEK_CUR = 1, LSEEK_END = 2 };
+enum OpenFlags { OPEN_READ = 0, OPEN_WRITE = 0x241 };  // O_WRONLY | O_CREAT | O_TRUNC
+
 enum Token {
     CHAR  = 1,
     INT, VOID, RETURN, IF, WHILE, CONTINUE, BREAK, ELSE, ENUM, DO, GOTO,
     IDENTIFIER  = 128,
     NUMBER, GE, EQ, RSH, NEQ, LOGAND, LOGOR, LSH, PLUSPLUS, PLUSASSIGN,
     MINUSASSIGN, MINUSMINUS, DIVASSIGN, MULASSIGN, ORASSIGN,
-    MODASSIGN, XORASSIGN, ANDASSIGN, LE, RSHASSIGN, LSHASSIGN, STRING, ARRAY_SUBSCRIPT
+    MODASSIGN, XORASSIGN, ANDASSIGN, LE, RSHASSIGN, LSHASSIGN, STRING, ARRAY_SUBSCRIPT,
+    EOL,  // end of a preprocessor directive
+    ARG_VALUE  // expression node: a parameter of an inlined function, see gen_inline_body
 };
 
 enum ErrorCode {
@@ -65,7 +132,31 @@ enum ErrorCode {
     E_EXPRESSION_NOT_CONST,
     E_CONTINUE_OUTSIDE_LOOP,
     E_BREAK_OUTSIDE_LOOP,
-    E_DO_MISSING_WHILE
+    E_DO_MISSING_WHILE,
+    E_WRITE_FAILED,
+    E_UNKNOWN_OPTION,
+    E_OPEN_FAILED,
+    E_BAD_OBJECT,
+    E_NO_OBJECT_FORMAT,
+    E_DUPLICATE_SYMBOL,
+    E_FUNCTION_TOO_LARGE,   // not used any more, the numbers after it stay
+    E_BAD_DIRECTIVE,
+    E_OUT_OF_MEMORY,
+    E_INCLUDE_TOO_DEEP
+};
+
+enum PpGroup { GROUP_ELSE = 1, GROUP_ELIF, GROUP_ENDIF };
+
+// include guard detection: the first directive of a file is #ifndef X and its #endif the last thing in it
+enum PpGuard { GUARD_NONE, GUARD_START, GUARD_INSIDE, GUARD_CLOSED };
+
+enum CharClass {
+    CC_SPACE    = 1,
+    CC_IDENT    = 2,   // letters and '_'
+    CC_DIGIT    = 4,
+    CC_HEXDIGIT = 8,
+    CC_OPERATOR = 16,  // first char of an operator that is one, two or three chars long
+    CC_BLOCK    = 32,  // matters when a block is skipped
 };
 
 enum TypeAttr {
@@ -78,42 +169,325 @@ enum TypeAttr {
     PARAM = 0x4000,
     FUNCTION = 0x8000,
     OPERATOR = 0x10000,
+    DEFINED = 0x20000,  // function with a body in this translation unit or link
 };
 
+#ifdef NANOCC_LIB
+// libnanocc.c: every thread compiles with a state of its own
+#define int  __thread int
+#define char __thread char
+#endif
+
+// source input: either the memory mapped file or a chunk refilled by _sys_read
+char *input_buffer;
+char *input_chunk;       // INPUT_CHUNK_SIZE bytes, allocated when standard input is read
+int  input_pos, input_size, input_mapped;
+
 // lexer variables
 int  current_char, previous_char;
 int  token_value;
-char token_text[256];
-int  token_text_len;
+char *token_text;        // text of the last string, char constant or identifier, see lex_reserve_text
+int  token_text_len, token_text_capacity;
+int  token_name;  // interned name of the last identifier
+
+// preprocessor: directives are handled where the lexer meets a '#', macros are replaced
+// by their tokens in lex_read_token
+int  pp_line_mode;                 // reading a directive: the end of the line is an EOL token
+int  pp_directives;                // directives handled so far
+int  pp_defines;                   // #define and #undef so far
+int  *pp_name_macro;               // 1 + macro of a name id (0: not defined), grows with the names
+int  *pp_macro_first;              // its tokens in pp_macro_token and pp_macro_value
+int  *pp_macro_count;
+int  *pp_macro_active;             // being expanded: not expanded again within itself
+int  pp_macros, pp_macro_capacity;
+int  *pp_macro_token;
+int  *pp_macro_value;              // token_value, token_name or offset into pp_macro_text
+int  pp_macro_tokens, pp_macro_token_capacity;
+char *pp_macro_text;
+int  pp_macro_text_size, pp_macro_text_capacity;
+int  pp_expand_macro[MAX_EXPANSION], pp_expand_pos[MAX_EXPANSION];
+int  pp_expand_depth;
+int  pp_cond_depth;                // open #if groups
+int  pp_if_token;                  // next token of an #if expression
+
+// source files, a file is mapped while it is read and unmapped at its end, see pp_read_file
+int  *pp_file_path;                // offset of the path in pp_path_text
+int  *pp_file_guard;               // name id of the macro guarding all of the file (0: none)
+int  *pp_file_once;                // #pragma once
+int  pp_files, pp_file_capacity;
+int  pp_file;                      // the file being read, -1: standard input or memory
+int  pp_unmap;                     // input_buffer is a mapping of that file
+char *pp_path_text;
+int  pp_path_text_size, pp_path_text_capacity;
+char *pp_read_buffer[MAX_INCLUDE + 1];  // files of each include depth on hosts that cannot map them
+int  pp_read_capacity[MAX_INCLUDE + 1];
+int  pp_guard, pp_guard_state, pp_guard_cond;  // include guard of the file being read
+
+// the files that include the one being read, innermost last
+char *pp_include_buffer[MAX_INCLUDE];
+int  pp_include_pos[MAX_INCLUDE], pp_include_size[MAX_INCLUDE], pp_include_mapped[MAX_INCLUDE];
+int  pp_include_unmap[MAX_INCLUDE];
+int  pp_include_file[MAX_INCLUDE], pp_include_line[MAX_INCLUDE], pp_include_cond[MAX_INCLUDE];
+int  pp_include_guard[MAX_INCLUDE], pp_include_guard_state[MAX_INCLUDE], pp_include_guard_cond[MAX_INCLUDE];
+int  pp_includes;
+
+// files named on the command line, read one after the other
+int  *pp_source;                   // offset of the path in pp_path_text
+int  pp_sources, pp_source_next, pp_source_capacity;
+
+// character classes and the operators starting with a char, filled in by lex_init
+char lex_class[256];
+char op_follow1[256], op_follow2[256];  // second char of the two char operators
+int  op_token1[256], op_token2[256];    // their tokens
+int  op_token3[256];                    // token of <<= and >>= (follow1 and then '=')
 int  lineno;
 int  pushed_token;
 
+// tokens of a function body read ahead, for the cache and the choice of the register
+// variables, and then handed to the parser again
+int  *replay_token;
+int  *replay_value;     // token_value, token_name or offset into replay_text
+int  *replay_line;
+char *replay_text;
+int  replay_count, replay_pos, replay_text_size, replay_lineno;
+int  replay_capacity, replay_text_capacity;
+
+// the tables below that are pointers are growable, see arena_grow. they may move when
+// they grow, so other tables refer into them by index and not by pointer.
+
 // strings and symbol names
-char string_table_buffer[MAX_STRING_TABLE_BUFFER]; // end up in the generated file
-int  string_table_size;
-char symbol_name_buffer[MAX_STRING_TABLE_BUFFER];  // only used during compilation
-int  symbol_name_buffer_size;
-
-// symbol table
-char *symbol_name[MAX_SYMBOLS];  // points into string buffer that holds the name of the symbol
-int  symbol_type[MAX_SYMBOLS];
-int  symbol_address[MAX_SYMBOLS];
-int  symbol_size[MAX_SYMBOLS];
-int  symbol_count;
+char *string_table_buffer;  // end up in the generated file
+int  string_table_size, string_table_capacity;
+char *symbol_name_buffer;   // only used during compilation, the empty name at offset 0
+int  symbol_name_buffer_size, symbol_name_buffer_capacity;
+
+// identifier names: each one is stored once and referred to by its id
+int  *name_hash;        // open addressing hash table of name ids (0: free slot), 2 * name_capacity slots
+int  *name_hash_value;
+int  *name_offset;      // into symbol_name_buffer, see parse_name
+int  *name_symbol;      // innermost visible symbol with that name (0: none)
+int  *name_label;       // goto label of the current function with that name (0: none)
+int  *name_register;    // register of a variable of the current function with that name (0: none),
+                        // the weighted number of uses while parse_choose_registers counts them
+int  name_count, name_capacity;
+
+// symbol table. it is a scope stack: the symbols of a block or a function are
+// popped when it ends, so slots above symbol_count are reused
+int  *symbol_name_id;
+int  *symbol_shadow;    // symbol of an outer scope hidden by this one
+int  *symbol_type;
+int  *symbol_address;
+int  *symbol_size;
+int  *symbol_register;  // ebx, esi or edi for a variable that lives in a register, 0: in memory
+int  *symbol_inline;    // a function that is inlined: its tree in inline_node, 0: none
+int  symbol_count, symbol_capacity;
 int  num_keywords;  // number of keywords in the symbol table
 
 // backpatching
-int  backpatch[MAX_BACKPATCH];
-int  backpatch_type[MAX_BACKPATCH];
-int  backpatch_count;
+int  *backpatch;
+int  *backpatch_type;
+int  *backpatch_symbol;  // relocations in object mode: index into object_name
+int  *backpatch_value;   // the dword in place, kept for the records of streamed code
+int  backpatch_count, backpatch_capacity, backpatch_kept;
+
+// branch labels of the current function, numbered from 1 (0: no label). every jump
+// leaves a fixup, resolved at the end of the function when the jumps are made short
+int  *label_address;     // -1: not placed yet
+int  *label_name;        // name id of a goto label, 0: loop or expression label
+int  label_count, label_capacity;
+int  *label_fixup;       // offset of the rel32
+int  *label_fixup_label;
+int  *label_fixup_op;    // opcode of the short form: 0xeb jmp or 0x70|cc
+int  *label_fixup_short; // 1: fits in a rel8, 2: a jmp to the next instruction, left out
+int  *label_fixup_removed;  // bytes the short jumps up to this one save
+int  label_fixups, label_fixup_capacity;
+int  relax_removed;      // bytes saved by short jumps
+
+// symbols of a relocatable object, see gen_object_tables. there are no more of them
+// than symbols, so they grow with the symbol table
+int  *object_name;       // name ids
+int  *object_kind;
+int  *object_value;
+int  object_count;
+int  *symbol_export;     // index into object_name
+
+// linking: the code and strings of the object that is read in follow the ones before
+int  link_code_base, link_string_base;
+
+// incremental compilation (-i file): functions whose tokens and referenced declarations
+// did not change are copied from the cache file instead of compiled again
+char *cache_path;
+char *cache_map;                     // the cache file of the previous build
+int  *cache_slot;                    // 1 + index into cache_old_entry, by key (0: free slot)
+int  *cache_old_entry;               // offsets of the entries in cache_map
+int  cache_old_count, cache_slot_capacity;
+int  cache_key1, cache_key2;
+int  *cache_new_key1;                // functions of this build, written to the new cache file
+int  *cache_new_key2;
+int  *cache_new_entry;               // 1 + offset of the entry to copy, 0: compiled in this process
+int  *cache_new_job;                 // that entry is in job_buffer, not in cache_map
+int  *cache_new_hit;
+int  *cache_new_code, *cache_new_code_size;
+int  *cache_new_string, *cache_new_string_size;
+int  *cache_new_reloc, *cache_new_reloc_count;
+int  *cache_new_name;                // name ids
+int  cache_new_count, cache_hits, cache_function_capacity;
+int  *cache_reloc_kind;              // OBJ_CALL, OBJ_DATA or OBJ_STRING
+int  *cache_reloc_offset;
+int  *cache_reloc_addend;
+int  *cache_reloc_name;              // name ids
+int  cache_reloc_count, cache_reloc_capacity;
+
+// parallel compilation (-j n): a forked scout reads the input once and notes where
+// the functions start, then forks workers that seek to every n-th function each,
+// compile it and hand the code to the parent as cache entries, together with the
+// input position after the body. the parent only parses the declarations then.
+int  job_count;                      // 0: serial
+int  job_scout, job_worker, job_index, job_next;
+int  job_pipe[2];
+int  job_fd[MAX_JOBS], job_write_fd[MAX_JOBS];
+int  job_header, job_header_line;    // where the function being parsed starts, -1: not for a worker
+int  job_header_declared, job_header_directives;
+int  job_bodies;                     // function bodies the scout found
+int  *job_begin;                     // by body: input position after the name, -1: the parent compiles it
+int  *job_begin_line;
+int  *job_stop;                      // input position after the body
+int  *job_begin_file;                // pp_file there
+int  *job_scope;                     // symbol_count before its parameters
+int  *job_symbol;
+int  *job_declared;
+int  *job_defines;                   // pp_defines there
+int  *job_ordinal;                   // by entry of a worker: its body
+int  job_file, job_file_size;        // the file a worker has open
+char *job_input;                     // standard input, mapped
+int  job_input_size;
+char *job_buffer;                    // what the workers sent
+int  job_buffer_capacity;
+int  job_start[MAX_JOBS + 1];
+int  *job_entry;                     // 1 + offset of the code of the n-th function in job_buffer, 0: the parent compiles it
+int  *job_end;                       // input position and line after the body
+int  *job_line;
+int  *job_hit;                       // the entry came from the cache file
 
 // parser data
 int  global_variable_space, local_variable_space;
-int  postfix_stack[1+2*MAX_POSTFIX];
+int  prec_level[512];   // operator precedence indexed by token, +256 for unary operators
+char prec_assoc[512];   // 1: right to left
+
+// the expression of the statement being compiled, reused by the next one. the nodes
+// have 4 integers each 0:type, 1:value, 2:child1, 3:child2; node 0 holds the root and
+// the next free node. children are always added before their parent
+int  *expr_table;
+int  expr_capacity;     // in nodes
+int  *operator_stack, *arg_stack;
+int  operator_capacity, arg_capacity;
+int  *branch_stack;     // gen_branch work list: node, label, jump_if
+int  branch_capacity;
+int  *reg_candidate;    // parse_choose_registers: the variables that may live in a register
+int  *reg_loop;         // and the brace depths of the loops around the token
+int  reg_candidate_capacity, reg_loop_capacity;
+int  reg_chosen[3];     // the names of the variables in ebx, esi and edi
+int  reg_chosen_count;
+
+// functions whose body is a single expression, see parse_record_inline. their trees have
+// 4 integers per node like expr_table, after a header node: root, node count, parameter count
+int  *inline_node;
+int  inline_node_count, inline_node_capacity;
+
+// gen_expr walks the expression tree with a stack of frames instead of recursion
+int  *gen_frames;       // FRAME_SIZE integers per frame, see enum GenFrame
+int  gen_frame_count, gen_frame_capacity;
+
+// the values gen_expr has computed and not used yet, bottom first. the lowest
+// gen_value_pushed of them are on the machine stack, the others in registers
+int  *gen_value_reg;    // the register of each value, -1: pushed
+int  gen_value_count, gen_value_pushed, gen_value_capacity;
+int  gen_reg_owner[8];  // the value in each register, -1: free, -2: taken by the current operation
+int  gen_reg_vars;      // the registers that hold variables of the current function
+int  gen_regs_used;     // all registers the current function writes, the callee-saved ones are saved
+int  gen_return_label;  // the epilog of the current function
+int  gen_inline_depth;  // inlined calls within each other
+int  gen_function;      // the function being compiled
+int  gen_body_label;    // the body of the current function after the prolog, where it calls itself
+int  gen_param_count;   // the parameters of the current function: room for a tail call's arguments
+int  gen_frame_escapes; // the address of a local variable or a parameter may be taken, see gen_is_tail_call
+int  *gen_tail_calls;   // stack of the code offsets where the tail calls restore the saved registers
+int  gen_tail_call_capacity;
+int  gen_mem_base, gen_mem_index;  // the registers of the memory operand being emitted
+int  gen_branch_cc;     // condition code of the compare a FOR_BRANCH expression ended with, -1: none
+
+// peephole window: the last load or push of gen_expr, which the push or pop right
+// after it can merge with. peep_end is where it ended, the window is gone when more
+// code follows
+int  peep_start, peep_end;
+int  peep_removed;      // bytes saved by the merges
+
+// resulting binary code. emit_pos is the offset in the code, emit_buffer holds the
+// code from emit_base on: when an executable is streamed, the code before it has been
+// written out already
+int  emit_pos, emit_base, emit_capacity;
+char *emit_buffer;
+int  emit_stream;        // the output fd when streaming, 0: the code stays in emit_buffer
+int  emit_file_start;    // file offset of the output when streaming
+int  emit_file_offset;   // file offset of the code when streaming
+
+// executable file image: headers, code and tables laid out by gen_write_binary
+char *image_buffer;
+int  image_size, image_capacity;
+int  image_offset;       // file offset of image_buffer relative to the start of the output
+
+// how the last compile ended: 0 or the error code, see parse_error
+int  compile_error;
+int  compile_quiet;  // no error message, the caller reports it
+
+#ifdef NANOCC_LIB
+#undef int
+#undef char
+#endif
+
+void *arena_grow(void *p, int size, int new_size)
+{
+    // a table of size bytes moved to new_size bytes, the new ones are 0
+    p = _sys_realloc(p, size, new_size);
+    if (p == 0)
+        parse_error(E_OUT_OF_MEMORY);
+    return p;
+}
+
+int arena_size(int size, int need, int initial)
+{
+    // the size a table grows to for need entries: doubling keeps the copying linear
+    if (size == 0)
+        size = initial;
+    while (size < need) {
+        if (size >= ARENA_MAX)
+            parse_error(E_OUT_OF_MEMORY);
+        size = size * 2;
+    }
+    return size;
+}
+
+void gen_reserve_code(int n)
+{
+    int size;
+
+    if (emit_pos - emit_base + n <= emit_capacity)
+        return;
+    size = arena_size(emit_capacity, emit_pos - emit_base + n, CODE_INITIAL);
+    emit_buffer = arena_grow(emit_buffer, emit_capacity, size);
+    emit_capacity = size;
+}
+
+void gen_reserve_image(int n)
+{
+    int size;
 
-// resulting binary code
-int  emit_pos;
-char emit_buffer[EMIT_BUFFER_SIZE];
+    if (image_size + n <= image_capacity)
+        return;
+    size = arena_size(image_capacity, image_size + n, IMAGE_INITIAL);
+    image_buffer = arena_grow(image_buffer, image_capacity, size);
+    image_capacity = size;
+}
 
 void gen_write_dword_into_buffer(char *buffer, int pos, int dword)
 {
@@ -135,23 +509,350 @@ int gen_read_dword_from_buffer(char *buffer, int pos)
     return value;
 }
 
+void gen_patch_code(int offset, int dword)
+{
+    gen_write_dword_into_buffer(emit_buffer, offset - emit_base, dword);
+}
+
+int gen_read_code(int offset)
+{
+    return gen_read_dword_from_buffer(emit_buffer, offset - emit_base);
+}
+
 void gen_add_backpatch(int type, int offset)
 {
+    int size;
+
+    if (backpatch_count == backpatch_capacity) {
+        size = arena_size(backpatch_capacity, backpatch_count + 1, BACKPATCH_INITIAL);
+        backpatch = arena_grow(backpatch, 4 * backpatch_capacity, 4 * size);
+        backpatch_type = arena_grow(backpatch_type, 4 * backpatch_capacity, 4 * size);
+        backpatch_symbol = arena_grow(backpatch_symbol, 4 * backpatch_capacity, 4 * size);
+        backpatch_value = arena_grow(backpatch_value, 4 * backpatch_capacity, 4 * size);
+        backpatch_capacity = size;
+    }
     backpatch[backpatch_count] = offset;
     backpatch_type[backpatch_count] = type;
     ++backpatch_count;
 }
 
+void gen_add_global_backpatch(int offset, int symidx)
+{
+    // remember the variable as well, for relocations
+    gen_add_backpatch(GLOBAL, offset);
+    backpatch_symbol[backpatch_count - 1] = symidx;
+}
+
+void gen_backpatch_local(int first)
+{
+    int i, n, offset, symidx;
+
+    // calls of defined functions get their final value now, only the other
+    // records stay for gen_backpatching
+    i = first;
+    n = first;
+    while (i < backpatch_count) {
+        offset = backpatch[i];
+        symidx = gen_read_code(offset);
+        if (backpatch_type[i] == 0 && (symbol_type[symidx] & DEFINED))
+            gen_patch_code(offset, symbol_address[symidx] - (offset + 4));
+        else {
+            backpatch[n] = offset;
+            backpatch_type[n] = backpatch_type[i];
+            backpatch_symbol[n] = backpatch_symbol[i];
+            ++n;
+        }
+        ++i;
+    }
+    backpatch_count = n;
+}
+
+int gen_new_label(int nameid)
+{
+    int size;
+
+    if (label_count + 1 >= label_capacity) {
+        size = arena_size(label_capacity, label_count + 2, LABELS_INITIAL);
+        label_address = arena_grow(label_address, 4 * label_capacity, 4 * size);
+        label_name = arena_grow(label_name, 4 * label_capacity, 4 * size);
+        label_capacity = size;
+    }
+    ++label_count;
+    label_address[label_count] = -1;
+    label_name[label_count] = nameid;
+    return label_count;
+}
+
+void gen_peep_barrier(void)
+{
+    peep_start = -1;  // emit_pos is a jump target: the code before it stays as it is
+}
+
+void gen_place_label(int label)
+{
+    if (label_address[label] >= 0)
+        parse_error(E_DUPLICATE_SYMBOL);  // goto label defined twice
+    label_address[label] = emit_pos;
+    gen_peep_barrier();
+}
+
+void gen_emitlabel(int label)
+{
+    int size;
+
+    // the rel32 of the jump just emitted. gen_resolve_labels fills it in
+    if (label_fixups == label_fixup_capacity) {
+        size = arena_size(label_fixup_capacity, label_fixups + 1, LABELS_INITIAL);
+        label_fixup = arena_grow(label_fixup, 4 * label_fixup_capacity, 4 * size);
+        label_fixup_label = arena_grow(label_fixup_label, 4 * label_fixup_capacity, 4 * size);
+        label_fixup_op = arena_grow(label_fixup_op, 4 * label_fixup_capacity, 4 * size);
+        label_fixup_short = arena_grow(label_fixup_short, 4 * label_fixup_capacity, 4 * size);
+        label_fixup_removed = arena_grow(label_fixup_removed, 4 * label_fixup_capacity, 4 * size);
+        label_fixup_capacity = size;
+    }
+    label_fixup[label_fixups] = emit_pos;
+    label_fixup_label[label_fixups] = label;
+    label_fixup_op[label_fixups] = 0xeb;                      // e9: jmp
+    if ((emit_buffer[emit_pos - 1 - emit_base] & 0xff) != 0xe9)
+        label_fixup_op[label_fixups] = 0x70 | (emit_buffer[emit_pos - 1 - emit_base] & 0x0f);  // 0f 8x: jcc
+    label_fixup_short[label_fixups] = 0;
+    ++label_fixups;
+    gen_emitdword(0);
+}
+
+int gen_jump_start(int i)
+{
+    if (label_fixup_op[i] == 0xeb)
+        return label_fixup[i] - 1;
+    return label_fixup[i] - 2;
+}
+
+int gen_jump_size(int i)
+{
+    if (label_fixup_short[i] == 2)
+        return 0;
+    if (label_fixup_short[i])
+        return 2;
+    if (label_fixup_op[i] == 0xeb)
+        return 5;
+    return 6;
+}
+
+int gen_relaxed_offset(int offset)
+{
+    int lo, hi, mid;
+
+    // where offset moves to: the jumps that start below it save label_fixup_removed
+    lo = 0;
+    hi = label_fixups;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (gen_jump_start(mid) < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return offset;
+    return offset - label_fixup_removed[lo - 1];
+}
+
+void gen_relax_jumps(void)
+{
+    int i, changed, removed, src, dst, start, disp;
+
+    // a jump is made short when its target is within a byte, and a short jmp to the
+    // next instruction goes away. all start long, and a shorter jump only brings the
+    // others closer, so the rounds end when none changes
+    changed = 1;
+    while (changed) {
+        changed = 0;
+        removed = 0;
+        i = 0;
+        while (i < label_fixups) {
+            if (label_fixup_short[i])
+                removed += label_fixup[i] + 4 - gen_jump_start(i) - gen_jump_size(i);  // 5 or 6 bytes become 2 or 0
+            label_fixup_removed[i] = removed;
+            ++i;
+        }
+
+        i = 0;
+        while (i < label_fixups) {
+            disp = gen_relaxed_offset(label_address[label_fixup_label[i]]) - (gen_relaxed_offset(gen_jump_start(i)) + 2);
+            if (!label_fixup_short[i] && disp >= -128 && disp < 128) {
+                label_fixup_short[i] = 1;
+                changed = 1;
+            }
+            else if (label_fixup_short[i] == 1 && disp == 0 && label_fixup_op[i] == 0xeb) {
+                label_fixup_short[i] = 2;
+                changed = 1;
+            }
+            ++i;
+        }
+    }
+
+    // move the code between the jumps down and write the jumps in their final form
+    if (label_fixups == 0)
+        return;
+    src = gen_jump_start(0);
+    dst = src;
+    i = 0;
+    while (i <= label_fixups) {
+        start = emit_pos;
+        if (i < label_fixups)
+            start = gen_jump_start(i);
+        while (src < start)
+            emit_buffer[dst++ - emit_base] = emit_buffer[src++ - emit_base];
+        if (i < label_fixups) {
+            disp = gen_relaxed_offset(label_address[label_fixup_label[i]]) - (dst + gen_jump_size(i));
+            if (label_fixup_short[i] == 2)
+                ;
+            else if (label_fixup_short[i]) {
+                emit_buffer[dst - emit_base] = label_fixup_op[i];   // jmp or jcc rel8
+                emit_buffer[dst + 1 - emit_base] = disp;
+            }
+            else if (label_fixup_op[i] == 0xeb) {
+                emit_buffer[dst - emit_base] = 0xe9;                // jmp rel32
+                gen_write_dword_into_buffer(emit_buffer, dst + 1 - emit_base, disp);
+            }
+            else {
+                emit_buffer[dst - emit_base] = 0x0f;                // jcc rel32
+                emit_buffer[dst + 1 - emit_base] = label_fixup_op[i] + 0x10;
+                gen_write_dword_into_buffer(emit_buffer, dst + 2 - emit_base, disp);
+            }
+            src = label_fixup[i] + 4;
+            dst = dst + gen_jump_size(i);
+        }
+        ++i;
+    }
+
+    // the calls, strings and variables of the function are the last backpatch records
+    i = backpatch_count - 1;
+    while (i >= 0 && backpatch[i] > gen_jump_start(0)) {
+        backpatch[i] = gen_relaxed_offset(backpatch[i]);
+        --i;
+    }
+    relax_removed += emit_pos - dst;
+    emit_pos = dst;
+    gen_peep_barrier();
+}
+
+void gen_resolve_labels(void)
+{
+    int i, label;
+
+    // a goto label may not be placed, loop labels always are
+    i = 0;
+    while (i < label_fixups) {
+        label = label_fixup_label[i];
+        if (label_address[label] < 0) {
+            parse_error_name(E_UNDEFINED_IDENTIFIER, parse_name(label_name[label]));
+        }
+        ++i;
+    }
+    gen_relax_jumps();
+
+    // the labels go with the function
+    while (label_count > 0) {
+        name_label[label_name[label_count]] = 0;
+        --label_count;
+    }
+    label_fixups = 0;
+}
+
+void gen_insert_code(int pos, int n)
+{
+    int i;
+
+    // room for n bytes at pos in the code of the current function: what comes after
+    // moves up, with its labels, jumps and backpatches
+    gen_reserve_code(n);
+    i = emit_pos;
+    while (i > pos) {
+        --i;
+        emit_buffer[i + n - emit_base] = emit_buffer[i - emit_base];
+    }
+    emit_pos += n;
+    i = 1;
+    while (i <= label_count) {
+        if (label_address[i] >= pos)
+            label_address[i] += n;
+        ++i;
+    }
+    i = 0;
+    while (i < label_fixups) {
+        if (label_fixup[i] >= pos)
+            label_fixup[i] += n;
+        ++i;
+    }
+    i = backpatch_count - 1;
+    while (i >= 0 && backpatch[i] >= pos) {
+        backpatch[i] += n;
+        --i;
+    }
+    gen_peep_barrier();
+}
+
+void gen_write_at(int fd, char *s, int n, int offset)
+{
+    int done, k;
+
+    // offset < 0: fd is not seekable, write in sequence
+    done = 0;
+    while (done < n) {
+        if (offset >= 0)
+            k = _sys_pwrite(fd, s + done, n - done, offset + done);
+        else
+            k = _sys_write(fd, s + done, n - done);
+        if (k <= 0)
+            parse_error(E_WRITE_FAILED);
+        done += k;
+    }
+}
+
+void gen_stream_code(int fd)
+{
+    int start;
+
+    // write the code of the executable to fd as it is compiled instead of keeping all
+    // of it in emit_buffer. gen_write_binary puts the header in front of it at the end
+    start = _sys_lseek(fd, 0, LSEEK_CUR);
+    if (start < 0)
+        return;  // not seekable
+    emit_stream = fd;
+    emit_file_start = start;
+    emit_file_offset = start + gen_code_offset();
+}
+
+void gen_flush_code(void)
+{
+    // between two functions: the code so far only changes through its backpatch
+    // records any more. keep their values and write the code out
+    if (emit_stream == 0 || emit_pos - emit_base < STREAM_FLUSH_SIZE)
+        return;
+    while (backpatch_kept < backpatch_count) {
+        backpatch_value[backpatch_kept] = gen_read_code(backpatch[backpatch_kept]);
+        ++backpatch_kept;
+    }
+    gen_write_at(emit_stream, emit_buffer, emit_pos - emit_base, emit_file_offset + emit_base);
+    emit_base = emit_pos;
+}
+
 void gen_backpatching(int string_base, int idata_base, int data_base)
 {
     int i;
+    char buffer[4];
 
+    // the records of streamed code are patched in the output file
     i = 0;
     while (i < backpatch_count) {
         int offset, value;
 
         offset = backpatch[i];
-        value = gen_read_dword_from_buffer(emit_buffer, offset);
+        if (i < backpatch_kept)
+            value = backpatch_value[i];
+        else
+            value = gen_read_code(offset);
         if (backpatch_type[i] == STRING)
             value += string_base;
         else if (backpatch_type[i] == GLOBAL)
@@ -160,21 +861,86 @@ void gen_backpatching(int string_base, int idata_base, int data_base)
             value += idata_base;
         else
             value = symbol_address[value] - (offset + 4);
-        gen_write_dword_into_buffer(emit_buffer, offset, value);
+        if (i < backpatch_kept) {
+            gen_write_dword_into_buffer(buffer, 0, value);
+            gen_write_at(emit_stream, buffer, 4, emit_file_offset + offset);
+        }
+        else
+            gen_patch_code(offset, value);
         ++i;
     }
 }
 
+void pp_read_file(int file);
+int pp_add_file(int path);
+
+void lex_open_file(int path)
+{
+    // a source file, path is an offset into pp_path_text
+    pp_read_file(pp_add_file(path));
+}
+
+void lex_open_input(void)
+{
+    int start, size;
+
+    // the files named on the command line one after the other, or standard input
+    if (pp_sources > 0) {
+        pp_source_next = 1;
+        lex_open_file(pp_source[0]);
+        return;
+    }
+
+    if (input_chunk == 0)
+        input_chunk = arena_grow(0, 0, INPUT_CHUNK_SIZE);
+    input_buffer = input_chunk;
+    input_pos = 0;
+    input_size = 0;
+    input_mapped = 0;
+
+    // a regular file can be seeked: map it as a whole instead of reading it
+    start = _sys_lseek(0, 0, LSEEK_CUR);
+    if (start < 0)
+        return;
+
+    size = _sys_lseek(0, 0, LSEEK_END);
+    if (size > start) {
+        input_buffer = _sys_mmap(0, size);
+        if (input_buffer) {
+            input_pos = start;
+            input_size = size;
+            input_mapped = 1;
+            return;
+        }
+        input_buffer = input_chunk;
+    }
+    _sys_lseek(0, start, LSEEK_SET);
+}
+
+void lex_open_memory(char *source, int size)
+{
+    // the source is in memory already, as if it was mapped
+    input_buffer = source;
+    input_pos = 0;
+    input_size = size;
+    input_mapped = 1;
+}
+
 int lex_readchar(void)
 {
-    char buffer[4];
-    int rc;
+    if (input_pos >= input_size) {
+        if (input_mapped)
+            return 0;
 
-    rc = _sys_read(0, buffer, 1);
-    if (rc)
-        return buffer[0];
+        input_pos = 0;
+        input_size = _sys_read(0, input_buffer, INPUT_CHUNK_SIZE);
+        if (input_size <= 0) {
+            input_size = 0;
+            return 0;
+        }
+    }
 
-    return 0;
+    return input_buffer[input_pos++];
 }
 
 int lex_shift()
@@ -193,6 +959,74 @@ int lex_shift()
 
 void lex_clear(void) { lex_shift(); previous_char = 0; } // no memory of previous char
 
+#ifndef NANOCC_SIMD
+// scanning kernels: return the offset of the first stop char in s[0..n), or n.
+// a gcc build links the vectorized versions from lex-simd.c instead.
+int lex_scan_line(char *s, int n)
+{
+    int i;
+
+    i = 0;
+    while (i < n && s[i] != '\n' && s[i] != 0)
+        ++i;
+    return i;
+}
+
+int lex_scan_comment(char *s, int n)
+{
+    int i;
+
+    i = 0;
+    while (i < n && s[i] != '*' && s[i] != '\n' && s[i] != 0)
+        ++i;
+    return i;
+}
+
+int lex_scan_string(char *s, int n, int delim)
+{
+    int i;
+
+    i = 0;
+    while (i < n && s[i] != delim && s[i] != '\\' && s[i] != 0)
+        ++i;
+    return i;
+}
+#endif
+
+void lex_skip_line(void)
+{
+    // skip to the end of a single line comment
+    while (1) {
+        input_pos += lex_scan_line(input_buffer + input_pos, input_size - input_pos);
+        current_char = lex_readchar();
+        if (current_char == 0)
+            break;
+        if (current_char == 10) {
+            ++lineno;
+            break;
+        }
+    }
+    lex_clear();
+}
+
+void lex_skip_comment(void)
+{
+    // skip to the end of a /* */ comment
+    while (1) {
+        input_pos += lex_scan_comment(input_buffer + input_pos, input_size - input_pos);
+        current_char = lex_readchar();
+        if (current_char == 0)
+            break;
+        if (current_char == 10)
+            ++lineno;
+        else if (current_char == '*') {
+            current_char = lex_readchar();
+            if (current_char == '/')
+                break;
+        }
+    }
+}
+
 int streq(char *s, char *t)
 {
     if (!s || !t) {
@@ -205,25 +1039,95 @@ int streq(char *s, char *t)
     return *s == *t;
 }
 
-int parse_lookup_symbol(char *name)
+int parse_hash_name(char *s)
 {
-    int symidx;
+    int h;
 
-    // need to search from bottom to top in order to find most recently added symbol first
-    symidx = symbol_count - 1;
-    while (symidx >= 0) {
-        if (streq(name, symbol_name[symidx]))
-            return symidx;
+    h = 0;
+    while (*s)
+        h = (h * 33 + *s++) & 0xffffff;
+    return h;
+}
+
+int parse_add_symbol_name(char *s);
+
+char *parse_name(int nameid)
+{
+    return symbol_name_buffer + name_offset[nameid];
+}
 
-        --symidx;
+void parse_grow_names(void)
+{
+    int size, slot, nameid;
+
+    // the tables indexed by name id, and the hash table rebuilt with twice as many slots
+    size = arena_size(name_capacity, name_count + 2, NAMES_INITIAL);
+    name_hash_value = arena_grow(name_hash_value, 4 * name_capacity, 4 * size);
+    name_offset = arena_grow(name_offset, 4 * name_capacity, 4 * size);
+    name_symbol = arena_grow(name_symbol, 4 * name_capacity, 4 * size);
+    name_label = arena_grow(name_label, 4 * name_capacity, 4 * size);
+    name_register = arena_grow(name_register, 4 * name_capacity, 4 * size);
+    pp_name_macro = arena_grow(pp_name_macro, 4 * name_capacity, 4 * size);
+    name_hash = arena_grow(name_hash, 8 * name_capacity, 8 * size);
+    name_capacity = size;
+
+    slot = 0;
+    while (slot < 2 * name_capacity)
+        name_hash[slot++] = 0;
+    nameid = 1;
+    while (nameid <= name_count) {
+        slot = name_hash_value[nameid] & (2 * name_capacity - 1);
+        while (name_hash[slot] != 0)
+            slot = (slot + 1) & (2 * name_capacity - 1);
+        name_hash[slot] = nameid;
+        ++nameid;
     }
+}
 
-    return 0;
+int parse_intern_name(char *name)
+{
+    int h, slot, nameid;
+
+    if (*name == 0)
+        return 0;  // id 0 is the empty name of internal labels
+
+    if (name_count + 1 >= name_capacity)
+        parse_grow_names();
+
+    h = parse_hash_name(name);
+    slot = h & (2 * name_capacity - 1);
+    while ((nameid = name_hash[slot]) != 0) {
+        if (name_hash_value[nameid] == h && streq(name, parse_name(nameid)))
+            return nameid;
+        slot = (slot + 1) & (2 * name_capacity - 1);
+    }
+
+    nameid = ++name_count;
+    name_hash[slot] = nameid;
+    name_hash_value[nameid] = h;
+    name_offset[nameid] = parse_add_symbol_name(name);
+    return nameid;
+}
+
+int parse_lookup_name(int nameid)
+{
+    return name_symbol[nameid];
+}
+
+int parse_lookup_symbol(char *name)
+{
+    return parse_lookup_name(parse_intern_name(name));
 }
 
 int parse_add_string(char *s, int len)
 {
-    int stridx;
+    int stridx, size;
+
+    if (string_table_size + len > string_table_capacity) {
+        size = arena_size(string_table_capacity, string_table_size + len, STRINGS_INITIAL);
+        string_table_buffer = arena_grow(string_table_buffer, string_table_capacity, size);
+        string_table_capacity = size;
+    }
     stridx = string_table_size;
 
     while (len > 0) {
@@ -235,7 +1139,14 @@ int parse_add_string(char *s, int len)
 
 int parse_add_symbol_name(char *s)
 {
-    int stridx;
+    int stridx, size;
+
+    size = symbol_name_buffer_size + mystrlen(s) + 1;
+    if (size > symbol_name_buffer_capacity) {
+        size = arena_size(symbol_name_buffer_capacity, size, NAME_TEXT_INITIAL);
+        symbol_name_buffer = arena_grow(symbol_name_buffer, symbol_name_buffer_capacity, size);
+        symbol_name_buffer_capacity = size;
+    }
     stridx = symbol_name_buffer_size;
     while ((symbol_name_buffer[symbol_name_buffer_size++] = *s++))
         ;
@@ -244,69 +1155,155 @@ int parse_add_symbol_name(char *s)
 
 // void trace(char *msg, int num);
 
-int parse_add_internal_label(void)
+void parse_grow_symbols(void)
 {
-    // same as parse_add_symbol just without name
-    return symbol_count++;
+    int size, old;
+
+    // the symbol table and the object symbols
+    size = arena_size(symbol_capacity, symbol_count + 1, SYMBOLS_INITIAL);
+    old = 4 * symbol_capacity;
+    symbol_name_id = arena_grow(symbol_name_id, old, 4 * size);
+    symbol_shadow = arena_grow(symbol_shadow, old, 4 * size);
+    symbol_type = arena_grow(symbol_type, old, 4 * size);
+    symbol_address = arena_grow(symbol_address, old, 4 * size);
+    symbol_size = arena_grow(symbol_size, old, 4 * size);
+    symbol_register = arena_grow(symbol_register, old, 4 * size);
+    symbol_inline = arena_grow(symbol_inline, old, 4 * size);
+    symbol_export = arena_grow(symbol_export, old, 4 * size);
+    object_name = arena_grow(object_name, old, 4 * size);
+    object_kind = arena_grow(object_kind, old, 4 * size);
+    object_value = arena_grow(object_value, old, 4 * size);
+    symbol_capacity = size;
 }
 
-int parse_add_symbol(char *name)
+int parse_bind_name(int nameid)
 {
-    int stridx, symidx;
-
-    stridx = parse_add_symbol_name(name);
-    symidx = parse_add_internal_label();
+    int symidx;
 
-    symbol_name[symidx] = &symbol_name_buffer[stridx];
+    if (symbol_count == symbol_capacity)
+        parse_grow_symbols();
+    symidx = symbol_count++;
+
+    // the slot may have been used by a symbol of a scope that has ended
+    symbol_name_id[symidx] = nameid;
+    symbol_shadow[symidx] = 0;
+    symbol_type[symidx] = 0;
+    symbol_address[symidx] = 0;
+    symbol_size[symidx] = 0;
+    symbol_register[symidx] = 0;
+    symbol_inline[symidx] = 0;
+    symbol_export[symidx] = 0;
+
+    // the new symbol hides any other symbol with the same name until it goes out of scope
+    if (nameid != 0) {
+        symbol_shadow[symidx] = name_symbol[nameid];
+        name_symbol[nameid] = symidx;
+    }
 
     return symidx;
 }
 
-int lex_optriple(int s0, int s1, int s2, int v0, int v1, int v2, int v3)
+int parse_add_symbol(char *name)
 {
-    int rc;
+    return parse_bind_name(parse_intern_name(name));
+}
 
-    current_char = lex_readchar();
-    if (current_char == s1) {
-        current_char = lex_readchar();
-        if (current_char == s2) {
-            lex_clear();
-            rc = v2;
-        }
-        else {
-            lex_shift();
-            rc = v1;
-        }
-    }
-    else if (current_char == s2) {
-        lex_clear();
-        rc = v3;
-    }
-    else {
-        lex_shift();
-        rc = v0;
+void parse_pop_scope(int symidx_old)
+{
+    int nameid;
+
+    // the symbols of a scope are the innermost ones with their names: uncover
+    // the hidden ones, latest first, and give the slots back
+    while (symbol_count > symidx_old) {
+        --symbol_count;
+        nameid = symbol_name_id[symbol_count];
+        if (nameid != 0)
+            name_symbol[nameid] = symbol_shadow[symbol_count];
     }
+}
 
-    if (rc < 0)
-        rc = rc * -1;
-    return rc;
+int parse_goto_label(int nameid)
+{
+    // goto labels are visible in the whole function, before they are placed too
+    if (name_label[nameid] == 0)
+        name_label[nameid] = gen_new_label(nameid);
+    return name_label[nameid];
+}
+
+void lex_set_class(int from, int to, int cls)
+{
+    while (from <= to)
+        lex_class[from++] |= cls;
+}
+
+void lex_set_operator(int c, int follow1, int token1, int follow2, int token2, int token3)
+{
+    lex_class[c] = CC_OPERATOR;
+    op_follow1[c] = follow1;
+    op_token1[c] = token1;
+    op_follow2[c] = follow2;
+    op_token2[c] = token2;
+    op_token3[c] = token3;
 }
 
-int lex_opdouble(int s0, int s1, int s2, int v0, int v1, int v2)
+void lex_init(void)
+{
+    lex_set_class(' ', ' ', CC_SPACE);
+    lex_set_class('\t', '\t', CC_SPACE);
+    lex_set_class('\r', '\r', CC_SPACE);
+    lex_set_class('\n', '\n', CC_SPACE);
+    lex_set_class('a', 'z', CC_IDENT);
+    lex_set_class('A', 'Z', CC_IDENT);
+    lex_set_class('_', '_', CC_IDENT);
+    lex_set_class('0', '9', CC_DIGIT | CC_HEXDIGIT);
+    lex_set_class('a', 'f', CC_HEXDIGIT);
+    lex_set_class('A', 'F', CC_HEXDIGIT);
+
+    lex_set_operator('>', '>', RSH, '=', GE, RSHASSIGN);
+    lex_set_operator('<', '<', LSH, '=', LE, LSHASSIGN);
+    lex_set_operator('+', '+', PLUSPLUS, '=', PLUSASSIGN, 0);
+    lex_set_operator('-', '-', MINUSMINUS, '=', MINUSASSIGN, 0);
+    lex_set_operator('*', '=', MULASSIGN, 0, 0, 0);
+    lex_set_operator('=', '=', EQ, 0, 0, 0);
+    lex_set_operator('!', '=', NEQ, 0, 0, 0);
+    lex_set_operator('|', '|', LOGOR, '=', ORASSIGN, 0);
+    lex_set_operator('%', '=', MODASSIGN, 0, 0, 0);
+    lex_set_operator('^', '=', XORASSIGN, 0, 0, 0);
+    lex_set_operator('&', '&', LOGAND, '=', ANDASSIGN, 0);
+
+    lex_set_class(0, 0, CC_BLOCK);
+    lex_set_class('{', '{', CC_BLOCK);
+    lex_set_class('}', '}', CC_BLOCK);
+    lex_set_class('"', '"', CC_BLOCK);
+    lex_set_class('\'', '\'', CC_BLOCK);
+    lex_set_class('/', '/', CC_BLOCK);
+    lex_set_class('#', '#', CC_BLOCK);
+    lex_set_class('\n', '\n', CC_BLOCK);
+}
+
+int lex_operator(int c)
 {
     current_char = lex_readchar();
-    if (current_char == s1) {
+    if (current_char == op_follow1[c]) {
+        if (op_token3[c] != 0) {
+            current_char = lex_readchar();
+            if (current_char == '=') {
+                lex_clear();
+                return op_token3[c];
+            }
+            lex_shift();
+            return op_token1[c];
+        }
         lex_clear();
-        return v1;
+        return op_token1[c];
     }
-    else if (v2 != 0 && current_char == s2) {
+    else if (op_follow2[c] != 0 && current_char == op_follow2[c]) {
         lex_clear();
-        return v2;
-    }
-    else {
-        lex_shift();
-        return v0;
+        return op_token2[c];
     }
+
+    lex_shift();
+    return c;
 }
 
 void lex_push_token(int tok)
@@ -315,84 +1312,92 @@ void lex_push_token(int tok)
     pushed_token = tok;
 }
 
-int lex_next_token(void)
+int pp_end_file(void);
+void pp_directive(void);
+
+void lex_reserve_text(int need)
 {
-    if (pushed_token) {
-        int tok;
-        tok = pushed_token;
-        pushed_token = 0;
-        return tok;
-    }
+    int size;
+
+    // room for need chars in token_text, a token may be as long as the input
+    if (need <= token_text_capacity)
+        return;
+    size = arena_size(token_text_capacity, need, TOKEN_TEXT_INITIAL);
+    token_text = arena_grow(token_text, token_text_capacity, size);
+    token_text_capacity = size;
+}
 
+int lex_read_raw_token(void)
+{
     while (1) {
+        int cls;
+
         if (previous_char != 0)
             current_char = lex_shift();
         else
             current_char = lex_readchar();
 
-        if (current_char == 0)
+        if (current_char == 0) {
+            if (pp_line_mode)
+                return EOL;
+            if (job_worker)
+                return 0;  // the end of a function body, see job_compile
+            if (pp_end_file())
+                continue;
             return 0;
+        }
 
-        if (current_char == ' ' || current_char == '\t' || current_char == '\r' || current_char == '\n') {
-            if (current_char == 10)
+        cls = lex_class[current_char & 0xff];
+        if (cls & CC_SPACE) {
+            if (current_char == 10) {
                 ++lineno;
+                if (pp_line_mode)
+                    return EOL;
+            }
             continue;
         }
 
-        if (current_char == '>')      return lex_optriple('>', '>', '=', '>', RSH, RSHASSIGN, GE);
-        else if (current_char == '<') return lex_optriple('<', '<', '=', '<', LSH, LSHASSIGN, LE);
-        else if (current_char == '+') return lex_opdouble('+', '+', '=', '+', PLUSPLUS, PLUSASSIGN);
-        else if (current_char == '-') return lex_opdouble('-', '-', '=', '-', MINUSMINUS, MINUSASSIGN);
-        else if (current_char == '*') return lex_opdouble('*', '=', 0, '*', MULASSIGN, 0);
-        else if (current_char == '=') return lex_opdouble('=', '=', 0, '=', EQ, 0);
-        else if (current_char == '!') return lex_opdouble('!', '=', 0, '!', NEQ, 0);
-        else if (current_char == '|') return lex_opdouble('|', '|', '=', '|', LOGOR, ORASSIGN);
-        else if (current_char == '%') return lex_opdouble('%', '=', 0, '%', MODASSIGN, 0);
-        else if (current_char == '^') return lex_opdouble('^', '=', 0, '^', XORASSIGN, 0);
-        else if (current_char == '&') return lex_opdouble('&', '&', '=', '&', LOGAND, ANDASSIGN);
-        else if (current_char == '#') {
-            // single line comment
-            while ((current_char = lex_readchar())) {
-                if (current_char == 10) {
-                    ++lineno;
-                    break;
-                }
-            }
+        if (cls & CC_OPERATOR)
+            return lex_operator(current_char);
+        else if (cls & CC_IDENT) {
+            int i;
+            // keywords and identifiers
+
+            i = 0;
+            do {
+                if (i + 2 > token_text_capacity)
+                    lex_reserve_text(i + 2);  // the char and the nul
+                token_text[i++] = current_char;
+                current_char = lex_readchar();
+            } while (lex_class[current_char & 0xff] & (CC_IDENT | CC_DIGIT));
+            token_text[i] = '\0';
+            lex_shift();
+            token_name = parse_intern_name(token_text);
+            i = parse_lookup_name(token_name);
+            if (i != 0 && i < num_keywords)
+                return i;
+            return IDENTIFIER;
+        }
+        else if (current_char == '#' && !pp_line_mode) {
             lex_clear();
+            pp_directive();
             continue;
         }
         else if (current_char == '/') {
             current_char = lex_readchar();
 
             if (current_char == '/') {
-                // single line comment
-                while ((current_char = lex_readchar())) {
-                    if (current_char == 10) {
-                        ++lineno;
-                        break;
-                    }
-                }
-                lex_clear();
+                lex_skip_line();
+                if (pp_line_mode)
+                    return EOL;
                 continue;
             }
             else if (current_char == '=') {
                 lex_clear();
                 return DIVASSIGN;
             }
-            else if (current_char == '*') {
-                // comment
-                while ((current_char = lex_readchar())) {
-                    if (current_char == 10)
-                        ++lineno;
-
-                    if (current_char != '*')
-                        continue;
-
-                    current_char = lex_readchar();
-                    if (current_char == '/')
-                        break;
-                }
-            }
+            else if (current_char == '*')
+                lex_skip_comment();
             else {
                 lex_shift();
                 return '/';
@@ -405,8 +1410,19 @@ int lex_next_token(void)
             delim = current_char;
 
             i = 0;
-            current_char = lex_readchar();
-            while (current_char != '\0' && current_char != delim) {
+            while (1) {
+                int n;
+
+                // copy the plain run of chars up to the next quote or escape
+                n = lex_scan_string(input_buffer + input_pos, input_size - input_pos, delim);
+                lex_reserve_text(i + n + 2);  // and an escaped char or the nul
+                while (n-- > 0)
+                    token_text[i++] = input_buffer[input_pos++];
+
+                current_char = lex_readchar();
+                if (current_char == '\0' || current_char == delim)
+                    break;
+
                 if (current_char == '\\') {
                     // escape characters
                     current_char = lex_readchar();
@@ -431,7 +1447,6 @@ int lex_next_token(void)
                         current_char = 0x9;
                 }
                 token_text[i++] = current_char;
-                current_char = lex_readchar();
             }
             token_text[i] = '\0';
             lex_clear();
@@ -444,26 +1459,10 @@ int lex_next_token(void)
                 return STRING;
             }
         }
-        else if ((current_char >= 'a' && current_char <= 'z') || (current_char >= 'A' && current_char <= 'Z') || (current_char == '_')) {
-            int i;
-            // keywords and identifiers
-
-            i = 0;
-            do {
-                token_text[i++] = current_char;
-                current_char = lex_readchar();
-            } while ((current_char >= 'a' && current_char <= 'z') || (current_char >= 'A' && current_char <= 'Z') || (current_char == '_') || (current_char >= '0' && current_char <= '9'));
-            token_text[i] = '\0';
-            lex_shift();
-            i = parse_lookup_symbol(token_text);
-            if (i != 0 && i < num_keywords)
-                return i;
-            return IDENTIFIER;
-        }
-        else if (current_char >= '1' && current_char <= '9') {
+        else if ((cls & CC_DIGIT) && current_char != '0') {
             // decimal numbers
             token_value = 0;
-            while (current_char >= '0' && current_char <= '9') {
+            while (lex_class[current_char & 0xff] & CC_DIGIT) {
                 token_value *= 10;
                 token_value += (current_char & 0xf) + (9 * (current_char >> 6));
                 current_char = lex_readchar();
@@ -479,7 +1478,7 @@ int lex_next_token(void)
                 current_char = lex_readchar();
 
                 token_value = 0;
-                while ((current_char >= '0' && current_char <= '9') || (current_char >= 'A' && current_char <= 'F') || (current_char >= 'a' && current_char <= 'f')) {
+                while (lex_class[current_char & 0xff] & CC_HEXDIGIT) {
                     token_value <<= 4;
                     token_value += (current_char & 0xf) + (9 * (current_char >> 6));
                     current_char = lex_readchar();
@@ -503,964 +1502,3260 @@ int lex_next_token(void)
 
             ch = current_char;
             lex_clear();
+            if (ch == '\\' && pp_line_mode) {
+                // the directive goes on in the next line
+                current_char = lex_readchar();
+                if (current_char == 13)
+                    current_char = lex_readchar();
+                if (current_char == 10) {
+                    ++lineno;
+                    continue;
+                }
+                lex_shift();
+            }
             return ch;
         }
     }
 }
 
-
-int mystrlen(char *p)
+int pp_add_path(char *path)
 {
-    int n;
-    n = 0;
-    while (*p++)
-        ++n;
-
-    return n;
+    int size, n, i;
+
+    // a copy of path in pp_path_text, the offset of it
+    n = mystrlen(path) + 1;
+    if (pp_path_text_size + n > pp_path_text_capacity) {
+        size = arena_size(pp_path_text_capacity, pp_path_text_size + n, PATH_TEXT_INITIAL);
+        pp_path_text = arena_grow(pp_path_text, pp_path_text_capacity, size);
+        pp_path_text_capacity = size;
+    }
+    i = 0;
+    while (i < n) {
+        pp_path_text[pp_path_text_size + i] = path[i];
+        ++i;
+    }
+    pp_path_text_size += n;
+    return pp_path_text_size - n;
 }
 
-void reverse(char *buffer)
+int pp_add_file(int path)
 {
-    int n, i;
-    char temp;
+    int size, old;
+
+    // a new entry in the file table
+    if (pp_files == pp_file_capacity) {
+        size = arena_size(pp_file_capacity, pp_files + 1, FILES_INITIAL);
+        old = 4 * pp_file_capacity;
+        pp_file_path = arena_grow(pp_file_path, old, 4 * size);
+        pp_file_guard = arena_grow(pp_file_guard, old, 4 * size);
+        pp_file_once = arena_grow(pp_file_once, old, 4 * size);
+        pp_file_capacity = size;
+    }
+    pp_file_path[pp_files] = path;
+    pp_file_guard[pp_files] = 0;
+    pp_file_once[pp_files] = 0;
+    return pp_files++;
+}
 
-    n = mystrlen(buffer);
-    i = 0;
+void pp_add_source(char *path)
+{
+    int size;
 
-    while (--n > i) {
-        temp = buffer[i];
-        buffer[i] = buffer[n];
-        buffer[n] = temp;
-        ++i;
+    // a file named on the command line
+    if (pp_sources == pp_source_capacity) {
+        size = arena_size(pp_source_capacity, pp_sources + 1, FILES_INITIAL);
+        pp_source = arena_grow(pp_source, 4 * pp_source_capacity, 4 * size);
+        pp_source_capacity = size;
     }
+    pp_source[pp_sources++] = pp_add_path(path);
 }
 
-void myitoa(char *buffer, int n, int value)
+void pp_release_file(void)
 {
-    int i, x;
+    // unmap the file being read, at its end or after an error
+    if (pp_unmap)
+        _sys_munmap(input_buffer, input_size);
+    pp_unmap = 0;
+}
 
-    i = 0;
+void pp_close_files(void)
+{
+    int n;
 
-    if (value == 0) {
-        buffer[i++] = '0';
+    // the files still open after an error
+    pp_release_file();
+    while (pp_includes > 0) {
+        n = --pp_includes;
+        if (pp_include_unmap[n])
+            _sys_munmap(pp_include_buffer[n], pp_include_size[n]);
     }
-    else {
-        while (value > 0) {
-            x = value % 10;
-            buffer[i++] = '0' + x;
-            value /= 10;
+}
+
+void pp_read_file(int file)
+{
+    int fd, size, n, capacity;
+    char *path, *text;
+
+    // map the file, or read it into the buffer of its include depth on hosts that cannot map it
+    path = &pp_path_text[pp_file_path[file]];
+    fd = _sys_open(path, OPEN_READ, 0);
+    if (fd < 0)
+        parse_error_name(E_OPEN_FAILED, path);
+
+    text = 0;
+    size = _sys_lseek(fd, 0, LSEEK_END);
+    if (size > 0) {
+        text = _sys_mmap(fd, size);
+        if (text == 0)
+            _sys_lseek(fd, 0, LSEEK_SET);
+    }
+    pp_unmap = text != 0;
+    if (text == 0) {
+        text = pp_read_buffer[pp_includes];
+        capacity = pp_read_capacity[pp_includes];
+        size = 0;
+        n = 1;
+        while (n > 0) {
+            if (capacity - size < INPUT_CHUNK_SIZE) {
+                n = arena_size(capacity, size + INPUT_CHUNK_SIZE, INPUT_CHUNK_SIZE);
+                text = arena_grow(text, capacity, n);
+                capacity = n;
+            }
+            n = _sys_read(fd, &text[size], capacity - size);
+            if (n > 0)
+                size += n;
         }
+        pp_read_buffer[pp_includes] = text;
+        pp_read_capacity[pp_includes] = capacity;
     }
+    _sys_close(fd);
 
-    buffer[i] = '\0';
-    reverse(buffer);
+    input_buffer = text;
+    input_pos = 0;
+    input_size = size;
+    input_mapped = 1;
+    previous_char = 0;
+    current_char = 0;
+    lineno = 1;
+    pp_file = file;
+    pp_guard = 0;
+    pp_guard_state = GUARD_START;
 }
 
-void parse_error(int err)
+int pp_find_file(char *path)
 {
-    char buffer[10];
-
-    _sys_write(2, "error: ", 7);
-    myitoa(buffer, 8, err);
-    _sys_write(2, buffer, mystrlen(buffer));
-    _sys_write(2, " in line ", 9);
-    myitoa(buffer, 8, lineno);
-    _sys_write(2, buffer, mystrlen(buffer));
-    _sys_write(2, "\n", 1);
+    int file;
 
-    _sys_exit(1);
+    file = 0;
+    while (file < pp_files) {
+        if (streq(&pp_path_text[pp_file_path[file]], path))
+            return file;
+        ++file;
+    }
+    return -1;
 }
 
-// void trace(char *msg, int num)
-// {
-//     char buffer[10];
-//
-//     _sys_write(2, msg, mystrlen(msg));
-//     myitoa(buffer, 8, num);
-//     buffer[8] = 0xa;
-//     _sys_write(2, buffer, 9);
-// }
-
-int gen_emitbyte(int byte)
+int pp_lookup_file(char *dir, int dir_len, char *name)
 {
-    emit_buffer[emit_pos++] = byte & 0xff;
-    return 1;
-}
+    char path[512];
+    int i, n, file, fd;
 
-int gen_emitbytes(int count, int b1, int b2, int b3, int b4)
-{
-    if (count >= 1) gen_emitbyte(b1);
-    if (count >= 2) gen_emitbyte(b2);
-    if (count >= 3) gen_emitbyte(b3);
-    if (count >= 4) gen_emitbyte(b4);
-    return count;
-}
+    // the file dir/name: one that was read before, or it is opened now
+    n = mystrlen(name);
+    if (dir_len + n >= 512)
+        return -1;
+    i = 0;
+    while (i < dir_len) {
+        path[i] = dir[i];
+        ++i;
+    }
+    i = 0;
+    while (i <= n) {
+        path[dir_len + i] = name[i];
+        ++i;
+    }
 
-int gen_emitdword(int dword)
-{
-    gen_write_dword_into_buffer(emit_buffer, emit_pos, dword);
-    emit_pos += 4;
-    return 4;
+    file = pp_find_file(path);
+    if (file >= 0)
+        return file;
+
+    // a file that can be opened, pp_read_file maps it
+    fd = _sys_open(path, OPEN_READ, 0);
+    if (fd < 0)
+        return -1;
+    _sys_close(fd);
+    return pp_add_file(pp_add_path(path));
 }
 
-int parse_args(int tok)
+void pp_include(char *name)
 {
-    if (tok != '(')
-        parse_error(E_FCT_MISSING_PARANTHESIS);
-
-    tok = lex_next_token();
-
-    if (tok == VOID) {
-        tok = lex_next_token();
-        if (tok != ')')
-            parse_error(E_FCT_MISSING_PARANTHESIS);
+    int file, dir_len, i, n;
+    char *dir;
+
+    // a "name" is looked for next to the file that includes it, then in the current directory
+    file = -1;
+    if (pp_file >= 0 && name[0] != '/') {
+        dir = &pp_path_text[pp_file_path[pp_file]];
+        dir_len = 0;
+        i = 0;
+        while (dir[i]) {
+            if (dir[i] == '/')
+                dir_len = i + 1;
+            ++i;
+        }
+        if (dir_len > 0)
+            file = pp_lookup_file(dir, dir_len, name);
     }
-    else {
-        int type, address, symidx;
+    if (file < 0)
+        file = pp_lookup_file(name, 0, name);
+    if (file < 0)
+        parse_error_name(E_OPEN_FAILED, name);
 
-        address = 8;
+    // a file whose guard macro is defined by now is not read again
+    if (pp_file_once[file])
+        return;
+    if (pp_file_guard[file] != 0 && pp_name_macro[pp_file_guard[file]] != 0)
+        return;
 
-        while (tok == INT || tok == CHAR || tok == VOID) {
-           type = tok;
-           tok = lex_next_token();
-           if (tok != IDENTIFIER) {
-                if (tok != '*')
-                    parse_error(E_MISSING_IDENTIFIER);
+    if (pp_includes == MAX_INCLUDE)
+        parse_error(E_INCLUDE_TOO_DEEP);
+    n = pp_includes++;
+    pp_include_buffer[n] = input_buffer;
+    pp_include_pos[n] = input_pos;
+    pp_include_size[n] = input_size;
+    pp_include_mapped[n] = input_mapped;
+    pp_include_unmap[n] = pp_unmap;
+    pp_include_file[n] = pp_file;
+    pp_include_line[n] = lineno;
+    pp_include_cond[n] = pp_cond_depth;
+    pp_include_guard[n] = pp_guard;
+    pp_include_guard_state[n] = pp_guard_state;
+    pp_include_guard_cond[n] = pp_guard_cond;
+    pp_read_file(file);
+}
 
-                type |= POINTER;
-                tok = lex_next_token();
-            }
+int pp_end_file(void)
+{
+    int n;
 
-            if (tok != IDENTIFIER)
-                parse_error(E_MISSING_IDENTIFIER);
+    // the end of a file: back to the one that included it, or on to the next source file
+    if (pp_file >= 0 && pp_guard_state == GUARD_CLOSED)
+        pp_file_guard[pp_file] = pp_guard;
+    pp_release_file();
+
+    if (pp_includes > 0) {
+        n = --pp_includes;
+        if (pp_cond_depth != pp_include_cond[n])
+            parse_error(E_BAD_DIRECTIVE);  // #if without #endif
+        input_buffer = pp_include_buffer[n];
+        input_pos = pp_include_pos[n];
+        input_size = pp_include_size[n];
+        input_mapped = pp_include_mapped[n];
+        pp_unmap = pp_include_unmap[n];
+        pp_file = pp_include_file[n];
+        lineno = pp_include_line[n];
+        pp_guard = pp_include_guard[n];
+        pp_guard_state = pp_include_guard_state[n];
+        pp_guard_cond = pp_include_guard_cond[n];
+        previous_char = 0;
+        current_char = 0;
+        return 1;
+    }
 
-            symidx = parse_add_symbol(token_text);
-            symbol_address[symidx] = address;
-            address += 4;
+    if (pp_cond_depth != 0)
+        parse_error(E_BAD_DIRECTIVE);
+    if (pp_source_next < pp_sources) {
+        lex_open_file(pp_source[pp_source_next++]);
+        return 1;
+    }
+    return 0;
+}
 
-            tok = lex_next_token();
+void pp_read_word(char *word, int size)
+{
+    int c, i;
 
-            if (tok == '[') {
-                tok = lex_next_token();
+    // the name of a directive in a skipped group
+    c = lex_readchar();
+    while (c == ' ' || c == 9)
+        c = lex_readchar();
+    i = 0;
+    while (lex_class[c & 0xff] & (CC_IDENT | CC_DIGIT)) {
+        if (i < size - 1)
+            word[i++] = c;
+        c = lex_readchar();
+    }
+    word[i] = 0;
+    if (c != 0)
+        --input_pos;
+}
 
-                type |= ARRAY;
+int pp_skip_group(int to_endif)
+{
+    int depth, c;
+    char word[8];
 
-                if (tok != ']')
-                    parse_error(E_WRONG_ARRAY_DEF);
-                tok = lex_next_token();
+    // skip the lines of a group up to its #else, #elif or #endif, or only up to its #endif
+    depth = 0;
+    while (1) {
+        c = lex_readchar();
+        while (c == ' ' || c == 9 || c == 13)
+            c = lex_readchar();
+        if (c == 0)
+            parse_error(E_BAD_DIRECTIVE);  // #if without #endif
+        if (c == 10) {
+            ++lineno;
+            continue;
+        }
+        if (c == '#') {
+            ++pp_directives;
+            pp_read_word(word, 8);
+            if (streq(word, "if") || streq(word, "ifdef") || streq(word, "ifndef"))
+                ++depth;
+            else if (streq(word, "endif")) {
+                if (depth == 0) {
+                    lex_skip_line();
+                    return GROUP_ENDIF;
+                }
+                --depth;
             }
-
-            symbol_type[symidx] = PARAM | type;
-            symbol_size[symidx] = 4;
-
-            if (tok == ',') {
-                tok = lex_next_token();
-                continue;
+            else if (depth == 0 && !to_endif) {
+                if (streq(word, "else")) {
+                    lex_skip_line();
+                    return GROUP_ELSE;
+                }
+                if (streq(word, "elif"))
+                    return GROUP_ELIF;
             }
-            else if (tok == ')')
-                return lex_next_token();
-            else
-                parse_error(E_PARAM_DEF);
         }
+        lex_skip_line();
     }
-    return lex_next_token();
 }
 
-int parse_calcexpr(int tok, int is_const, int *retval, int delim);
+int lex_read_token(void);
+int pp_if_or(void);
 
-int parse_enum_decl(int tok)
+int pp_if_next(void)
 {
-    int enumval;
+    pp_if_token = lex_read_token();
+    return pp_if_token;
+}
 
-    enumval = 0;
+int pp_if_unary(void)
+{
+    int value, tok, paren;
 
-    if (tok == ENUM) {
-        tok = lex_next_token();
-        if (tok == IDENTIFIER)
-            tok = lex_next_token();
+    if (pp_if_token == '!') {
+        pp_if_next();
+        return !pp_if_unary();
+    }
+    if (pp_if_token == '-') {
+        pp_if_next();
+        return -pp_if_unary();
+    }
+    if (pp_if_token == '(') {
+        pp_if_next();
+        value = pp_if_or();
+        if (pp_if_token != ')')
+            parse_error(E_BAD_DIRECTIVE);
+        pp_if_next();
+        return value;
+    }
+    if (pp_if_token == NUMBER) {
+        value = token_value;
+        pp_if_next();
+        return value;
+    }
+    if (pp_if_token != IDENTIFIER)
+        parse_error(E_BAD_DIRECTIVE);
+
+    // defined NAME or defined(NAME), any other name is 0
+    value = 0;
+    if (streq(parse_name(token_name), "defined")) {
+        paren = 0;
+        tok = lex_read_raw_token();
+        if (tok == '(') {
+            paren = 1;
+            tok = lex_read_raw_token();
+        }
+        if (tok != IDENTIFIER)
+            parse_error(E_BAD_DIRECTIVE);
+        value = pp_name_macro[token_name] != 0;
+        if (paren && lex_read_raw_token() != ')')
+            parse_error(E_BAD_DIRECTIVE);
+    }
+    pp_if_next();
+    return value;
+}
 
-        if (tok != '{')
-            parse_error(E_ENUM_MISSING_OPENING_BRACES);
+int pp_if_compare(void)
+{
+    int value, op, right;
+
+    value = pp_if_unary();
+    op = pp_if_token;
+    if (op == EQ || op == NEQ || op == '<' || op == '>' || op == LE || op == GE) {
+        pp_if_next();
+        right = pp_if_unary();
+        if (op == EQ)
+            value = value == right;
+        else if (op == NEQ)
+            value = value != right;
+        else if (op == '<')
+            value = value < right;
+        else if (op == '>')
+            value = value > right;
+        else if (op == LE)
+            value = value <= right;
+        else
+            value = value >= right;
+    }
+    return value;
+}
 
-        tok = lex_next_token();
-        while (tok != '}') {
+int pp_if_and(void)
+{
+    int value, right;
+
+    value = pp_if_compare();
+    while (pp_if_token == LOGAND) {
+        pp_if_next();
+        right = pp_if_compare();
+        value = value && right;
+    }
+    return value;
+}
+
+int pp_if_or(void)
+{
+    int value, right;
+
+    value = pp_if_and();
+    while (pp_if_token == LOGOR) {
+        pp_if_next();
+        right = pp_if_and();
+        value = value || right;
+    }
+    return value;
+}
+
+int pp_if_value(void)
+{
+    int value;
+
+    // the rest of an #if or #elif line: numbers, defined, !, comparisons, && and ||
+    pp_line_mode = 1;
+    pp_if_next();
+    value = pp_if_or();
+    if (pp_if_token != EOL)
+        parse_error(E_BAD_DIRECTIVE);
+    pp_line_mode = 0;
+    return value;
+}
+
+void pp_condition(int value)
+{
+    int group;
+
+    // an #if group: read it, or skip to the #else or #elif that is read instead
+    ++pp_cond_depth;
+    while (!value) {
+        group = pp_skip_group(0);
+        if (group == GROUP_ENDIF) {
+            --pp_cond_depth;
+            return;
+        }
+        if (group == GROUP_ELSE)
+            return;
+        value = pp_if_value();
+    }
+}
+
+void pp_end_line(int tok)
+{
+    // the rest of the directive line is not used
+    while (tok != EOL)
+        tok = lex_read_raw_token();
+    pp_line_mode = 0;
+}
+
+int pp_define_name(void)
+{
+    if (lex_read_raw_token() != IDENTIFIER)
+        parse_error(E_BAD_DIRECTIVE);
+    return token_name;
+}
+
+void pp_reserve_macro(void)
+{
+    int size;
+
+    // room for one more macro
+    if (pp_macros == pp_macro_capacity) {
+        size = arena_size(pp_macro_capacity, pp_macros + 1, MACROS_INITIAL);
+        pp_macro_first = arena_grow(pp_macro_first, 4 * pp_macro_capacity, 4 * size);
+        pp_macro_count = arena_grow(pp_macro_count, 4 * pp_macro_capacity, 4 * size);
+        pp_macro_active = arena_grow(pp_macro_active, 4 * pp_macro_capacity, 4 * size);
+        pp_macro_capacity = size;
+    }
+}
+
+void pp_reserve_macro_tokens(int tokens)
+{
+    int size;
+
+    if (pp_macro_tokens + tokens > pp_macro_token_capacity) {
+        size = arena_size(pp_macro_token_capacity, pp_macro_tokens + tokens, MACRO_TOKENS_INITIAL);
+        pp_macro_token = arena_grow(pp_macro_token, 4 * pp_macro_token_capacity, 4 * size);
+        pp_macro_value = arena_grow(pp_macro_value, 4 * pp_macro_token_capacity, 4 * size);
+        pp_macro_token_capacity = size;
+    }
+}
+
+void pp_define(int nameid)
+{
+    int tok, macro, i, size;
+
+    // an object-like macro: the tokens up to the end of the line
+    if (previous_char == '(')
+        parse_error(E_BAD_DIRECTIVE);  // no function-like macros
+    pp_reserve_macro();
+    ++pp_defines;
+    macro = pp_macros++;
+    pp_macro_first[macro] = pp_macro_tokens;
+    tok = lex_read_raw_token();
+    while (tok != EOL) {
+        pp_reserve_macro_tokens(1);
+        pp_macro_token[pp_macro_tokens] = tok;
+        if (tok == IDENTIFIER)
+            pp_macro_value[pp_macro_tokens] = token_name;
+        else if (tok == STRING) {
+            if (pp_macro_text_size + 4 + token_text_len > pp_macro_text_capacity) {
+                size = arena_size(pp_macro_text_capacity, pp_macro_text_size + 4 + token_text_len, MACRO_TEXT_INITIAL);
+                pp_macro_text = arena_grow(pp_macro_text, pp_macro_text_capacity, size);
+                pp_macro_text_capacity = size;
+            }
+            pp_macro_value[pp_macro_tokens] = pp_macro_text_size;
+            gen_write_dword_into_buffer(pp_macro_text, pp_macro_text_size, token_text_len);
+            pp_macro_text_size += 4;
+            i = 0;
+            while (i < token_text_len)
+                pp_macro_text[pp_macro_text_size++] = token_text[i++];
+        }
+        else
+            pp_macro_value[pp_macro_tokens] = token_value;
+        ++pp_macro_tokens;
+        tok = lex_read_raw_token();
+    }
+    pp_macro_count[macro] = pp_macro_tokens - pp_macro_first[macro];
+    pp_name_macro[nameid] = macro + 1;
+    pp_line_mode = 0;
+}
+
+void pp_predefine(char *name, int value)
+{
+    int nameid;
+
+    nameid = parse_intern_name(name);
+    pp_reserve_macro();
+    pp_reserve_macro_tokens(1);
+    pp_macro_first[pp_macros] = pp_macro_tokens;
+    pp_macro_count[pp_macros] = 1;
+    pp_macro_token[pp_macro_tokens] = NUMBER;
+    pp_macro_value[pp_macro_tokens++] = value;
+    pp_name_macro[nameid] = ++pp_macros;
+}
+
+void pp_directive(void)
+{
+    int tok, nameid, guard_state, i;
+    char name[256];
+
+    // the '#' was read: the rest of its line is the directive
+    ++pp_directives;
+    pp_line_mode = 1;
+    guard_state = pp_guard_state;
+    if (pp_guard_state != GUARD_INSIDE)
+        pp_guard_state = GUARD_NONE;
+
+    tok = lex_read_raw_token();
+    if (tok == EOL) {
+        pp_line_mode = 0;
+        return;
+    }
+    if (tok == IF) {
+        pp_condition(pp_if_value());
+        return;
+    }
+    if (tok == ELSE) {
+        if (pp_cond_depth == 0)
+            parse_error(E_BAD_DIRECTIVE);
+        if (pp_guard_state == GUARD_INSIDE && pp_cond_depth == pp_guard_cond)
+            pp_guard_state = GUARD_NONE;
+        pp_end_line(lex_read_raw_token());
+        pp_skip_group(1);
+        --pp_cond_depth;
+        return;
+    }
+    if (tok != IDENTIFIER)
+        parse_error(E_BAD_DIRECTIVE);
+
+    if (streq(token_text, "include")) {
+        tok = lex_read_raw_token();
+        if (tok == STRING) {
+            if (token_text_len > 256)
+                parse_error(E_BAD_DIRECTIVE);
+            i = 0;
+            while (i < token_text_len) {
+                name[i] = token_text[i];
+                ++i;
+            }
+            pp_end_line(lex_read_raw_token());
+            pp_include(name);
+        }
+        else if (tok == '<')
+            pp_end_line(tok);  // no system headers: the library comes from the backend
+        else
+            parse_error(E_BAD_DIRECTIVE);
+    }
+    else if (streq(token_text, "define"))
+        pp_define(pp_define_name());
+    else if (streq(token_text, "undef")) {
+        pp_name_macro[pp_define_name()] = 0;
+        ++pp_defines;
+        pp_end_line(lex_read_raw_token());
+    }
+    else if (streq(token_text, "ifdef") || streq(token_text, "ifndef")) {
+        tok = token_text[2];  // 'd' or 'n'
+        nameid = pp_define_name();
+        pp_end_line(lex_read_raw_token());
+        if (tok == 'n' && guard_state == GUARD_START) {
+            pp_guard = nameid;
+            pp_guard_state = GUARD_INSIDE;
+            pp_guard_cond = pp_cond_depth + 1;
+        }
+        if (tok == 'n')
+            pp_condition(pp_name_macro[nameid] == 0);
+        else
+            pp_condition(pp_name_macro[nameid] != 0);
+    }
+    else if (streq(token_text, "elif")) {
+        // the group before was read: skip the others
+        if (pp_cond_depth == 0)
+            parse_error(E_BAD_DIRECTIVE);
+        if (pp_guard_state == GUARD_INSIDE && pp_cond_depth == pp_guard_cond)
+            pp_guard_state = GUARD_NONE;
+        pp_end_line(lex_read_raw_token());
+        pp_skip_group(1);
+        --pp_cond_depth;
+    }
+    else if (streq(token_text, "endif")) {
+        if (pp_cond_depth == 0)
+            parse_error(E_BAD_DIRECTIVE);
+        if (pp_guard_state == GUARD_INSIDE && pp_cond_depth == pp_guard_cond)
+            pp_guard_state = GUARD_CLOSED;
+        --pp_cond_depth;
+        pp_end_line(lex_read_raw_token());
+    }
+    else if (streq(token_text, "pragma")) {
+        tok = lex_read_raw_token();
+        if (tok == IDENTIFIER && streq(token_text, "once") && pp_file >= 0)
+            pp_file_once[pp_file] = 1;
+        pp_end_line(tok);
+    }
+    else
+        parse_error(E_BAD_DIRECTIVE);
+}
+
+int pp_expand_token(void)
+{
+    int n, macro, pos, tok, i;
+
+    // the next token of the innermost macro being expanded, -1 at its end
+    n = pp_expand_depth - 1;
+    macro = pp_expand_macro[n];
+    pos = pp_expand_pos[n];
+    if (pos == pp_macro_first[macro] + pp_macro_count[macro]) {
+        pp_macro_active[macro] = 0;
+        --pp_expand_depth;
+        return -1;
+    }
+    pp_expand_pos[n] = pos + 1;
+
+    tok = pp_macro_token[pos];
+    if (tok == IDENTIFIER)
+        token_name = pp_macro_value[pos];
+    else if (tok == STRING) {
+        pos = pp_macro_value[pos];
+        token_text_len = gen_read_dword_from_buffer(pp_macro_text, pos);
+        pos += 4;
+        lex_reserve_text(token_text_len);
+        i = 0;
+        while (i < token_text_len)
+            token_text[i++] = pp_macro_text[pos++];
+    }
+    else
+        token_value = pp_macro_value[pos];
+    return tok;
+}
+
+int lex_read_token(void)
+{
+    int tok, macro;
+
+    // the tokens after preprocessing: a macro name is replaced by the tokens of the macro
+    while (1) {
+        if (pp_expand_depth > 0)
+            tok = pp_expand_token();
+        else
+            tok = lex_read_raw_token();
+
+        if (tok == IDENTIFIER) {
+            macro = pp_name_macro[token_name] - 1;
+            if (macro >= 0 && !pp_macro_active[macro]) {
+                if (pp_expand_depth == MAX_EXPANSION)
+                    parse_error(E_BAD_DIRECTIVE);
+                pp_macro_active[macro] = 1;
+                pp_expand_macro[pp_expand_depth] = macro;
+                pp_expand_pos[pp_expand_depth] = pp_macro_first[macro];
+                ++pp_expand_depth;
+                continue;
+            }
+        }
+        if (tok < 0)
+            continue;
+
+        if (pp_guard_state != GUARD_INSIDE && !pp_line_mode)
+            pp_guard_state = GUARD_NONE;  // something outside of the guard
+        return tok;
+    }
+}
+
+
+int lex_tell(void)
+{
+    // input position of the next char, the pushed back one included
+    if (previous_char != 0)
+        return input_pos - 1;
+    return input_pos;
+}
+
+void lex_seek(int pos)
+{
+    // only for mapped input
+    input_pos = pos;
+    previous_char = 0;
+    current_char = 0;
+}
+
+int lex_skip_block(void)
+{
+    int depth, c;
+
+    // skip the rest of a block without making tokens: only braces, strings,
+    // character constants and comments matter. 1 if it stopped at a directive,
+    // which has to be read by the preprocessor.
+    lex_seek(lex_tell());
+    depth = 1;
+    while (depth > 0 && input_pos < input_size) {
+        c = input_buffer[input_pos++];
+        if (!(lex_class[c & 0xff] & CC_BLOCK))
+            continue;
+        if (c == 0) {
+            --input_pos;  // the end of the input for the lexer, too
+            break;
+        }
+        if (c == '{')
+            ++depth;
+        else if (c == '}')
+            --depth;
+        else if (c == 10)
+            ++lineno;
+        else if (c == '"' || c == '\'') {
+            while (1) {
+                input_pos += lex_scan_string(input_buffer + input_pos, input_size - input_pos, c);
+                if (lex_readchar() != '\\')
+                    break;
+                lex_readchar();
+            }
+        }
+        else if (c == '#')
+            return 1;
+        else if (c == '/') {
+            c = lex_readchar();
+            if (c == '/')
+                lex_skip_line();
+            else if (c == '*')
+                lex_skip_comment();
+            else if (c != 0)
+                --input_pos;
+        }
+    }
+    return 0;
+}
+
+void lex_record_block(void)
+{
+    int tok, depth, i, size;
+
+    // read the tokens up to the closing brace of the block that was just opened
+    replay_count = 0;
+    replay_pos = 0;
+    replay_text_size = 0;
+    depth = 1;
+    while (depth > 0) {
+        if (replay_count == replay_capacity) {
+            size = arena_size(replay_capacity, replay_count + 1, REPLAY_INITIAL);
+            replay_token = arena_grow(replay_token, 4 * replay_capacity, 4 * size);
+            replay_value = arena_grow(replay_value, 4 * replay_capacity, 4 * size);
+            replay_line = arena_grow(replay_line, 4 * replay_capacity, 4 * size);
+            replay_capacity = size;
+        }
+        tok = lex_read_token();
+        replay_token[replay_count] = tok;
+        replay_line[replay_count] = lineno;
+        if (tok == IDENTIFIER)
+            replay_value[replay_count] = token_name;
+        else if (tok == STRING) {
+            if (replay_text_size + 4 + token_text_len > replay_text_capacity) {
+                size = arena_size(replay_text_capacity, replay_text_size + 4 + token_text_len, REPLAY_TEXT_INITIAL);
+                replay_text = arena_grow(replay_text, replay_text_capacity, size);
+                replay_text_capacity = size;
+            }
+            replay_value[replay_count] = replay_text_size;
+            gen_write_dword_into_buffer(replay_text, replay_text_size, token_text_len);  // with the nul
+            replay_text_size += 4;
+            i = 0;
+            while (i < token_text_len)
+                replay_text[replay_text_size++] = token_text[i++];
+        }
+        else if (tok == NUMBER)
+            replay_value[replay_count] = token_value;  // numbers and char constants
+        else
+            replay_value[replay_count] = 0;  // token_value is left from the last number
+        ++replay_count;
+
+        if (tok == '{')
+            ++depth;
+        else if (tok == '}' || tok == 0)
+            --depth;
+        if (tok == 0)
+            break;
+    }
+    replay_lineno = lineno;
+}
+
+int lex_next_token(void)
+{
+    int tok, i, pos;
+
+    if (pushed_token) {
+        tok = pushed_token;
+        pushed_token = 0;
+        return tok;
+    }
+
+    if (replay_count == 0)
+        return lex_read_token();
+
+    if (replay_pos == replay_count) {
+        // back to the input after the recorded block
+        replay_count = 0;
+        lineno = replay_lineno;
+        return lex_read_token();
+    }
+
+    tok = replay_token[replay_pos];
+    lineno = replay_line[replay_pos];
+    if (tok == IDENTIFIER)
+        token_name = replay_value[replay_pos];
+    else if (tok == STRING) {
+        pos = replay_value[replay_pos];
+        token_text_len = gen_read_dword_from_buffer(replay_text, pos);
+        pos += 4;
+        lex_reserve_text(token_text_len);
+        i = 0;
+        while (i < token_text_len)
+            token_text[i++] = replay_text[pos++];
+    }
+    else
+        token_value = replay_value[replay_pos];
+    ++replay_pos;
+    return tok;
+}
+
+int mystrlen(char *p)
+{
+    int n;
+    n = 0;
+    while (*p++)
+        ++n;
+
+    return n;
+}
+
+void reverse(char *buffer)
+{
+    int n, i;
+    char temp;
+
+    n = mystrlen(buffer);
+    i = 0;
+
+    while (--n > i) {
+        temp = buffer[i];
+        buffer[i] = buffer[n];
+        buffer[n] = temp;
+        ++i;
+    }
+}
+
+void myitoa(char *buffer, int n, int value)
+{
+    int i, x;
+
+    i = 0;
+
+    if (value == 0) {
+        buffer[i++] = '0';
+    }
+    else {
+        while (value > 0) {
+            x = value % 10;
+            buffer[i++] = '0' + x;
+            value /= 10;
+        }
+    }
+
+    buffer[i] = '\0';
+    reverse(buffer);
+}
+
+int myatoi(char *s)
+{
+    int value;
+
+    value = 0;
+    while (*s >= '0' && *s <= '9')
+        value = value * 10 + (*s++ - '0');
+    return value;
+}
+
+void parse_error(int err)
+{
+    char buffer[10];
+
+    compile_error = err;
+    if (compile_quiet)
+        _sys_exit(1);  // a job's parent compiles the function again and reports it, libnanocc returns it
+
+    _sys_write(2, "error: ", 7);
+    myitoa(buffer, 8, err);
+    _sys_write(2, buffer, mystrlen(buffer));
+    _sys_write(2, " in line ", 9);
+    myitoa(buffer, 8, lineno);
+    _sys_write(2, buffer, mystrlen(buffer));
+    if (pp_file >= 0) {
+        _sys_write(2, " of ", 4);
+        _sys_write(2, &pp_path_text[pp_file_path[pp_file]], mystrlen(&pp_path_text[pp_file_path[pp_file]]));
+    }
+    _sys_write(2, "\n", 1);
+
+    _sys_exit(1);
+}
+
+void parse_error_name(int err, char *name)
+{
+    // an error about a name, a label or a file, which comes in front of the message
+    if (!compile_quiet) {
+        _sys_write(2, name, mystrlen(name));
+        _sys_write(2, ": ", 2);
+    }
+    parse_error(err);
+}
+
+// void trace(char *msg, int num)
+// {
+//     char buffer[10];
+//
+//     _sys_write(2, msg, mystrlen(msg));
+//     myitoa(buffer, 8, num);
+//     buffer[8] = 0xa;
+//     _sys_write(2, buffer, 9);
+// }
+
+int gen_emitbyte(int byte)
+{
+    if (emit_pos - emit_base == emit_capacity)
+        gen_reserve_code(1);
+    emit_buffer[emit_pos++ - emit_base] = byte & 0xff;
+    return 1;
+}
+
+int gen_emitbytes(int count, int b1, int b2, int b3, int b4)
+{
+    if (count >= 1) gen_emitbyte(b1);
+    if (count >= 2) gen_emitbyte(b2);
+    if (count >= 3) gen_emitbyte(b3);
+    if (count >= 4) gen_emitbyte(b4);
+    return count;
+}
+
+int gen_emitdword(int dword)
+{
+    gen_reserve_code(4);
+    gen_patch_code(emit_pos, dword);
+    emit_pos += 4;
+    return 4;
+}
+
+int parse_args(int tok)
+{
+    int type, address, symidx;
+
+    if (tok != '(')
+        parse_error(E_FCT_MISSING_PARANTHESIS);
+
+    tok = lex_next_token();
+
+    if (tok == VOID) {
+        tok = lex_next_token();
+        if (tok == ')')
+            return lex_next_token();
+        lex_push_token(tok);  // void *name
+        tok = VOID;
+    }
+
+    address = 8;
+
+    while (tok == INT || tok == CHAR || tok == VOID) {
+        type = tok;
+        tok = lex_next_token();
+        if (tok != IDENTIFIER) {
+            if (tok != '*')
+                parse_error(E_MISSING_IDENTIFIER);
+
+            type |= POINTER;
+            tok = lex_next_token();
+        }
+
+        if (tok != IDENTIFIER)
+            parse_error(E_MISSING_IDENTIFIER);
+
+        symidx = parse_bind_name(token_name);
+        symbol_address[symidx] = address;
+        address += 4;
+
+        tok = lex_next_token();
+
+        if (tok == '[') {
+            tok = lex_next_token();
+
+            type |= ARRAY;
+
+            if (tok != ']')
+                parse_error(E_WRONG_ARRAY_DEF);
+            tok = lex_next_token();
+        }
+
+        symbol_type[symidx] = PARAM | type;
+        symbol_size[symidx] = 4;
+
+        if (tok == ',') {
+            tok = lex_next_token();
+            continue;
+        }
+        else if (tok == ')')
+            return lex_next_token();
+        else
+            parse_error(E_PARAM_DEF);
+    }
+    return lex_next_token();
+}
+
+int parse_calcexpr(int tok, int is_const, int *retval, int delim);
+
+int parse_enum_decl(int tok)
+{
+    int enumval;
+
+    enumval = 0;
+
+    if (tok == ENUM) {
+        tok = lex_next_token();
+        if (tok == IDENTIFIER)
+            tok = lex_next_token();
+
+        if (tok != '{')
+            parse_error(E_ENUM_MISSING_OPENING_BRACES);
+
+        tok = lex_next_token();
+        while (tok != '}') {
+            int symidx;
+
+            if (tok != IDENTIFIER)
+                parse_error(E_ENUM_MISSING_IDENTIFIER);
+
+            symidx = parse_bind_name(token_name);
+
+            tok = lex_next_token();
+            if (tok == '=') {
+                int number;
+                tok = lex_next_token();
+                tok = parse_calcexpr(tok, 1, &number, 0);
+                enumval = number;
+            }
+
+            symbol_address[symidx] = enumval;
+            symbol_type[symidx]    = ENUM;
+            symbol_size[symidx]    = 4;
+
+            if (tok == ',') {
+                ++enumval;
+                tok = lex_next_token();
+            }
+        }
+        tok = lex_next_token();
+        if (tok != ';')
+            parse_error(E_MISSING_SEMICOLON);
+    }
+    return lex_next_token();
+}
+
+int parse_vardecl2(int tok, int type)
+{
+    int symidx, nameid;
+
+    while (1) {
+        int array_count, size, padded_size;
+
+        nameid = token_name;
+
+        array_count = 0;
+
+        if (tok == '[') {
+            // we use a trick here to use the expression parser
+            // instead of [] we parse (]
+            tok = parse_calcexpr('(', 1, &array_count, ']');
+
+            type |= ARRAY;
+        }
+
+        size = 1;
+        if (type & POINTER || (type & 0xff) == INT)
+            size = 4;
+        if (array_count > 1)
+            size *= array_count;
+        padded_size = size;
+        while (padded_size % 4 != 0)
+            ++padded_size;
+
+        if (type & LOCAL) {
+            symidx = parse_bind_name(nameid);
+            if (name_register[nameid] > 0)
+                symbol_register[symidx] = name_register[nameid];  // see parse_choose_registers
+            else {
+                local_variable_space += padded_size;
+                symbol_address[symidx] = local_variable_space;
+            }
+        }
+        else {
+            // global
+            symidx = parse_lookup_name(nameid);
+            if (symidx == 0)
+                symidx = parse_bind_name(nameid);
+
+            symbol_address[symidx] = global_variable_space;
+            global_variable_space += padded_size;
+        }
+
+        symbol_size[symidx] = size;
+        symbol_type[symidx] = type;
+
+        if (tok == ',') {
+            type &= ~(POINTER|ARRAY);  // no pointer and no array flag
+
+            tok = lex_next_token();
+            if (tok != IDENTIFIER) {
+                if (tok != '*')
+                    parse_error(E_MISSING_IDENTIFIER);
+
+                type |= POINTER;
+                tok = lex_next_token();
+            }
+            if (tok != IDENTIFIER)
+                parse_error(E_MISSING_IDENTIFIER);
+
+            tok = lex_next_token();
+            continue;
+        }
+        else if (tok != ';')
+            parse_error(E_MISSING_SEMICOLON);
+
+        return lex_next_token();
+    }
+}
+
+int parse_vardecl(int tok)
+{
+    int type;
+
+    if (tok == ENUM)
+        return parse_enum_decl(tok);
+
+    type = tok;
+    if (tok != VOID && tok != INT && tok != CHAR)
+        parse_error(E_MISSING_TYPE);
+
+    tok = lex_next_token();
+    if (tok != IDENTIFIER) {
+        if (tok != '*')
+            parse_error(E_MISSING_IDENTIFIER);
+
+        type |= POINTER;
+        tok = lex_next_token();
+    }
+
+    return parse_vardecl2(lex_next_token(), type | LOCAL);
+}
+
+int stack_empty(int *stack)
+{
+    return stack[0] == 0;
+}
+
+void stack_push(int *stack, int value)
+{
+    stack[++stack[0]] = value;
+}
+
+int stack_top(int *stack, int pop)
+{
+    int retval;
+
+    retval = -1;
+    if (!stack_empty(stack)) {
+        retval = stack[stack[0]];
+
+        if (pop)
+            stack[0]--;
+    }
+
+    return retval;
+}
+
+int stack_pop(int *stack) { return stack_top(stack, 1); }
+
+int *stack_reserve(int *stack, int *capacity, int n)
+{
+    int size, used, old;
+
+    // room for n more entries, the stack may move
+    old = *capacity;
+    used = 0;
+    if (old > 0)
+        used = stack[0];
+    if (used + n < old)
+        return stack;
+    size = arena_size(old, used + n + 1, STACK_INITIAL);
+    stack = arena_grow(stack, 4 * old, 4 * size);
+    *capacity = size;
+    return stack;
+}
+
+void parse_set_precedence(int op, int prec, int assoc)
+{
+    int idx;
+
+    idx = op & 0xff;
+    if (op & UNARY)
+        idx += 256;
+    prec_level[idx] = prec;
+    prec_assoc[idx] = assoc;
+}
+
+void parse_init_precedence(void)
+{
+    int i;
+
+    i = 0;
+    while (i < 512)
+        prec_level[i++] = 1000;
+
+    // 1 is right to left
+    parse_set_precedence('=', 24, 1);
+    parse_set_precedence(MULASSIGN, 24, 1);
+    parse_set_precedence(MINUSASSIGN, 24, 1);
+    parse_set_precedence(PLUSASSIGN, 24, 1);
+    parse_set_precedence(DIVASSIGN, 24, 1);
+    parse_set_precedence(MODASSIGN, 24, 1);
+    parse_set_precedence(LSHASSIGN, 24, 1);
+    parse_set_precedence(RSHASSIGN, 24, 1);
+    parse_set_precedence(ANDASSIGN, 24, 1);
+    parse_set_precedence(XORASSIGN, 24, 1);
+    parse_set_precedence(ORASSIGN, 24, 1);
+    parse_set_precedence(ARRAY_SUBSCRIPT, 11, 0);
+    parse_set_precedence(PLUSPLUS, 11, 0);
+    parse_set_precedence(MINUSMINUS, 11, 0);
+    parse_set_precedence(',', 25, 0);
+    parse_set_precedence(UNARY | '-', 12, 1);
+    parse_set_precedence(UNARY | '+', 12, 1);
+    parse_set_precedence('~', 12, 1);
+    parse_set_precedence('!', 12, 1);
+    parse_set_precedence(UNARY | '!', 12, 1);
+    parse_set_precedence(UNARY | '~', 12, 1);
+    parse_set_precedence(UNARY | '*', 12, 1);
+    parse_set_precedence(UNARY | '&', 12, 1);
+    parse_set_precedence(UNARY | MINUSMINUS, 12, 1);  // prefix ++/--
+    parse_set_precedence(UNARY | PLUSPLUS, 12, 1);
+    parse_set_precedence('*', 13, 0);
+    parse_set_precedence('/', 13, 0);
+    parse_set_precedence('%', 13, 0);
+    parse_set_precedence('+', 14, 0);
+    parse_set_precedence('-', 14, 0);
+    parse_set_precedence(LSH, 15, 0);
+    parse_set_precedence(RSH, 15, 0);
+    parse_set_precedence('<', 16, 0);
+    parse_set_precedence(LE, 16, 0);
+    parse_set_precedence('>', 16, 0);
+    parse_set_precedence(GE, 16, 0);
+    parse_set_precedence(EQ, 17, 0);
+    parse_set_precedence(NEQ, 17, 0);
+    parse_set_precedence('&', 18, 0);
+    parse_set_precedence('^', 19, 0);
+    parse_set_precedence('|', 20, 0);
+    parse_set_precedence(LOGAND, 21, 0);
+    parse_set_precedence(LOGOR, 22, 0);
+}
+
+int parse_precedence(int op, int *assoc)
+{
+    int idx;
+
+    *assoc = 0; // left to right
+
+    if (op == FUNCTION)
+        return 11;
+    if (op & ~(UNARY | 0xff))
+        return 1000;
+
+    idx = op & 0xff;
+    if (op & UNARY)
+        idx += 256;
+    *assoc = prec_assoc[idx];
+    return prec_level[idx];
+}
+
+void parse_reserve_nodes(int n)
+{
+    int size, used;
+
+    used = 0;
+    if (expr_capacity > 0)
+        used = expr_table[1];
+    if (used + n <= expr_capacity)
+        return;
+    size = arena_size(expr_capacity, used + n, EXPR_NODES_INITIAL);
+    expr_table = arena_grow(expr_table, 16 * expr_capacity, 16 * size);
+    expr_capacity = size;
+}
+
+int parse_add_elem(int type, int value)
+{
+    int nextfree;
+
+    parse_reserve_nodes(1);
+    nextfree = expr_table[1];
+    expr_table[4*nextfree+0] = type;
+    expr_table[4*nextfree+1] = value;
+    expr_table[4*nextfree+2] = 0; // child1
+    expr_table[4*nextfree+3] = 0; // child2
+    expr_table[1] = nextfree+1;
+
+    if (expr_table[0] == 0)
+        expr_table[0] = nextfree;
+    return nextfree;
+}
+
+void parse_reduce(void)
+{
+    int idx, op, child1, child2;
+
+    op = stack_pop(operator_stack);
+
+    child2 = 0;
+    if (!(op & UNARY) && op != MINUSMINUS && op != PLUSPLUS) {
+        child2 = stack_pop(arg_stack);
+    }
+    child1 = stack_pop(arg_stack);
+    if (child1 == -1 && op & FUNCTION) {
+        // -1 indicates the end of parameter list: ignore
+        child1 = stack_pop(arg_stack);
+    }
+    if (child1 == -1 || child2 == -1)
+        parse_error(E_BAD_EXPRESSION);  // an operand is missing
+
+    if (op == ARRAY_SUBSCRIPT) {
+        int idx2;
+
+        idx2 = parse_add_elem(OPERATOR, '+');
+        expr_table[4*idx2+2] = child1;
+        expr_table[4*idx2+3] = child2;
+
+        idx = parse_add_elem(OPERATOR, UNARY | '*');
+        expr_table[4*idx+2] = idx2;
+    }
+    else {
+        idx = parse_add_elem(OPERATOR, op);
+        expr_table[4*idx+2] = child1;
+        expr_table[4*idx+3] = child2;
+    }
+
+    expr_table[0] = idx;
+    stack_push(arg_stack, idx);
+}
+
+int parse_check_unary(int c, int last)
+{
+    if (c == '!' || c == '~')
+        return UNARY;
+
+    if (c == '-' || c == '+' || c == '*' || c == '&' || c == PLUSPLUS || c == MINUSMINUS) {
+        if (last == 0)
+            return UNARY;
+
+        if (last == NUMBER || last == IDENTIFIER || last == ')' || last == ']' || last == MINUSMINUS || last == PLUSPLUS)
+            return 0;
+
+        return UNARY;
+    }
+
+    return 0;
+}
+
+int parse_is_number(int node)
+{
+    return expr_table[4*node+0] == NUMBER;
+}
+
+void parse_set_number(int node, int value)
+{
+    expr_table[4*node+0] = NUMBER;
+    expr_table[4*node+1] = value;
+}
+
+void parse_replace_node(int node, int child)
+{
+    // the node becomes its child, nothing else refers to the child
+    expr_table[4*node+0] = expr_table[4*child+0];
+    expr_table[4*node+1] = expr_table[4*child+1];
+    expr_table[4*node+2] = expr_table[4*child+2];
+    expr_table[4*node+3] = expr_table[4*child+3];
+}
+
+int parse_foldable(int op, int b)
+{
+    if (op == '/' || op == '%')
+        return b != 0 && b != -1;  // left to the division at run time
+    return op == '+' || op == '-' || op == '*' || op == '&' || op == '|' || op == '^' ||
+        op == LSH || op == RSH || op == '<' || op == '>' || op == LE || op == GE ||
+        op == EQ || op == NEQ || op == LOGAND || op == LOGOR;
+}
+
+int parse_fold(int op, int a, int b)
+{
+    // the value the generated code computes: shifts use the low 5 bits of the count
+    // like the cpu, >> of an int is the arithmetic sar
+    if (op == '+') return a + b;
+    if (op == '-') return a - b;
+    if (op == '*') return a * b;
+    if (op == '/') return a / b;
+    if (op == '%') return a % b;
+    if (op == '&') return a & b;
+    if (op == '|') return a | b;
+    if (op == '^') return a ^ b;
+    if (op == LSH) return a << (b & 31);
+    if (op == RSH) return a >> (b & 31);
+    if (op == '<') return a < b;
+    if (op == '>') return a > b;
+    if (op == LE)  return a <= b;
+    if (op == GE)  return a >= b;
+    if (op == EQ)  return a == b;
+    if (op == NEQ) return a != b;
+    if (op == LOGAND) return a != 0 && b != 0;
+    return a != 0 || b != 0;  // LOGOR
+}
+
+void parse_simplify_expression(void)
+{
+    int root, op, child, child1, child2, value;
+
+    // children come before their parents in expr_table, so one pass in order
+    // simplifies them first. nodes that are no longer referenced do no harm.
+    // an operand that is dropped must not have side effects: only leaves are
+    root = 1;
+    while (root < expr_table[1]) {
+        if (expr_table[4*root+0] == ENUM) {
             int symidx;
 
-            if (tok != IDENTIFIER)
-                parse_error(E_ENUM_MISSING_IDENTIFIER);
+            symidx = expr_table[4*root+1];
+            expr_table[4*root+0] = NUMBER;
+            expr_table[4*root+1] = symbol_address[symidx];
+        }
 
-            symidx = parse_add_symbol(token_text);
+        op = expr_table[4*root+1];
+        child1 = expr_table[4*root+2];
+        child2 = expr_table[4*root+3];
 
-            tok = lex_next_token();
-            if (tok == '=') {
-                int number;
-                tok = lex_next_token();
-                tok = parse_calcexpr(tok, 1, &number, 0);
-                enumval = number;
+        if (expr_table[4*root+0] != OPERATOR)
+            ; // is already a constant or variable
+        else if (op & UNARY) {
+            value = expr_table[4*child1+1];
+            if (op == (UNARY | '+'))
+                parse_replace_node(root, child1);
+            else if (parse_is_number(child1)) {
+                if (op == (UNARY | '-'))
+                    parse_set_number(root, -value);
+                else if (op == (UNARY | '~'))
+                    parse_set_number(root, ~value);
+                else if (op == (UNARY | '!'))
+                    parse_set_number(root, !value);
+            }
+        }
+        else if (parse_is_number(child1) && parse_is_number(child2)) {
+            if (parse_foldable(op, expr_table[4*child2+1]))
+                parse_set_number(root, parse_fold(op, expr_table[4*child1+1], expr_table[4*child2+1]));
+        }
+        else if ((op == LOGAND || op == LOGOR) && (parse_is_number(child1) || parse_is_number(child2))) {
+            // a constant operand either decides the value or leaves the other one != 0
+            child = child1;
+            if (parse_is_number(child1))
+                child = child2;
+            value = expr_table[4*(child1 + child2 - child)+1] != 0;
+            if (value == (op == LOGOR) && (child == child2 || expr_table[4*child+0] != OPERATOR))
+                parse_set_number(root, value);
+            else if (value != (op == LOGOR)) {
+                expr_table[4*root+1] = NEQ;
+                expr_table[4*root+2] = child;
+                expr_table[4*root+3] = child1 + child2 - child;
+                parse_set_number(child1 + child2 - child, 0);
+            }
+        }
+        else if (parse_is_number(child1) || parse_is_number(child2)) {
+            if (parse_is_number(child1) && (op == '+' || op == '*' || op == '&' || op == '|' || op == '^' || op == EQ || op == NEQ)) {
+                // the constant goes to the right, where it can be an immediate
+                expr_table[4*root+2] = child2;
+                expr_table[4*root+3] = child1;
+                child1 = child2;
+                child2 = expr_table[4*root+3];
+            }
+            if (op == '-' && parse_is_number(child2)) {
+                // x - c is x + -c, so it joins the chains of +
+                op = '+';
+                expr_table[4*root+1] = op;
+                expr_table[4*child2+1] = -expr_table[4*child2+1];
             }
 
-            symbol_address[symidx] = enumval;
-            symbol_type[symidx]    = ENUM;
-            symbol_size[symidx]    = 4;
+            // (x op c1) op c2 is x op (c1 op c2)
+            child = child1;
+            if ((op == '+' || op == '*' || op == '&' || op == '|' || op == '^') && parse_is_number(child2) &&
+                    expr_table[4*child+0] == OPERATOR && expr_table[4*child+1] == op && parse_is_number(expr_table[4*child+3])) {
+                expr_table[4*child2+1] = parse_fold(op, expr_table[4*expr_table[4*child+3]+1], expr_table[4*child2+1]);
+                child1 = expr_table[4*child+2];
+                expr_table[4*root+2] = child1;
+            }
 
-            if (tok == ',') {
-                ++enumval;
-                tok = lex_next_token();
+            if (parse_is_number(child2)) {
+                value = expr_table[4*child2+1];
+                if (value == 0 && (op == '+' || op == '|' || op == '^' || op == LSH || op == RSH))
+                    parse_replace_node(root, child1);
+                else if (value == 1 && (op == '*' || op == '/'))
+                    parse_replace_node(root, child1);
+                else if (value == -1 && op == '&')
+                    parse_replace_node(root, child1);
+                else if (value == 0 && (op == '*' || op == '&') && expr_table[4*child1+0] != OPERATOR)
+                    parse_set_number(root, 0);
+                else if (value == 1 && op == '%' && expr_table[4*child1+0] != OPERATOR)
+                    parse_set_number(root, 0);
             }
         }
-        tok = lex_next_token();
-        if (tok != ';')
-            parse_error(E_MISSING_SEMICOLON);
+        ++root;
     }
-    return lex_next_token();
 }
 
-void mystrcpy(char *dst, char *src)
+enum Flags_genexpr {
+    ADDR_ONLY  = 0x100,    // result must be the address (don't load value)
+    FOR_EFFECT = 0x200,    // the value of the expression is not used
+    GEN_ARG    = 0x400,    // the value is a parameter of a call: push it
+    GEN_MEMORY = 0x800,    // result is a memory operand, see enum MemMode (with ADDR_ONLY)
+    FOR_BRANCH = 0x1000,   // a compare leaves its result in the flags, see gen_branch_cc
+    GEN_TAIL   = 0x2000    // a call that is returned: the function jumps to it, see gen_is_tail_call
+};
+
+// memory operands: [ebp+disp], ds:[address of a global], [base+disp], [base+index*scale],
+// and a variable in a register, which instructions take like memory
+enum MemMode { MEM_FRAME = 1, MEM_ABSOLUTE = 2, MEM_BASE = 3, MEM_INDEX = 4, MEM_REGISTER = 5 };
+
+// the right operand of a binary operator: a register, an immediate or a variable in memory
+enum OperandKind { OPERAND_REG = 0, OPERAND_IMM = 1, OPERAND_MEM = 2 };
+
+// the registers of the i386, gen_expr keeps values in them
+enum Registers {
+    EAX = 0, ECX = 1, EDX = 2, EBX = 3, ESP = 4, EBP = 5, ESI = 6, EDI = 7,
+    REG_ANY  = 0xcf,    // masks of (1 << register): all but esp and ebp
+    REG_BYTE = 0x0f,    // those with a byte register: al, cl, dl, bl
+    REG_SAVED = 0xc8    // ebx, esi and edi: a function gives them back as it got them
+};
+
+int parse_deref(int type)
 {
-    while ((*dst++ = *src++))
-        ;
+    if (type & ARRAY)
+        return type & ~ARRAY;
+
+    if (type & POINTER)
+        return type & ~POINTER;
+
+    return type;
 }
 
-int parse_vardecl2(int tok, int type)
+int parse_get_size(int type)
 {
-    int symidx;
-    char name[256];
+    if (type & ARRAY)
+        return 4;
+    if (type & POINTER)
+        return 4;
+    if ((type & 0xff) == INT)
+        return 4;
 
-    while (1) {
-        int array_count, size, padded_size;
+    return 1;
+}
 
-        mystrcpy(name, token_text);
+enum GenFrame {
+    FRAME_NODE    = 0,
+    FRAME_FLAGS   = 1,
+    FRAME_PHASE   = 2,    // number of children generated so far
+    FRAME_TYPE    = 3,    // type of the node's value
+    FRAME_CHILD   = 4,    // type of the child generated last
+    FRAME_LEFT    = 5,    // type of child1 when both are needed
+    FRAME_COUNT   = 6,    // function call: number of parameters
+    FRAME_COUNTER = 7,    // frame of the call whose parameters ',' counts, -1: none
+    FRAME_LABEL   = 8,    // && and ||
+    FRAME_MODE    = 9,    // the memory operand of a GEN_MEMORY child, see enum MemMode
+    FRAME_DISP    = 10,
+    FRAME_SCALE   = 11,
+    FRAME_INLINE  = 12,   // inlined call: 1 + the value of its last parameter, 0: a call
+    FRAME_SIZE    = 13
+};
 
-        array_count = 0;
+void gen_push_frame(int node, int flags, int counter)
+{
+    int size, base;
 
-        if (tok == '[') {
-            // we use a trick here to use the expression parser
-            // instead of [] we parse (]
-            tok = parse_calcexpr('(', 1, &array_count, ']');
+    if (gen_frame_count == gen_frame_capacity) {
+        size = arena_size(gen_frame_capacity, gen_frame_count + 1, GEN_FRAMES_INITIAL);
+        gen_frames = arena_grow(gen_frames, 4 * FRAME_SIZE * gen_frame_capacity, 4 * FRAME_SIZE * size);
+        gen_frame_capacity = size;
+    }
+    base = FRAME_SIZE * gen_frame_count++;
+    gen_frames[base+FRAME_NODE] = node;
+    gen_frames[base+FRAME_FLAGS] = flags;
+    gen_frames[base+FRAME_PHASE] = 0;
+    gen_frames[base+FRAME_TYPE] = INT;
+    gen_frames[base+FRAME_CHILD] = INT;
+    gen_frames[base+FRAME_LEFT] = INT;
+    gen_frames[base+FRAME_COUNT] = 0;
+    gen_frames[base+FRAME_COUNTER] = counter;
+    gen_frames[base+FRAME_LABEL] = 0;
+    gen_frames[base+FRAME_MODE] = MEM_BASE;
+    gen_frames[base+FRAME_DISP] = 0;
+    gen_frames[base+FRAME_SCALE] = 0;
+    gen_frames[base+FRAME_INLINE] = 0;
+}
 
-            type |= ARRAY;
-        }
+void gen_move(int dst, int src)
+{
+    if (dst != src)
+        gen_emitbytes(2, 0x89, 0xc0 | (src << 3) | dst, 0, 0);  // mov dst,src
+}
 
-        size = 1;
-        if (type & POINTER || (type & 0xff) == INT)
-            size = 4;
-        if (array_count > 1)
-            size *= array_count;
-        padded_size = size;
-        while (padded_size % 4 != 0)
-            ++padded_size;
+int gen_peep_last(void)
+{
+    // the start of the window, -1 if there is none
+    if (peep_start < emit_base || peep_end != emit_pos)
+        return -1;
+    return peep_start;
+}
 
-        if (type & LOCAL) {
-            symidx = parse_add_symbol(name);
-            local_variable_space += padded_size;
-            symbol_address[symidx] = local_variable_space;
-        }
-        else {
-            // global
-            symidx = parse_lookup_symbol(name);
-            if (symidx == 0)
-                symidx = parse_add_symbol(name);
+void gen_peep_mark(int start)
+{
+    peep_start = start;
+    peep_end = emit_pos;
+}
 
-            symbol_address[symidx] = global_variable_space;
-            global_variable_space += padded_size;
+int gen_peep_byte(int i)
+{
+    return emit_buffer[peep_start - emit_base + i] & 0xff;
+}
+
+void gen_peep_set(int i, int b)
+{
+    emit_buffer[peep_start - emit_base + i] = b;
+}
+
+void gen_push_reg(int reg)
+{
+    int b0, b1;
+
+    // mov reg,imm32 / mov reg,[ebp+X] / mov reg,ds:[X] and a push reg become push imm32 /
+    // push [ebp+X] / push ds:[X]. the operand stays where it was, and so do backpatches.
+    // reg is free after a push, it needn't be loaded
+    if (gen_peep_last() >= 0) {
+        b0 = gen_peep_byte(0);
+        b1 = gen_peep_byte(1);
+        if (b0 == 0xb8 + reg) {
+            gen_peep_set(0, 0x68);
+            ++peep_removed;
+            return;
+        }
+        if (b0 == 0x8b && ((b1 >> 3) & 7) == reg && ((b1 & 0xc7) == 0x85 || (b1 & 0xc7) == 0x45 || (b1 & 0xc7) == 0x05)) {
+            gen_peep_set(0, 0xff);
+            gen_peep_set(1, (b1 & 0xc7) | 0x30);
+            ++peep_removed;
+            return;
         }
+        if (b0 == 0x8b && (b1 & 0xf8) == (0xc0 | (reg << 3))) {
+            // a register variable: push it instead of the copy
+            gen_peep_set(0, 0x50 + (b1 & 7));
+            emit_pos = peep_start + 1;
+            gen_peep_mark(peep_start);
+            peep_removed += 2;
+            return;
+        }
+    }
+    gen_emitbyte(0x50 + reg);   // push reg
+    gen_peep_mark(emit_pos - 1);
+}
 
-        symbol_size[symidx] = size;
-        symbol_type[symidx] = type;
+void gen_pop_reg(int reg)
+{
+    int b0, b1;
+
+    // a push and a pop: the value goes to reg directly, the other way round than
+    // gen_push_reg
+    if (gen_peep_last() >= 0) {
+        b0 = gen_peep_byte(0);
+        b1 = gen_peep_byte(1);
+        if (b0 >= 0x50 && b0 < 0x58) {
+            --emit_pos;
+            peep_removed += 1;
+            if (b0 - 0x50 == reg)
+                peep_removed += 1;
+            gen_move(reg, b0 - 0x50);
+            gen_peep_barrier();
+            return;
+        }
+        if (b0 == 0x68) {
+            gen_peep_set(0, 0xb8 + reg);
+            ++peep_removed;
+            return;
+        }
+        if (b0 == 0xff && (b1 == 0xb5 || b1 == 0x75 || b1 == 0x35)) {
+            gen_peep_set(0, 0x8b);
+            gen_peep_set(1, (b1 & 0xc7) | (reg << 3));
+            ++peep_removed;
+            return;
+        }
+    }
+    gen_emitbyte(0x58 + reg);   // pop reg
+    gen_peep_barrier();
+}
 
-        if (tok == ',') {
-            type &= ~(POINTER|ARRAY);  // no pointer and no array flag
+void gen_add_esp(int n)
+{
+    if (n > 0 && n < 128)
+        gen_emitbytes(3, 0x83, 0xc4, n, 0);  // add esp, n
+    else if (n > 0) {
+        gen_emitbytes(2, 0x81, 0xc4, 0, 0);  // add esp, n
+        gen_emitdword(n);
+    }
+}
 
-            tok = lex_next_token();
-            if (tok != IDENTIFIER) {
-                if (tok != '*')
-                    parse_error(E_MISSING_IDENTIFIER);
+void gen_spill(int count)
+{
+    int reg;
+
+    // push the values below count that are still in registers. the pushed ones are
+    // always the lowest, so the machine stack keeps the order of the values
+    while (gen_value_pushed < count) {
+        reg = gen_value_reg[gen_value_pushed];
+        gen_push_reg(reg);
+        gen_reg_owner[reg] = -1;
+        gen_value_reg[gen_value_pushed] = -1;
+        ++gen_value_pushed;
+    }
+}
 
-                type |= POINTER;
-                tok = lex_next_token();
-            }
-            if (tok != IDENTIFIER)
-                parse_error(E_MISSING_IDENTIFIER);
+int gen_find_reg(int mask)
+{
+    int reg;
 
-            tok = lex_next_token();
-            continue;
+    reg = 0;
+    while (reg < 8) {
+        if ((mask & (1 << reg)) && gen_reg_owner[reg] == -1) {
+            gen_regs_used |= 1 << reg;
+            return reg;
         }
-        else if (tok != ';')
-            parse_error(E_MISSING_SEMICOLON);
+        ++reg;
+    }
+    return -1;
+}
 
-        return lex_next_token();
+int gen_alloc_reg(int mask)
+{
+    int reg;
+
+    // a free register of mask, taken by the current operation until gen_push_value or
+    // gen_free_reg. if there is none the lowest values are pushed until one is free
+    reg = gen_find_reg(mask);
+    while (reg < 0) {
+        if (gen_value_pushed == gen_value_count)
+            parse_error(E_BAD_EXPRESSION);  // an operation never takes that many registers
+        gen_spill(gen_value_pushed + 1);
+        reg = gen_find_reg(mask);
     }
+    gen_reg_owner[reg] = -2;
+    return reg;
 }
 
-int parse_vardecl(int tok)
+void gen_free_reg(int reg)
 {
-    int type;
+    gen_reg_owner[reg] = -1;
+}
 
-    if (tok == ENUM)
-        return parse_enum_decl(tok);
+void gen_push_value(int reg)
+{
+    int size;
 
-    type = tok;
-    if (tok != VOID && tok != INT && tok != CHAR)
-        parse_error(E_MISSING_TYPE);
+    if (gen_value_count == gen_value_capacity) {
+        size = arena_size(gen_value_capacity, gen_value_count + 1, GEN_VALUES_INITIAL);
+        gen_value_reg = arena_grow(gen_value_reg, 4 * gen_value_capacity, 4 * size);
+        gen_value_capacity = size;
+    }
+    gen_reg_owner[reg] = gen_value_count;
+    gen_value_reg[gen_value_count] = reg;
+    ++gen_value_count;
+}
 
-    tok = lex_next_token();
-    if (tok != IDENTIFIER) {
-        if (tok != '*')
-            parse_error(E_MISSING_IDENTIFIER);
+int gen_pop_value(int mask)
+{
+    int reg, old;
+
+    // the top value in a register of mask, taken like by gen_alloc_reg
+    --gen_value_count;
+    if (gen_value_count < gen_value_pushed) {
+        gen_value_pushed = gen_value_count;
+        reg = gen_alloc_reg(mask);
+        gen_pop_reg(reg);
+        return reg;
+    }
 
-        type |= POINTER;
-        tok = lex_next_token();
+    reg = gen_value_reg[gen_value_count];
+    gen_reg_owner[reg] = -2;
+    if (!(mask & (1 << reg))) {
+        old = reg;
+        reg = gen_alloc_reg(mask);
+        gen_move(reg, old);
+        gen_free_reg(old);
     }
+    return reg;
+}
 
-    return parse_vardecl2(lex_next_token(), type | LOCAL);
+int gen_top_reg(void)
+{
+    return gen_value_reg[gen_value_count - 1];  // -1: pushed
 }
 
-int stack_empty(int *stack)
+void gen_evict(int reg)
 {
-    return stack[0] == 0;
+    int value, other;
+
+    // the value in reg moves to a free register, or to the machine stack
+    value = gen_reg_owner[reg];
+    if (value < 0)
+        return;
+
+    other = gen_find_reg(REG_ANY);
+    if (other >= 0) {
+        gen_move(other, reg);
+        gen_reg_owner[other] = value;
+        gen_value_reg[value] = other;
+        gen_free_reg(reg);
+    }
+    else
+        gen_spill(value + 1);
 }
 
-void stack_push(int *stack, int value)
+int gen_arg_flags(int node)
 {
-    stack[++stack[0]] = value;
+    // a parameter is pushed when it is done, the ',' between them are not parameters
+    if (expr_table[4*node+0] == OPERATOR && expr_table[4*node+1] == ',')
+        return 0;
+    return GEN_ARG;
 }
 
-int stack_top(int *stack, int pop)
+int gen_is_variable(int node)
 {
-    int retval;
+    int type;
 
-    retval = -1;
-    if (!stack_empty(stack)) {
-        retval = stack[stack[0]];
+    // a variable that can be a memory operand: not an array name, which is an address
+    type = expr_table[4*node+0];
+    if (type == OPERATOR || type == NUMBER || type == STRING || type == ARG_VALUE)
+        return 0;
+    return (type & PARAM) || !(type & ARRAY);
+}
 
-        if (pop)
-            stack[0]--;
+int gen_var_register(int node)
+{
+    // the register of a variable that lives in one, 0: none
+    if (!gen_is_variable(node))
+        return 0;
+    return symbol_register[expr_table[4*node+1]];
+}
+
+int gen_var_mode(int node)
+{
+    if (symbol_register[expr_table[4*node+1]])
+        return MEM_REGISTER;
+    if (expr_table[4*node+0] & (LOCAL | PARAM))
+        return MEM_FRAME;
+    return MEM_ABSOLUTE;
+}
+
+int gen_var_disp(int node)
+{
+    int symidx;
+
+    // [ebp+X] for locals and parameters, the symbol of a global, or the register
+    symidx = expr_table[4*node+1];
+    if (symbol_register[symidx])
+        return symbol_register[symidx];
+    if (expr_table[4*node+0] & LOCAL)
+        return -symbol_address[symidx];
+    if (expr_table[4*node+0] & PARAM)
+        return symbol_address[symidx];
+    return symidx;
+}
+
+int gen_operand_kind(int node)
+{
+    int type;
+
+    // how the right operand of a binary operator can be given to the instruction
+    if (expr_table[4*node+0] == NUMBER)
+        return OPERAND_IMM;
+    if (gen_is_variable(node)) {
+        type = symbol_type[expr_table[4*node+1]];
+        if (!(type & (ARRAY | POINTER)) && (type & 0xff) == INT)
+            return OPERAND_MEM;
     }
+    return OPERAND_REG;
+}
 
-    return retval;
+void gen_mem(int reg, int mode, int scale, int disp)
+{
+    int base, mod;
+
+    // modrm, sib and displacement of a memory operand. reg is the register operand or the
+    // opcode extension, base and index registers come from gen_pop_address
+    if (mode == MEM_REGISTER) {
+        gen_emitbyte(0xc0 | (reg << 3) | disp);
+        return;
+    }
+    if (mode == MEM_ABSOLUTE) {
+        gen_emitbyte(0x05 | (reg << 3));
+        gen_add_global_backpatch(emit_pos, disp);
+        gen_emitdword(symbol_address[disp]);
+        return;
+    }
+
+    base = EBP;
+    if (mode != MEM_FRAME)
+        base = gen_mem_base;
+    mod = 0x80;                     // disp32
+    if (disp >= -128 && disp < 128)
+        mod = 0x40;                 // disp8
+    if (disp == 0 && base != EBP)
+        mod = 0;
+
+    if (mode == MEM_INDEX) {
+        gen_emitbyte(mod | (reg << 3) | 4);
+        gen_emitbyte((scale << 6) | (gen_mem_index << 3) | base);
+    }
+    else
+        gen_emitbyte(mod | (reg << 3) | base);
+
+    if (mod == 0x40)
+        gen_emitbyte(disp & 0xff);
+    else if (mod == 0x80)
+        gen_emitdword(disp);
 }
 
-int stack_pop(int *stack) { return stack_top(stack, 1); }
+void gen_mem_node(int reg, int node)
+{
+    gen_mem(reg, gen_var_mode(node), 0, gen_var_disp(node));
+}
 
-int parse_precedence(int op, int *assoc)
+void gen_pop_address(int mode, int mask)
 {
-    *assoc = 0; // left to right
+    // the registers of a memory operand are on top of the value stack, the index above the base
+    if (mode == MEM_INDEX)
+        gen_mem_index = gen_pop_value(mask);
+    if (mode == MEM_INDEX || mode == MEM_BASE)
+        gen_mem_base = gen_pop_value(mask);
+}
+
+void gen_free_address(int mode)
+{
+    if (mode == MEM_INDEX)
+        gen_free_reg(gen_mem_index);
+    if (mode == MEM_INDEX || mode == MEM_BASE)
+        gen_free_reg(gen_mem_base);
+}
+
+int gen_alu_ext(int op)
+{
+    // the opcode extension of add, or, and, sub, xor and cmp, the opcodes are 8 apart
+    if (op == '|' || op == ORASSIGN)
+        return 1;
+    if (op == '&' || op == ANDASSIGN)
+        return 4;
+    if (op == '-' || op == MINUSASSIGN)
+        return 5;
+    if (op == '^' || op == XORASSIGN)
+        return 6;
+    if (op == '+' || op == PLUSASSIGN)
+        return 0;
+    return 7;  // compare
+}
+
+void gen_alu(int ext, int a, int kind, int value)
+{
+    // a = a op value: value is a register, an immediate or the node of a variable
+    if (kind == OPERAND_IMM) {
+        if (value >= -128 && value < 128)
+            gen_emitbytes(3, 0x83, 0xc0 | (ext << 3) | a, value & 0xff, 0);  // op a,imm8
+        else {
+            gen_emitbytes(2, 0x81, 0xc0 | (ext << 3) | a, 0, 0);             // op a,imm32
+            gen_emitdword(value);
+        }
+    }
+    else if (kind == OPERAND_MEM) {
+        gen_emitbyte(8 * ext + 3);              // op a,DWORD PTR [X]
+        gen_mem_node(a, value);
+    }
+    else
+        gen_emitbytes(2, 8 * ext + 1, 0xc0 | (value << 3) | a, 0, 0);      // op a,value
+}
+
+void gen_alu_mem(int ext, int mode, int scale, int disp, int kind, int value)
+{
+    // [memory] = [memory] op value: value is a register or an immediate
+    if (kind == OPERAND_IMM) {
+        if (value >= -128 && value < 128) {
+            gen_emitbyte(0x83);                 // op DWORD PTR [X],imm8
+            gen_mem(ext, mode, scale, disp);
+            gen_emitbyte(value & 0xff);
+        }
+        else {
+            gen_emitbyte(0x81);                 // op DWORD PTR [X],imm32
+            gen_mem(ext, mode, scale, disp);
+            gen_emitdword(value);
+        }
+    }
+    else {
+        gen_emitbyte(8 * ext + 1);              // op DWORD PTR [X],value
+        gen_mem(value, mode, scale, disp);
+    }
+}
 
-    if (op == '=' || op == MULASSIGN || op == MINUSASSIGN
-        || op == PLUSASSIGN || op == DIVASSIGN || op == MODASSIGN
-        || op == LSHASSIGN || op == RSHASSIGN || op == ANDASSIGN || op == XORASSIGN || op == ORASSIGN)
-    {
-        *assoc = 1; // right to left
-        return 24;
-    }
-    else if (op == ARRAY_SUBSCRIPT || op == FUNCTION || op == PLUSPLUS || op == MINUSMINUS) return 11;
-    else if (op == PLUSPLUS || op == MINUSMINUS) return 11;
-    else if (op == ',') {
-        return 25;
-    }
-    else if (op == (UNARY | '-') || op == (UNARY | '+') || op == '~' || op == '!'
-        || op == (UNARY | '!') || op == '~' || op == (UNARY |'~') || op == (UNARY | '*') || op == (UNARY | '&')
-        || /* prefix ++/-- */op == (UNARY | MINUSMINUS) || op == (UNARY | PLUSPLUS)
-        )
-    {
-        *assoc = 1; // right to left
-        return 12;
-    }
-    else if (op == '*' || op == '/' || op == '%') return 13;
-    else if (op == '+' || op == '-') return 14;
-    else if (op == LSH || op == RSH) return 15;
-    else if (op == '<' || op == LE || op == '>' || op == GE) return 16;
-    else if (op == EQ || op == NEQ) return 17;
-    else if (op == '&') return 18;
-    else if (op == '^') return 19;
-    else if (op == '|') return 20;
-    else if (op == LOGAND) return 21;
-    else if (op == LOGOR) return 22;
-
-    return 1000;
-}
-
-int parse_add_elem(int *expr_table, int type, int value)
+int gen_scale(int type)
 {
-    int nextfree;
-
-    nextfree = expr_table[1];
-    expr_table[4*nextfree+0] = type;
-    expr_table[4*nextfree+1] = value;
-    expr_table[4*nextfree+2] = 0; // child1
-    expr_table[4*nextfree+3] = 0; // child2
-    expr_table[1] = nextfree+1;
-
-    if (expr_table[0] == 0)
-        expr_table[0] = nextfree;
-    return nextfree;
+    // pointer arithmetic: the shift for the size of the elements
+    if ((type & (ARRAY | POINTER)) && parse_get_size(parse_deref(type)) == 4)
+        return 2;
+    return 0;
 }
 
-void parse_reduce(int *expr_table, int *operator_stack, int *arg_stack)
+int gen_arith(int op, int type_left, int type_right, int kind, int value)
 {
-    int idx, op, child1, child2;
+    int a, b, type, left_is_pointer, right_is_pointer, scale;
+
+    // + - ^ | & << >>: the right operand is on top of the value stack, the left one below
+    // it, unless kind says the right one is an immediate or a variable
+    b = -1;
+    if (kind == OPERAND_REG) {
+        if (op == LSH || op == RSH) {
+            // the count goes to cl
+            if (gen_top_reg() != ECX)
+                gen_evict(ECX);
+            b = gen_pop_value(1 << ECX);
+        }
+        else
+            b = gen_pop_value(REG_ANY);
+        value = b;
+    }
+    a = gen_pop_value(REG_ANY);
 
-    op = stack_pop(operator_stack);
+    left_is_pointer = 0;
+    right_is_pointer = 0;
+    if (op == '+' || op == '-') {
+        left_is_pointer  = (type_left & ARRAY) || (type_left & POINTER);
+        right_is_pointer = (type_right & ARRAY) || (type_right & POINTER);
+    }
 
-    child2 = 0;
-    if (!(op & UNARY) && op != MINUSMINUS && op != PLUSPLUS) {
-        child2 = stack_pop(arg_stack);
+    type = INT;
+    if (left_is_pointer && !right_is_pointer) {
+        type = type_left;
+        scale = gen_scale(type_left);
+        if (kind == OPERAND_IMM)
+            gen_alu(gen_alu_ext(op), a, kind, value << scale);
+        else {
+            if (op == '-')
+                gen_emitbytes(2, 0xf7, 0xd8 | b, 0, 0);  // neg b
+            gen_emitbytes(3, 0x8d, 0x04 | (a << 3), (scale << 6) | (b << 3) | a, 0);  // lea a,DWORD PTR [a+b*scale]
+        }
     }
-    child1 = stack_pop(arg_stack);
-    if (child1 == -1 && op & FUNCTION) {
-        // -1 indicates the end of parameter list: ignore
-        child1 = stack_pop(arg_stack);
+    else if (!left_is_pointer && right_is_pointer) {
+        type = type_right;
+        if (op == '-')
+            gen_emitbytes(2, 0xf7, 0xd8 | a, 0, 0);  // neg a
+        gen_emitbytes(3, 0x8d, 0x04 | (b << 3), (gen_scale(type_right) << 6) | (a << 3) | b, 0);  // lea b,DWORD PTR [b+a*scale]
+        gen_free_reg(a);
+        gen_push_value(b);
+        return type;
     }
-
-    if (op == ARRAY_SUBSCRIPT) {
-        int idx2;
-
-        idx2 = parse_add_elem(expr_table, OPERATOR, '+');
-        expr_table[4*idx2+2] = child1;
-        expr_table[4*idx2+3] = child2;
-
-        idx = parse_add_elem(expr_table, OPERATOR, UNARY | '*');
-        expr_table[4*idx+2] = idx2;
+    else if (op == LSH || op == RSH) {
+        if (kind == OPERAND_IMM) {
+            if (op == LSH) gen_emitbytes(3, 0xc1, 0xe0 | a, value & 0xff, 0);   //  shl    a,imm8
+            if (op == RSH) gen_emitbytes(3, 0xc1, 0xf8 | a, value & 0xff, 0);   //  sar    a,imm8
+        }
+        else {
+            if (op == LSH) gen_emitbytes(2, 0xd3, 0xe0 | a, 0, 0);              //  shl    a,cl
+            if (op == RSH) gen_emitbytes(2, 0xd3, 0xf8 | a, 0, 0);              //  sar    a,cl
+        }
     }
     else {
-        idx = parse_add_elem(expr_table, OPERATOR, op);
-        expr_table[4*idx+2] = child1;
-        expr_table[4*idx+3] = child2;
+        gen_alu(gen_alu_ext(op), a, kind, value);
+
+        if (left_is_pointer && right_is_pointer && gen_scale(type_left) == 2) {
+            // we are subtracting pointer to int: result is 4 times too high
+            gen_emitbytes(3, 0xc1, 0xf8 | a, 0x02, 0);  //  sar    a,0x2
+        }
     }
 
-    expr_table[0] = idx;
-    stack_push(arg_stack, idx);
+    if (b >= 0)
+        gen_free_reg(b);
+    gen_push_value(a);
+    return type;
 }
 
-int parse_check_unary(int c, int last)
+int gen_log2(int value)
 {
-    if (c == '!' || c == '~')
-        return UNARY;
-
-    if (c == '-' || c == '+' || c == '*' || c == '&' || c == PLUSPLUS || c == MINUSMINUS) {
-        if (last == 0)
-            return UNARY;
-
-        if (last == NUMBER || last == IDENTIFIER || last == ')' || last == ']' || last == MINUSMINUS || last == PLUSPLUS)
-            return 0;
+    int k;
+
+    // k if value is 1 << k, else -1
+    k = 0;
+    while (k < 31 && (1 << k) < value)
+        ++k;
+    if (value > 0 && (1 << k) == value)
+        return k;
+    return -1;
+}
 
-        return UNARY;
+void gen_mul_imm(int a, int value)
+{
+    int k, rest;
+
+    // a = a * value, a power of 2 times 1, 3, 5 or 9 is a shift and a lea
+    k = 0;
+    rest = value;
+    while (rest > 0 && (rest & 1) == 0) {
+        rest = rest >> 1;
+        ++k;
     }
 
-    return 0;
+    if (value == 0)
+        gen_alu(6, a, OPERAND_REG, a);                                    // xor a,a
+    else if (value == -1)
+        gen_emitbytes(2, 0xf7, 0xd8 | a, 0, 0);                           // neg a
+    else if (rest == 1 || rest == 3 || rest == 5 || rest == 9) {
+        if (rest > 1)
+            gen_emitbytes(3, 0x8d, 0x04 | (a << 3), (gen_log2(rest - 1) << 6) | (a << 3) | a, 0);  // lea a,[a+a*(rest-1)]
+        if (k > 0)
+            gen_emitbytes(3, 0xc1, 0xe0 | a, k, 0);                       // shl a,k
+    }
+    else if (value >= -128 && value < 128)
+        gen_emitbytes(3, 0x6b, 0xc0 | (a << 3) | a, value & 0xff, 0);     // imul a,a,imm8
+    else {
+        gen_emitbytes(2, 0x69, 0xc0 | (a << 3) | a, 0, 0);                // imul a,a,imm32
+        gen_emitdword(value);
+    }
 }
 
-void parse_simplify_expression(int *expr_table, int root)
+void gen_div_imm(int op, int value)
 {
-    int op;
-
-    if (root != 0) {
-        if (expr_table[4*root+0] == ENUM) {
-            int symidx;
+    int a, b, k, shift, magic, rem;
+
+    // the top value / or % value, a constant > 1, without idiv. the quotient rounds
+    // towards 0: a power of 2 adds value-1 to a negative dividend before the shift
+    k = gen_log2(value);
+    if (k > 0) {
+        a = gen_pop_value(REG_ANY);
+        b = gen_alloc_reg(REG_ANY);
+        gen_move(b, a);
+        if (k > 1)
+            gen_emitbytes(3, 0xc1, 0xf8 | b, 31, 0);      // sar b,31
+        gen_emitbytes(3, 0xc1, 0xe8 | b, 32 - k, 0);      // shr b,32-k
+        gen_alu(0, a, OPERAND_REG, b);                     // add a,b
+        if (op == '/')
+            gen_emitbytes(3, 0xc1, 0xf8 | a, k, 0);        // sar a,k
+        else {
+            gen_alu(4, a, OPERAND_IMM, value - 1);         // and a,value-1
+            gen_alu(5, a, OPERAND_REG, b);                 // sub a,b
+        }
+        gen_free_reg(b);
+        gen_push_value(a);
+        return;
+    }
 
-            symidx = expr_table[4*root+1];
-            expr_table[4*root+0] = NUMBER;
-            expr_table[4*root+1] = symbol_address[symidx];
+    // other divisors multiply by a magic number (Granlund and Montgomery):
+    // q = (a + high(a * magic)) >> shift, plus 1 if a is negative. with 2^(shift+1) >= value,
+    // magic is 2^(32+shift) / value + 1 - 2^32, a long division that never overflows
+    shift = 0;
+    while (shift < 31 && (1 << shift) < value)
+        ++shift;
+    magic = 0;
+    rem = 1;
+    k = 0;
+    while (k < 31 + shift) {
+        magic = magic << 1;
+        if (rem >= value - rem) {
+            rem = rem - (value - rem);
+            magic = magic | 1;
         }
+        else
+            rem = rem + rem;
+        ++k;
+    }
+    magic = magic + 1;
+    shift = shift - 1;
+
+    a = gen_pop_value(REG_ANY & ~((1 << EAX) | (1 << EDX)));
+    gen_evict(EAX);
+    gen_reg_owner[EAX] = -2;
+    gen_evict(EDX);
+    gen_reg_owner[EDX] = -2;
+    gen_emitbyte(0xb8);                                    // mov eax,magic
+    gen_emitdword(magic);
+    gen_emitbytes(2, 0xf7, 0xe8 | a, 0, 0);                // imul a
+    gen_alu(0, EDX, OPERAND_REG, a);                       // add edx,a
+    gen_emitbytes(3, 0xc1, 0xf8 | EDX, shift, 0);          // sar edx,shift
+    gen_move(EAX, a);
+    gen_emitbytes(3, 0xc1, 0xe8 | EAX, 31, 0);             // shr eax,31
+    gen_alu(0, EDX, OPERAND_REG, EAX);                     // add edx,eax
+    gen_free_reg(EAX);
+    if (op == '/') {
+        gen_free_reg(a);
+        gen_push_value(EDX);
+    }
+    else {
+        gen_mul_imm(EDX, value);
+        gen_alu(5, a, OPERAND_REG, EDX);                   // sub a,edx
+        gen_free_reg(EDX);
+        gen_push_value(a);
+    }
+}
 
-        if (expr_table[4*root+0] != OPERATOR)
-            return; // is already a constant or variable
+void gen_deref(int mode, int scale, int disp, int type, int addr_only)
+{
+    int a;
+
+    // the value at a memory operand, or its address
+    if (addr_only && mode == MEM_BASE && disp == 0)
+        return;  // the address is on the value stack already
+
+    gen_pop_address(mode, REG_ANY);
+    if (mode == MEM_BASE || mode == MEM_INDEX)
+        a = gen_mem_base;
+    else
+        a = gen_alloc_reg(REG_ANY);
+
+    if (addr_only)
+        gen_emitbyte(0x8d);                     // lea a,[X]
+    else if ((type & POINTER) || (type & 0xff) == INT)
+        gen_emitbyte(0x8b);                     // mov a,DWORD PTR [X]
+    else
+        gen_emitbytes(2, 0x0f, 0xb6, 0, 0);     // movzx a,BYTE PTR [X]
+    gen_mem(a, mode, scale, disp);
+
+    if (mode == MEM_INDEX)
+        gen_free_reg(gen_mem_index);
+    gen_push_value(a);
+}
 
-        op = expr_table[4*root+1];
+void gen_load_mem(int reg, int mode, int scale, int disp, int is_byte)
+{
+    if (is_byte)
+        gen_emitbytes(2, 0x0f, 0xb6, 0, 0);     // movzx reg,BYTE PTR [X]
+    else
+        gen_emitbyte(0x8b);                     // mov reg,DWORD PTR [X]
+    gen_mem(reg, mode, scale, disp);
+}
 
-        if (op & UNARY) {
-            int child;
+int gen_leaf(int root, int flags)
+{
+    int type, expr_type, reg, start, value;
 
-            parse_simplify_expression(expr_table, expr_table[4*root+2]);
-            child = expr_table[4*root+2];
+    type = expr_table[4*root+0];
+    reg = gen_alloc_reg(REG_ANY);
+    start = emit_pos;
+    if (type == NUMBER || type == STRING) {
+        // not an operator
+        gen_emitbyte(0xb8 + reg);  // mov reg, imm32
+        expr_type = INT;
+        if (type != NUMBER) {
+            gen_add_backpatch(STRING, emit_pos);
+            expr_type = POINTER | CHAR;
+        }
 
-            if (op == (UNARY | '-')) {
-                if (expr_table[4*child+0] == NUMBER) {
-                    expr_table[4*root+1] = -expr_table[4*child+1];
-                    expr_table[4*root+0] = NUMBER;
-                }
+        gen_emitdword(expr_table[4*root+1]);
+    }
+    else if (type == ARG_VALUE) {
+        // a parameter of an inlined function: the value of the argument, which may have
+        // been pushed in the meantime
+        value = expr_table[4*root+1];
+        if (value < gen_value_pushed) {
+            value = 4 * (gen_value_pushed - 1 - value);
+            if (value < 128)
+                gen_emitbytes(4, 0x8b, 0x44 | (reg << 3), 0x24, value);  // mov reg,DWORD PTR [esp+X]
+            else {
+                gen_emitbytes(3, 0x8b, 0x84 | (reg << 3), 0x24, 0);
+                gen_emitdword(value);
             }
         }
-        else /* binary */ {
-            int child1, child2;
+        else
+            gen_move(reg, gen_value_reg[value]);
+        expr_type = expr_table[4*root+2];
+    }
+    else {
+        // variable
+        int symidx;
 
-            child1 = expr_table[4*root+2];
-            parse_simplify_expression(expr_table, child1); // expr_table may have changed during simplification
-            child1 = expr_table[4*root+2];
-            child2 = expr_table[4*root+3];
-            parse_simplify_expression(expr_table, child2); // expr_table may have changed during simplification
-            child2 = expr_table[4*root+3];
+        symidx = expr_table[4*root+1];
+        if (!gen_is_variable(root))
+            flags |= ADDR_ONLY;  // array name is the address if it's not a parameter
 
-            if (expr_table[4*child1+0] == NUMBER && expr_table[4*child2+0] == NUMBER) {
-                if (op == '+') {
-                    expr_table[4*root+1] = expr_table[4*child1+1] + expr_table[4*child2+1];
-                    expr_table[4*root+0] = NUMBER;
-                }
-                else if (op == '*') {
-                    expr_table[4*root+1] = expr_table[4*child1+1] * expr_table[4*child2+1];
-                    expr_table[4*root+0] = NUMBER;
-                }
-                else if (op == '-') {
-                    expr_table[4*root+1] = expr_table[4*child1+1] - expr_table[4*child2+1];
-                    expr_table[4*root+0] = NUMBER;
-                }
-                else if (op == '/') {
-                    expr_table[4*root+1] = expr_table[4*child1+1] / expr_table[4*child2+1];
-                    expr_table[4*root+0] = NUMBER;
-                }
-                else if (op == NEQ) {
-                    expr_table[4*root+1] = expr_table[4*child1+1] != expr_table[4*child2+1];
-                    expr_table[4*root+0] = NUMBER;
-                }
+        expr_type = symbol_type[symidx];
+        if (flags & ADDR_ONLY) {
+            if (gen_var_mode(root) == MEM_FRAME) {
+                gen_emitbyte(0x8d);                         // lea reg, dword ptr [ebp+X]
+                gen_mem_node(reg, root);
             }
+            else {
+                gen_emitbyte(0xb8 + reg);                   // mov reg, absolute
+                gen_add_global_backpatch(emit_pos, symidx);
+                gen_emitdword(symbol_address[symidx]);
+            }
+        }
+        else {
+            if (symbol_size[symidx] >= 4)
+                gen_emitbyte(0x8b);                         // mov reg, dword ptr [X]
+            else
+                gen_emitbytes(2, 0x0f, 0xb6, 0, 0);         // movzx reg, byte ptr [X]
+            gen_mem_node(reg, root);
         }
     }
+    gen_peep_mark(start);
+    gen_push_value(reg);
+    return expr_type;
 }
 
-enum Flags_genexpr {
-    ADDR_ONLY  = 0x100,    // result must be the address (don't load value)
-};
-
-int parse_deref(int type)
+int gen_count_args(int node)
 {
-    if (type & ARRAY)
-        return type & ~ARRAY;
-
-    if (type & POINTER)
-        return type & ~POINTER;
-
-    return type;
+    // the parameters of a call, the ',' between them are no parameters
+    if (node == 0)
+        return 0;
+    if (expr_table[4*node+0] == OPERATOR && expr_table[4*node+1] == ',')
+        return gen_count_args(expr_table[4*node+2]) + gen_count_args(expr_table[4*node+3]);
+    return 1;
 }
 
-int parse_get_size(int type)
+int gen_inline_body(int symidx, int first)
 {
-    if (type & ARRAY)
-        return 4;
-    if (type & POINTER)
-        return 4;
-    if ((type & 0xff) == INT)
-        return 4;
-
-    return 1;
+    int start, count, params, base, node, i;
+
+    // a copy of the tree of an inlined function at the end of expr_table. its parameters
+    // become the values of the arguments, the last one is value first, see gen_expr
+    start = symbol_inline[symidx];
+    count = inline_node[4*start+1];
+    params = inline_node[4*start+2];
+    parse_reserve_nodes(count);
+    base = expr_table[1] - 1;  // node i of the tree is base + i
+    node = 1;
+    while (node <= count) {
+        i = 0;
+        while (i < 4) {
+            expr_table[4*(base+node)+i] = inline_node[4*(start+node)+i];
+            ++i;
+        }
+        if (expr_table[4*(base+node)+0] == OPERATOR) {
+            if (expr_table[4*(base+node)+2] != 0)
+                expr_table[4*(base+node)+2] += base;
+            if (expr_table[4*(base+node)+3] != 0)
+                expr_table[4*(base+node)+3] += base;
+        }
+        else if (expr_table[4*(base+node)+0] == ARG_VALUE)
+            expr_table[4*(base+node)+1] = first + params - 1 - expr_table[4*(base+node)+1];
+        ++node;
+    }
+    expr_table[1] = base + count + 1;
+    return base + inline_node[4*start+0];
 }
 
-void gen_expr(int *expr_table, int root, int *comma_count, int flags, int *expr_type)
+int gen_expr(int root, int flags)
 {
-    int type, op, dummy;
-
-    type = expr_table[4*root+0];
-    op = expr_table[4*root+1];
-
-    if (root == 0)
-        return;
+    int frame, base, type, op, phase, child, child1, child2, next, next_flags, counter, next_counter;
+    int root_flags, a, b, reg, kind, value, mode, disp, scale;
+
+    // a node is visited once before its children and once after each of them:
+    // FRAME_PHASE tells how far it is. next is the child to generate now, -1 when
+    // the node is done: its value is on top of the value stack then and its type
+    // goes to the parent's FRAME_CHILD. a GEN_MEMORY node leaves the registers of
+    // a memory operand instead and describes it in the parent's FRAME_MODE
+    gen_frame_count = 0;
+    gen_value_count = 0;
+    gen_value_pushed = 0;
+    gen_branch_cc = -1;
+    gen_inline_depth = 0;
+    reg = 0;
+    while (reg < 8) {
+        gen_reg_owner[reg] = -1;
+        if (gen_reg_vars & (1 << reg))
+            gen_reg_owner[reg] = -2;  // a variable lives there
+        ++reg;
+    }
 
-    if (type == OPERATOR) {
-        if (!(op & UNARY) && op == ',') {
-            // right to left
-            ++*comma_count;
+    root_flags = flags;
+    gen_push_frame(root, flags, -1);
+    type = INT;
+    while (gen_frame_count > 0) {
+        frame = gen_frame_count - 1;
+        base = FRAME_SIZE * frame;
+        root = gen_frames[base+FRAME_NODE];
+        flags = gen_frames[base+FRAME_FLAGS];
+        phase = gen_frames[base+FRAME_PHASE];
+        type = gen_frames[base+FRAME_TYPE];
+        child = gen_frames[base+FRAME_CHILD];
+        counter = gen_frames[base+FRAME_COUNTER];
+        mode = gen_frames[base+FRAME_MODE];
+        disp = gen_frames[base+FRAME_DISP];
+        scale = gen_frames[base+FRAME_SCALE];
+        op = expr_table[4*root+1];
+        child1 = expr_table[4*root+2];
+        child2 = expr_table[4*root+3];
+        next = -1;
+        next_flags = 0;
+        next_counter = -1;
+        kind = OPERAND_REG;
+        value = 0;
+        b = -1;
+
+        if (root == 0)
+            ;
+        else if (expr_table[4*root+0] != OPERATOR) {
+            if ((flags & GEN_MEMORY) && gen_is_variable(root)) {
+                // the variable itself is the operand
+                type = symbol_type[expr_table[4*root+1]];
+                mode = gen_var_mode(root);
+                disp = gen_var_disp(root);
+            }
+            else {
+                type = gen_leaf(root, flags);
+                mode = MEM_BASE;
+                disp = 0;
+            }
+        }
+        else if (!(op & UNARY) && op == ',') {
+            // right to left, both values stay
+            if (phase == 0) {
+                if (counter >= 0)
+                    ++gen_frames[FRAME_SIZE*counter+FRAME_COUNT];
+                next = child2;
+            }
+            else if (phase == 1)
+                next = child1;
 
-            gen_expr(expr_table, expr_table[4*root+3], comma_count, flags & ~ADDR_ONLY, &dummy);
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, &dummy);
+            if (next >= 0 && counter >= 0) {
+                next_flags = gen_arg_flags(next);
+                next_counter = counter;
+            }
         }
         else if (op == (UNARY | '*')) {
-            // dereference operator
-
-            if (!(flags & ADDR_ONLY)) {
-                gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, expr_type);
-                *expr_type = parse_deref(*expr_type);
-
-                gen_emitbyte(0x58);                  // pop eax
-                if ((*expr_type & POINTER) || (*expr_type & 0xff) == INT) {
-                    gen_emitbytes(2, 0xff, 0x30, 0, 0);  // push   DWORD PTR [eax]
+            int inner, ptr_type, type_left;
+
+            // dereference operator: p[i], which is *(p + i), and *(p + n) become memory
+            // operands with an index or a displacement
+            inner = expr_table[4*child1+1];
+            ptr_type = 0;
+            if (expr_table[4*child1+0] == OPERATOR && (inner == '+' || inner == '-')) {
+                if (phase == 0)
+                    next = expr_table[4*child1+2];
+                else if (phase == 1) {
+                    gen_frames[base+FRAME_LEFT] = child;
+                    kind = gen_operand_kind(expr_table[4*child1+3]);
+                    if (kind != OPERAND_IMM)
+                        next = expr_table[4*child1+3];
+                    else
+                        value = expr_table[4*expr_table[4*child1+3]+1];
                 }
-                else {
-                    gen_emitbytes(3, 0x0f, 0xb6, 0x00, 0);  // movzx  eax,BYTE PTR [eax]
-                    gen_emitbyte(0x50);                  // push eax
+
+                if (next < 0) {
+                    type_left = gen_frames[base+FRAME_LEFT];
+                    if (phase == 2)
+                        kind = OPERAND_REG;
+                    else
+                        child = INT;
+
+                    mode = MEM_BASE;
+                    disp = 0;
+                    scale = 0;
+                    if ((type_left & (ARRAY | POINTER)) && !(child & (ARRAY | POINTER))) {
+                        ptr_type = type_left;
+                        if (kind == OPERAND_IMM) {
+                            disp = value << gen_scale(type_left);
+                            if (inner == '-')
+                                disp = -disp;
+                        }
+                        else {
+                            if (inner == '-') {
+                                b = gen_pop_value(REG_ANY);
+                                gen_emitbytes(2, 0xf7, 0xd8 | b, 0, 0);  // neg b
+                                gen_push_value(b);
+                            }
+                            mode = MEM_INDEX;
+                            scale = gen_scale(type_left);
+                        }
+                    }
+                    else
+                        ptr_type = gen_arith(inner, type_left, child, kind, value);
                 }
             }
+            else if (phase == 0)
+                next = child1;
             else {
-                gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, expr_type);
-                *expr_type = parse_deref(*expr_type);
+                ptr_type = child;
+                mode = MEM_BASE;
+                disp = 0;
+                scale = 0;
+            }
+
+            if (next < 0) {
+                type = parse_deref(ptr_type);
+                if (!(flags & GEN_MEMORY))
+                    gen_deref(mode, scale, disp, type, flags & ADDR_ONLY);
             }
         }
         else if (op == (UNARY | '-')) {
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, expr_type);
-            gen_emitbyte(0x58);                     // pop eax
-            gen_emitbytes(3, 0x83, 0xf0, 0xff, 0);  // xor eax,0xffffffff
-            gen_emitbyte(0x40);                     // inc eax
-            gen_emitbyte(0x50);                     // push eax
+            if (phase == 0)
+                next = child1;
+            else {
+                type = child;
+                a = gen_pop_value(REG_ANY);
+                gen_emitbytes(2, 0xf7, 0xd8 | a, 0, 0);  // neg a
+                gen_push_value(a);
+            }
         }
         else if (op == (UNARY | '&')) {
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags | ADDR_ONLY, expr_type);
-            *expr_type |= POINTER;
+            if (phase == 0) {
+                next = child1;
+                next_flags = ADDR_ONLY;
+            }
+            else
+                type = child | POINTER;
         }
         else if (op == (UNARY | '!')) {
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, expr_type);
-            gen_emitbyte(0x5b);                     // pop ebx
-            gen_emitbytes(2, 0x31, 0xc0, 0, 0);     // xor eax,eax
-            gen_emitbytes(2, 0x09, 0xdb, 0, 0);     // or ebx,ebx
-            gen_emitbytes(3, 0x0f, 0x94, 0xc0, 0);  // sete  al
-            gen_emitbyte(0x50);                     // push eax
-            *expr_type = INT;
+            if (phase == 0)
+                next = child1;
+            else {
+                a = gen_pop_value(REG_BYTE);
+                gen_emitbytes(2, 0x85, 0xc0 | (a << 3) | a, 0, 0);     // test a,a
+                gen_emitbytes(3, 0x0f, 0x94, 0xc0 | a, 0);             // sete a8
+                gen_emitbytes(3, 0x0f, 0xb6, 0xc0 | (a << 3) | a, 0);  // movzx a,a8
+                gen_push_value(a);
+                type = INT;
+            }
         }
         else if (op == (UNARY | '~') || op == '~') {
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, expr_type);
-            gen_emitbyte(0x5b);                     // pop ebx
-            gen_emitbytes(2, 0xf7, 0xd3, 0, 0);     // not ebx
-            gen_emitbyte(0x53);                     // push ebx
+            if (phase == 0)
+                next = child1;
+            else {
+                type = child;
+                a = gen_pop_value(REG_ANY);
+                gen_emitbytes(2, 0xf7, 0xd0 | a, 0, 0);  // not a
+                gen_push_value(a);
+            }
         }
         else if (op & FUNCTION) {
-            int symidx, param_count;
-            symidx = expr_table[4*root+2];
-            *expr_type = expr_table[4*symidx+1];
-            symidx = expr_table[4*symidx+1];
+            int symidx, param_count, first, k;
+
+            symidx = expr_table[4*child1+1];
+            if (phase == 0 && symbol_inline[symidx] && gen_inline_depth < INLINE_DEPTH
+                    && gen_count_args(child2) == inline_node[4*symbol_inline[symidx]+2]) {
+                // a function that is one expression: the arguments stay on the value
+                // stack, and its tree takes the parameters from there
+                gen_frames[base+FRAME_INLINE] = gen_value_count + 1;
+                type = symbol_type[symidx] & ~(FUNCTION | DEFINED);
+                next = child2;
+                if (child2 == 0)
+                    phase = 1;
+            }
 
-            param_count = 0;
-            if (expr_table[4*root+3] != 0) {
-                param_count = 1;
-                gen_expr(expr_table, expr_table[4*root+3], &param_count, flags & ~ADDR_ONLY, &dummy);
+            first = gen_frames[base+FRAME_INLINE] - 1;
+            if (first >= 0) {
+                if (phase == 1) {
+                    next = gen_inline_body(symidx, first);
+                    next_flags = flags & FOR_EFFECT;
+                    ++gen_inline_depth;
+                }
+                else if (phase == 2) {
+                    // its value takes the place of the arguments
+                    --gen_inline_depth;
+                    b = -1;
+                    if (gen_value_count > first + inline_node[4*symbol_inline[symidx]+2])
+                        b = gen_pop_value(REG_ANY);
+                    while (gen_value_count > first) {
+                        --gen_value_count;
+                        if (gen_value_count >= gen_value_pushed)
+                            gen_free_reg(gen_value_reg[gen_value_count]);
+                    }
+                    if (gen_value_pushed > first) {
+                        gen_add_esp(4 * (gen_value_pushed - first));
+                        gen_value_pushed = first;
+                    }
+                    if (b >= 0)
+                        gen_push_value(b);
+                }
+            }
+            else if (phase == 0) {
+                // the callee may use every register
+                gen_spill(gen_value_count);
+
+                type = symbol_type[symidx] & ~(FUNCTION | DEFINED);  // the return type
+                if (child2 != 0) {
+                    // the parameters, each ',' among them counts one more
+                    gen_frames[base+FRAME_COUNT] = 1;
+                    next = child2;
+                    next_flags = gen_arg_flags(child2);
+                    next_counter = frame;
+                }
             }
 
-            gen_emitbyte(0xe8);  // call
-            if (symbol_address[symidx] != 0) {
-                // we know the target address already
-                gen_emitdword(symbol_address[symidx] - (emit_pos + 4));
+            if (first < 0 && next < 0 && (flags & GEN_TAIL)) {
+                // the arguments are on the machine stack, the first one on top: they are popped
+                // into the parameters. the function calls itself by going back to its start,
+                // another one gets a jmp after the epilog
+                param_count = gen_frames[base+FRAME_COUNT];
+                gen_value_count -= param_count;
+                gen_value_pushed -= param_count;
+                k = 0;
+                while (k < param_count) {
+                    gen_emitbyte(0x8f);             // pop DWORD PTR [ebp+X]
+                    gen_mem(0, MEM_FRAME, 0, 8 + 4*k);
+                    ++k;
+                }
+                if (symidx == gen_function) {
+                    gen_emitbyte(0xe9);   // jmp
+                    gen_emitlabel(gen_body_label);
+                }
+                else {
+                    gen_tail_calls = stack_reserve(gen_tail_calls, &gen_tail_call_capacity, 1);
+                    stack_push(gen_tail_calls, emit_pos);  // the pops of the saved registers go here
+                    gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xe9); // mov esp,ebp / pop ebp / jmp
+                    gen_add_backpatch(0, emit_pos);
+                    gen_emitdword(symidx);
+                }
+                gen_peep_barrier();
             }
-            else {
+            else if (first < 0 && next < 0) {
+                param_count = gen_frames[base+FRAME_COUNT];
+
+                gen_emitbyte(0xe8);  // call, backpatched at the end of the function at the latest
                 gen_add_backpatch(0, emit_pos);
                 gen_emitdword(symidx);
-            }
 
-            if (param_count > 0) {
-                gen_emitbytes(2, 0x81, 0xc4, 0, 0); // add esp, n
-                gen_emitdword(param_count*4);
+                gen_value_count -= param_count;
+                gen_value_pushed -= param_count;
+                gen_add_esp(param_count*4);
+                gen_push_value(EAX);
             }
-            gen_emitbyte(0x50);   // push eax
         }
         else if (op == '=') {
-            int type_left;
-
-            gen_expr(expr_table, expr_table[4*root+3], comma_count, flags & ~ADDR_ONLY, expr_type);
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags | ADDR_ONLY, &type_left);
-            gen_emitbyte(0x5b);                  // pop ebx
-            gen_emitbyte(0x58);                  // pop eax
-            if ((type_left & (ARRAY|POINTER)) || (type_left & 0xff) == INT)
-                gen_emitbytes(2, 0x89, 0x03, 0, 0);  // mov DWORD PTR [ebx],eax
-            else
-                gen_emitbytes(2, 0x88, 0x03, 0, 0);  // mov BYTE PTR [ebx],al
-            gen_emitbyte(0x50);                  // push eax
+            kind = gen_operand_kind(child2);
+            if (phase == 0 && kind == OPERAND_IMM)
+                phase = 1;  // the value goes into the instruction
+
+            if (phase == 0)
+                next = child2;
+            else if (phase == 1) {
+                if (kind != OPERAND_IMM)
+                    type = child;
+                next = child1;
+                next_flags = GEN_MEMORY | ADDR_ONLY;
+            }
+            else {
+                int is_byte;
+
+                is_byte = !(child & (ARRAY|POINTER)) && (child & 0xff) != INT;
+                gen_pop_address(mode, REG_ANY);
+                if (kind == OPERAND_IMM) {
+                    value = expr_table[4*child2+1];
+                    if (is_byte) {
+                        gen_emitbyte(0xc6);                  // mov BYTE PTR [X],imm8
+                        gen_mem(0, mode, scale, disp);
+                        gen_emitbyte(value & 0xff);
+                    }
+                    else if (mode == MEM_REGISTER) {
+                        gen_emitbyte(0xb8 + disp);           // mov reg,imm32
+                        gen_emitdword(value);
+                    }
+                    else {
+                        gen_emitbyte(0xc7);                  // mov DWORD PTR [X],imm32
+                        gen_mem(0, mode, scale, disp);
+                        gen_emitdword(value);
+                    }
+                    if (!(flags & FOR_EFFECT)) {
+                        b = gen_alloc_reg(REG_ANY);
+                        gen_emitbyte(0xb8 + b);              // mov b,imm32
+                        gen_emitdword(value);
+                        gen_push_value(b);
+                    }
+                }
+                else {
+                    if (is_byte) {
+                        b = gen_pop_value(REG_BYTE);
+                        gen_emitbyte(0x88);                  // mov BYTE PTR [X],b8
+                    }
+                    else {
+                        b = gen_pop_value(REG_ANY);
+                        gen_emitbyte(0x89);                  // mov DWORD PTR [X],b
+                    }
+                    gen_mem(b, mode, scale, disp);
+                    gen_push_value(b);
+                }
+                gen_free_address(mode);
+            }
         }
         else if (op == NEQ || op == EQ || op == '<' || op == '>' || op == LE || op == GE) {
-            gen_expr(expr_table, expr_table[4*root+3], comma_count, flags & ~ADDR_ONLY, &dummy);
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, expr_type);
-            gen_emitbyte(0x58);                    // pop eax
-            gen_emitbyte(0x5b);                    // pop ebx
-            gen_emitbytes(2, 0x31, 0xc9, 0, 0);    // xor    ecx,ecx
-            gen_emitbytes(2, 0x39, 0xd8, 0, 0);    // cmp    eax,ebx
-            if (op == NEQ) gen_emitbytes(3, 0x0f, 0x95, 0xc1, 0); // setne  cl
-            if (op == EQ) gen_emitbytes(3, 0x0f, 0x94, 0xc1, 0);  // sete  cl
-            if (op == '<') gen_emitbytes(3, 0x0f, 0x9c, 0xc1, 0); // setl  cl
-            if (op == '>') gen_emitbytes(3, 0x0f, 0x9f, 0xc1, 0); // setg  cl
-            if (op == LE) gen_emitbytes(3, 0x0f, 0x9e, 0xc1, 0);  // setle  cl
-            if (op == GE) gen_emitbytes(3, 0x0f, 0x9d, 0xc1, 0);  // setge  cl
-
-            gen_emitbyte(0x51);                    // push ecx
-        }
-        else if (op == '*' || op == '%' || op == '/') {
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, &dummy);
-            gen_expr(expr_table, expr_table[4*root+3], comma_count, flags & ~ADDR_ONLY, expr_type);
-            gen_emitbyte(0x59);                          // pop ecx
-            gen_emitbyte(0x58);                          // pop eax
+            int setcc;
 
-            if (op == '*')
-                gen_emitbytes(2, 0xf7, 0xe9, 0, 0);     // imul   ecx
+            kind = gen_operand_kind(child2);
+            if (phase == 0 && kind != OPERAND_REG)
+                phase = 1;  // the right operand goes into the cmp
+
+            if (phase == 0)
+                next = child2;
+            else if (phase == 1 && !((flags & FOR_BRANCH) && gen_var_register(child1)))
+                next = child1;
             else {
-                gen_emitbytes(2, 0x31, 0xd2, 0, 0);     // xor    edx,edx
-                gen_emitbytes(2, 0xf7, 0xf9, 0, 0);     // idiv   ecx
+                // a register variable on the left is compared as it is
+                if (phase == 1) {
+                    type = symbol_type[expr_table[4*child1+1]];
+                    a = gen_var_register(child1);
+                }
+                else {
+                    type = child;
+                    a = gen_pop_value(REG_BYTE);
+                }
+                if (kind == OPERAND_REG)
+                    value = gen_pop_value(REG_ANY);
+                else if (kind == OPERAND_IMM)
+                    value = expr_table[4*child2+1];
+                else
+                    value = child2;
+                gen_alu(7, a, kind, value);                            // cmp a,value
+
+                setcc = 0x95;                   // setne
+                if (op == EQ)  setcc = 0x94;    // sete
+                if (op == '<') setcc = 0x9c;    // setl
+                if (op == '>') setcc = 0x9f;    // setg
+                if (op == LE)  setcc = 0x9e;    // setle
+                if (op == GE)  setcc = 0x9d;    // setge
+
+                if (kind == OPERAND_REG)
+                    gen_free_reg(value);
+                if (flags & FOR_BRANCH) {
+                    // the jump uses the flags, there is no value
+                    gen_branch_cc = setcc & 0x0f;
+                    if (phase == 2)
+                        gen_free_reg(a);
+                }
+                else {
+                    gen_emitbytes(3, 0x0f, setcc, 0xc0 | a, 0);            // setcc a8
+                    gen_emitbytes(3, 0x0f, 0xb6, 0xc0 | (a << 3) | a, 0);  // movzx a,a8
+                    gen_push_value(a);
+                }
             }
-            if (op == '%')
-                gen_emitbyte(0x52);     // push edx
-            else
-                gen_emitbyte(0x50);     // push eax
         }
-        else if (op == '+' || op == '-' || op == '^' || op == '|' || op == '&' || op == LSH || op == RSH) {
-            int type_left, type_right, aithmetic_done;
-            int left_is_pointer, right_is_pointer;
-
-            aithmetic_done = 0;
-            left_is_pointer = 0;
-            right_is_pointer = 0;
-
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, &type_left);
-            gen_expr(expr_table, expr_table[4*root+3], comma_count, flags & ~ADDR_ONLY, &type_right);
-            gen_emitbyte(0x59);                                     //        pop    ecx
-
-            if (op == '+' || op == '-') {
-                left_is_pointer  = (type_left & ARRAY) || (type_left & POINTER);
-                right_is_pointer = (type_right & ARRAY) || (type_right & POINTER);
-
-                if (left_is_pointer && !right_is_pointer) {
-                    aithmetic_done = 1;
-                    *expr_type = type_left;
-
-                    if (op == '-') {
-                        // ecx = -ecx
-                        gen_emitbytes(3, 0x83, 0xf1, 0xff, 0);  // xor ecx,0xffffffff
-                        gen_emitbyte(0x41);                     // inc ecx
+        else if (op == '*' || op == '%' || op == '/') {
+            // a divisor below 2 takes idiv, those are rare
+            kind = gen_operand_kind(child2);
+            if (op != '*' && (kind != OPERAND_IMM || expr_table[4*child2+1] < 2))
+                kind = OPERAND_REG;
+
+            if (phase == 0)
+                next = child1;
+            else if (phase == 1 && kind == OPERAND_REG)
+                next = child2;
+            else {
+                if (kind == OPERAND_REG)
+                    type = child;
+                if (op == '*') {
+                    if (kind == OPERAND_REG)
+                        b = gen_pop_value(REG_ANY);
+                    a = gen_pop_value(REG_ANY);
+                    if (kind == OPERAND_IMM)
+                        gen_mul_imm(a, expr_table[4*child2+1]);
+                    else if (kind == OPERAND_MEM) {
+                        gen_emitbytes(2, 0x0f, 0xaf, 0, 0);                   // imul a,DWORD PTR [X]
+                        gen_mem_node(a, child2);
                     }
-                    gen_emitbyte(0x5b);                        //                pop ebx
-                    if ((type_left & (ARRAY | POINTER)) && parse_get_size(parse_deref(type_left)) == 4)
-                        gen_emitbytes(3, 0x8d, 0x1c, 0x8b, 0); //                lea    ebx,DWORD PTR [ebx+ecx*4]
-                    else
-                        gen_emitbytes(3, 0x8d, 0x1c, 0x0b, 0); //                lea    ebx,DWORD PTR [ebx+ecx*1]
-
-                    gen_emitbyte(0x53);                        //                push   ebx
+                    else {
+                        gen_emitbytes(3, 0x0f, 0xaf, 0xc0 | (a << 3) | b, 0);  // imul a,b
+                        gen_free_reg(b);
+                    }
+                    gen_push_value(a);
                 }
-                else if (!left_is_pointer && right_is_pointer) {
-                    aithmetic_done = 1;
-                    *expr_type = type_right;
-
-                    gen_emitbyte(0x5b);                        //                pop ebx
-                    if (op == '-') {
-                        // ebx = -ebx
-                        gen_emitbytes(3, 0x83, 0xf3, 0xff, 0);  // xor ebx,0xffffffff
-                        gen_emitbyte(0x43);                     // inc ebx
+                else if (kind == OPERAND_IMM)
+                    gen_div_imm(op, expr_table[4*child2+1]);
+                else {
+                    // the dividend goes to eax, edx is overwritten
+                    b = gen_pop_value(REG_ANY & ~((1 << EAX) | (1 << EDX)));
+                    if (gen_top_reg() != EAX)
+                        gen_evict(EAX);
+                    a = gen_pop_value(1 << EAX);
+                    gen_evict(EDX);
+                    gen_reg_owner[EDX] = -2;
+
+                    gen_emitbyte(0x99);                      // cdq: the sign of eax in edx
+                    gen_emitbytes(2, 0xf7, 0xf8 | b, 0, 0);  // idiv   b
+                    gen_free_reg(b);
+                    if (op == '%') {
+                        gen_free_reg(EAX);
+                        gen_push_value(EDX);
+                    }
+                    else {
+                        gen_free_reg(EDX);
+                        gen_push_value(EAX);
                     }
-
-                    if ((type_right & (ARRAY | POINTER)) && parse_get_size(parse_deref(type_right)) == 4)
-                        gen_emitbytes(3, 0x8d, 0x1c, 0x99, 0); //                lea    ebx,DWORD PTR [ecx+ebx*4]
-                    else
-                        gen_emitbytes(3, 0x8d, 0x1c, 0x19, 0); //                lea    ebx,DWORD PTR [ecx+ebx*1]
-
-                    gen_emitbyte(0x53);                        //                push   ebx
                 }
             }
-
-            if (!aithmetic_done) {
-                *expr_type = INT;
-
-                if (op == '+') gen_emitbytes(3, 0x01, 0x0c, 0x24, 0);   //  add    DWORD PTR [esp],ecx
-                if (op == '|') gen_emitbytes(3, 0x09, 0x0c, 0x24, 0);   //  or     DWORD PTR [esp,ecx
-                if (op == '-') gen_emitbytes(3, 0x29, 0x0c, 0x24, 0);   //  sub    DWORD PTR [esp],ecx
-                if (op == '&') gen_emitbytes(3, 0x21, 0x0c, 0x24, 0);   //  and    DWORD PTR [esp],ecx
-                if (op == '^') gen_emitbytes(3, 0x31, 0x0c, 0x24, 0);   //  xor    DWORD PTR [esp],ecx
-                if (op == LSH) gen_emitbytes(3, 0xd3, 0x24, 0x24, 0);   //  shl    DWORD PTR [esp],cl
-                if (op == RSH) gen_emitbytes(3, 0xd3, 0x2c, 0x24, 0);   //  shr    DWORD PTR [esp],cl
-
-                if (left_is_pointer && right_is_pointer) {
-                    if ((type_left & (ARRAY | POINTER)) && parse_get_size(parse_deref(type_left)) == 4) {
-                        // we are subtracting pointer to int: result is 4 times too high
-                        gen_emitbytes(4, 0xc1, 0x2c, 0x24,  0x02);  //  shr    DWORD PTR [esp],0x2
-                    }
+        }
+        else if (op == '+' || op == '-' || op == '^' || op == '|' || op == '&' || op == LSH || op == RSH) {
+            if (phase == 0)
+                next = child1;
+            else if (phase == 1) {
+                // an immediate, or a variable unless it is a shift count or an index
+                kind = gen_operand_kind(child2);
+                if (kind == OPERAND_MEM && (op == LSH || op == RSH || (child & (ARRAY | POINTER))))
+                    kind = OPERAND_REG;
+
+                if (kind == OPERAND_REG) {
+                    gen_frames[base+FRAME_LEFT] = child;
+                    next = child2;
+                }
+                else {
+                    value = child2;
+                    if (kind == OPERAND_IMM)
+                        value = expr_table[4*child2+1];
+                    type = gen_arith(op, child, INT, kind, value);
                 }
             }
+            else
+                type = gen_arith(op, gen_frames[base+FRAME_LEFT], child, OPERAND_REG, 0);
         }
         else if (op == DIVASSIGN || op == MODASSIGN || op == MULASSIGN) {
-            gen_expr(expr_table, expr_table[4*root+3], comma_count, flags & ~ADDR_ONLY, expr_type);
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags | ADDR_ONLY, &dummy);
-            gen_emitbyte(0x5b);                         // pop ebx
-            gen_emitbytes(2, 0x8b, 0x03, 0, 0);         // mov eax,DWORD PTR [ebx]
-
-            if (op == MULASSIGN)
-                gen_emitbytes(3, 0xf7, 0x2c, 0x24, 0);  // imul DWORD PTR [esp]
-            else {
-                gen_emitbytes(2, 0x31, 0xd2, 0, 0);     // xor    edx,edx
-                gen_emitbytes(3, 0xf7, 0x3c, 0x24, 0);  // idiv DWORD PTR [esp]
+            kind = gen_operand_kind(child2);
+            if (kind != OPERAND_IMM || (op != MULASSIGN && expr_table[4*child2+1] < 2))
+                kind = OPERAND_REG;
+            if (phase == 0 && kind == OPERAND_IMM)
+                phase = 1;
+
+            if (phase == 0)
+                next = child2;
+            else if (phase == 1) {
+                if (kind == OPERAND_REG)
+                    type = child;
+                next = child1;
+                next_flags = GEN_MEMORY | ADDR_ONLY;
             }
-            if (op == MODASSIGN) {
-                gen_emitbytes(2, 0x89, 0x13, 0, 0);     // mov DWORD PTR [ebx],edx
-                gen_emitbytes(3, 0x89, 0x14, 0x24, 0);  // mov DWORD PTR [esp],edx
+            else if (kind == OPERAND_IMM) {
+                // like * / and % by a constant, on the value loaded from the variable
+                gen_pop_address(mode, REG_ANY & ~((1 << EAX) | (1 << EDX)));
+                b = gen_alloc_reg(REG_ANY & ~((1 << EAX) | (1 << EDX)));
+                gen_load_mem(b, mode, scale, disp, 0);       // mov b,DWORD PTR [X]
+                value = expr_table[4*child2+1];
+                if (op == MULASSIGN)
+                    gen_mul_imm(b, value);
+                gen_push_value(b);
+                if (op == DIVASSIGN)
+                    gen_div_imm('/', value);
+                if (op == MODASSIGN)
+                    gen_div_imm('%', value);
+
+                b = gen_pop_value(REG_ANY);
+                gen_emitbyte(0x89);                          // mov DWORD PTR [X],b
+                gen_mem(b, mode, scale, disp);
+                gen_free_address(mode);
+                gen_push_value(b);
             }
             else {
-                gen_emitbytes(2, 0x89, 0x03, 0, 0);     // mov DWORD PTR [ebx],eax
-                gen_emitbytes(3, 0x89, 0x04, 0x24, 0);  // mov DWORD PTR [esp],eax
+                // the operation needs eax and edx
+                gen_pop_address(mode, REG_ANY & ~((1 << EAX) | (1 << EDX)));
+                b = gen_pop_value(REG_ANY & ~((1 << EAX) | (1 << EDX)));
+                gen_evict(EAX);
+                gen_reg_owner[EAX] = -2;
+                gen_evict(EDX);
+                gen_reg_owner[EDX] = -2;
+
+                gen_load_mem(EAX, mode, scale, disp, 0);     // mov eax,DWORD PTR [X]
+                if (op == MULASSIGN)
+                    gen_emitbytes(2, 0xf7, 0xe8 | b, 0, 0);  // imul b
+                else {
+                    gen_emitbyte(0x99);                      // cdq
+                    gen_emitbytes(2, 0xf7, 0xf8 | b, 0, 0);  // idiv b
+                }
+
+                reg = EAX;
+                if (op == MODASSIGN)
+                    reg = EDX;
+                gen_emitbyte(0x89);                          // mov DWORD PTR [X],reg
+                gen_mem(reg, mode, scale, disp);
+
+                gen_free_address(mode);
+                gen_free_reg(b);
+                gen_free_reg(EAX);
+                gen_free_reg(EDX);
+                gen_push_value(reg);
             }
         }
         else if (op == PLUSASSIGN || op == MINUSASSIGN || op == LSHASSIGN || op == RSHASSIGN || op == ANDASSIGN || op == XORASSIGN || op == ORASSIGN) {
-            int type_left;
-
-            gen_expr(expr_table, expr_table[4*root+3], comma_count, flags & ~ADDR_ONLY, expr_type);
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags | ADDR_ONLY, &type_left);
-            gen_emitbyte(0x5b);                  // pop ebx
-            gen_emitbyte(0x59);                  // pop ecx
-
-            if ((op == PLUSASSIGN || op == MINUSASSIGN) && (type_left & (ARRAY | POINTER)) && parse_get_size(parse_deref(type_left)) == 4) {
-                // pointer arithmetic in += and -=
-                gen_emitbytes(3, 0xc1, 0xe1, 0x02, 0);                   //  shl    ecx,0x2
+            kind = gen_operand_kind(child2);
+            if (kind == OPERAND_MEM)
+                kind = OPERAND_REG;  // there is no memory to memory operation
+            if (phase == 0 && kind == OPERAND_IMM)
+                phase = 1;
+
+            if (phase == 0)
+                next = child2;
+            else if (phase == 1) {
+                if (kind == OPERAND_REG)
+                    type = child;
+                next = child1;
+                next_flags = GEN_MEMORY | ADDR_ONLY;
             }
+            else {
+                gen_pop_address(mode, REG_ANY & ~(1 << ECX));
+                if (kind == OPERAND_IMM)
+                    value = expr_table[4*child2+1];
+                else if (op == LSHASSIGN || op == RSHASSIGN) {
+                    // the count goes to cl
+                    if (gen_top_reg() != ECX)
+                        gen_evict(ECX);
+                    value = gen_pop_value(1 << ECX);
+                }
+                else
+                    value = gen_pop_value(REG_ANY);
 
-            if (op == PLUSASSIGN)  gen_emitbytes(2, 0x01, 0x0b, 0, 0);   //  add    DWORD PTR [ebx],ecx
-            if (op == ORASSIGN)    gen_emitbytes(2, 0x09, 0x0b, 0, 0);   //  or     DWORD PTR [ebx],ecx
-            if (op == MINUSASSIGN) gen_emitbytes(2, 0x29, 0x0b, 0, 0);   //  sub    DWORD PTR [ebx],ecx
-            if (op == ANDASSIGN)   gen_emitbytes(2, 0x21, 0x0b, 0, 0);   //  and    DWORD PTR [ebx],ecx
-            if (op == XORASSIGN)   gen_emitbytes(2, 0x31, 0x0b, 0, 0);   //  xor    DWORD PTR [ebx],ecx
-            if (op == LSHASSIGN)   gen_emitbytes(2, 0xd3, 0x23, 0, 0);   //  shl    DWORD PTR [ebx],cl
-            if (op == RSHASSIGN)   gen_emitbytes(2, 0xd3, 0x2b, 0, 0);   //  shr    DWORD PTR [ebx],cl
+                if ((op == PLUSASSIGN || op == MINUSASSIGN) && gen_scale(child) == 2) {
+                    // pointer arithmetic in += and -=
+                    if (kind == OPERAND_IMM)
+                        value = value << 2;
+                    else
+                        gen_emitbytes(3, 0xc1, 0xe0 | value, 0x02, 0);  //  shl    value,0x2
+                }
 
-            gen_emitbytes(2, 0xff, 0x33, 0, 0);  // push   DWORD PTR [ebx]
+                if (op == LSHASSIGN || op == RSHASSIGN) {
+                    reg = 4;                        // shl
+                    if (op == RSHASSIGN)
+                        reg = 7;                    // sar
+                    if (kind == OPERAND_IMM) {
+                        gen_emitbyte(0xc1);         // shl/sar DWORD PTR [X],imm8
+                        gen_mem(reg, mode, scale, disp);
+                        gen_emitbyte(value & 0xff);
+                    }
+                    else {
+                        gen_emitbyte(0xd3);         // shl/sar DWORD PTR [X],cl
+                        gen_mem(reg, mode, scale, disp);
+                    }
+                }
+                else
+                    gen_alu_mem(gen_alu_ext(op), mode, scale, disp, kind, value);
+
+                if (kind == OPERAND_REG)
+                    gen_free_reg(value);
+                if (!(flags & FOR_EFFECT)) {
+                    b = gen_alloc_reg(REG_ANY);
+                    gen_load_mem(b, mode, scale, disp, 0);   // mov b,DWORD PTR [X]
+                    gen_push_value(b);
+                }
+                gen_free_address(mode);
+            }
         }
         else if ((op & 0xff) == MINUSMINUS || (op & 0xff) == PLUSPLUS) {
             // -- or ++
-            int b3, type_left;
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags | ADDR_ONLY, &type_left);
-            gen_emitbyte(0x58);                     // pop eax
+            int b3, is_byte;
 
-            *expr_type = type_left;
-
-            if ((op & 0xff) == MINUSMINUS) {
-                if ((type_left & (ARRAY | POINTER)) && parse_get_size(parse_deref(type_left)) == 4)
-                    b3 = 0xfc;   // -4
-                else
-                    b3 = 0xff;   // -1
+            if (phase == 0) {
+                next = child1;
+                next_flags = GEN_MEMORY | ADDR_ONLY;
             }
             else {
-                if ((type_left & (ARRAY | POINTER)) && parse_get_size(parse_deref(type_left)) == 4)
-                    b3 = 4;     // +4
+                type = child;
+                is_byte = !(child & (ARRAY | POINTER)) && (child & 0xff) != INT;
+
+                b3 = 1;
+                if (gen_scale(child) == 2)
+                    b3 = 4;
+                if ((op & 0xff) == MINUSMINUS)
+                    b3 = -b3;
+
+                // the value is loaded before the postfix operators and after the prefix
+                // ones, the memory operand is changed right away
+                gen_pop_address(mode, REG_ANY);
+                b = -1;
+                if (!(flags & FOR_EFFECT))
+                    b = gen_alloc_reg(REG_ANY);
+                if (b >= 0 && !(op & UNARY))
+                    gen_load_mem(b, mode, scale, disp, is_byte);
+
+                if (is_byte)
+                    gen_emitbyte(0x80);             // add BYTE PTR [X],b3
                 else
-                    b3 = 1;     // +1
+                    gen_emitbyte(0x83);             // add DWORD PTR [X],b3
+                gen_mem(0, mode, scale, disp);
+                gen_emitbyte(b3 & 0xff);
+
+                if (b >= 0 && (op & UNARY))
+                    gen_load_mem(b, mode, scale, disp, is_byte);
+                gen_free_address(mode);
+                if (b >= 0)
+                    gen_push_value(b);
             }
+        }
+        else if (op == LOGAND || op == LOGOR) {
+            int end_label;
 
-            if (op & UNARY) {
-                // prefix
-                gen_emitbytes(3, 0x83, 0x00, b3, 0); // add  DWORD PTR [eax],b3
+            // both ways to the end label leave the same values: the ones below are
+            // pushed and the operands go through eax
+            type = INT;
+            if (phase == 0) {
+                gen_frames[base+FRAME_LABEL] = gen_new_label(0);
+                next = child1;
+            }
+            else if (phase == 1) {
+                end_label = gen_frames[base+FRAME_LABEL];
+                gen_spill(gen_value_count - 1);
+                gen_pop_value(1 << EAX);
+                gen_emitbytes(2, 0x85, 0xc0, 0, 0);     // test eax,eax
+                if (op == LOGAND) gen_emitbytes(2, 0x0f, 0x84, 0, 0);  /* jz */  else gen_emitbytes(2, 0x0f, 0x85, 0, 0);  /* jnz */
+                gen_emitlabel(end_label);
+                gen_free_reg(EAX);
+                next = child2;
             }
             else {
-                // postfix
-                // remember to inc (or dec) later
-                int temp;
+                end_label = gen_frames[base+FRAME_LABEL];
+                gen_pop_value(1 << EAX);
 
-                local_variable_space += 4;
-                temp = -local_variable_space;
+                gen_place_label(end_label);  // jump to this position on end;
 
-                stack_push(postfix_stack, b3);
-                stack_push(postfix_stack, temp);
-
-                gen_emitbytes(2, 0x89, 0x85, 0, 0);   // mov    DWORD PTR [ebp+X],eax
-                gen_emitdword(temp);
+                gen_emitbytes(2, 0x85, 0xc0, 0, 0);    //  test   eax,eax
+                gen_emitbytes(3, 0x0f, 0x95, 0xc0, 0); //  setne  al
+                gen_emitbytes(3, 0x0f, 0xb6, 0xc0, 0); //  movzx  eax,al
+                gen_push_value(EAX);
             }
-            gen_emitbytes(2, 0xff, 0x30, 0, 0);  // push DWORD PTR [eax]
         }
-        else if (op == LOGAND || op == LOGOR) {
-            int end_label;
+        else {
+            if (phase == 0)
+                next = child1;
+            else
+                type = child;
+        }
 
-            *expr_type = INT;
+        if (next >= 0) {
+            gen_frames[base+FRAME_PHASE] = phase + 1;
+            gen_frames[base+FRAME_TYPE] = type;
+            gen_frames[base+FRAME_MODE] = mode;
+            gen_frames[base+FRAME_DISP] = disp;
+            gen_frames[base+FRAME_SCALE] = scale;
+            gen_push_frame(next, next_flags, next_counter);
+        }
+        else {
+            if (flags & GEN_ARG)
+                gen_spill(gen_value_count);  // the parameter goes to the machine stack
+            --gen_frame_count;
+            if (gen_frame_count > 0) {
+                base = FRAME_SIZE * (gen_frame_count - 1);
+                gen_frames[base+FRAME_CHILD] = type;
+                if (flags & GEN_MEMORY) {
+                    gen_frames[base+FRAME_MODE] = mode;
+                    gen_frames[base+FRAME_DISP] = disp;
+                    gen_frames[base+FRAME_SCALE] = scale;
+                }
+            }
+        }
+    }
 
-            end_label = parse_add_internal_label();
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, &dummy);
-            gen_emitbyte(0x58);                     // pop eax
-            gen_emitbytes(2, 0x09, 0xc0, 0, 0);     // or eax,eax
-            if (op == LOGAND) gen_emitbytes(2, 0x0f, 0x84, 0, 0);  /* jz */  else gen_emitbytes(2, 0x0f, 0x85, 0, 0);  /* jnz */
-            gen_add_backpatch(0, emit_pos);
-            gen_emitdword(end_label);
+    if (!(root_flags & FOR_EFFECT) && gen_value_count > 0) {
+        // the result goes to eax, values below it are left over by ','
+        gen_move(EAX, gen_pop_value(REG_ANY));
+    }
+    gen_add_esp(4 * gen_value_pushed);
+    return type;
+}
 
-            gen_expr(expr_table, expr_table[4*root+3], comma_count, flags & ~ADDR_ONLY, &dummy);
-            gen_emitbyte(0x58);                     // pop eax
+int gen_is_tail_call(int root)
+{
+    int symidx;
 
-            symbol_address[end_label] = emit_pos;  // jump to this position on end;
+    // return f(...): the arguments take the places of the parameters and the function
+    // jumps to f, which returns to the caller. there have to be as many parameters as
+    // arguments at least, and nothing may point into the frame any more
+    if (expr_table[4*root+0] != OPERATOR || !(expr_table[4*root+1] & FUNCTION) || gen_frame_escapes)
+        return 0;
+    symidx = expr_table[4*expr_table[4*root+2]+1];
+    return symbol_inline[symidx] == 0 && gen_count_args(expr_table[4*root+3]) <= gen_param_count;
+}
 
-            gen_emitbytes(2, 0x31, 0xc9, 0, 0);    //  xor    ecx,ecx
-            gen_emitbytes(2, 0x09, 0xc0, 0, 0);    //  or     eax,eax
-            gen_emitbytes(3, 0x0f, 0x95, 0xc1, 0); //  setne  cl
-            gen_emitbyte(0x51);                    //  push   ecx
+void gen_branch_leaf(int root, int label, int jump_if)
+{
+    int cc, type;
+
+    // jump to label if the expression is true (jump_if 1) or false (0). compares jump on
+    // their flags, a variable is compared with 0 in memory, other values are tested in eax
+    cc = 5;  // ne
+    if (expr_table[4*root+0] == NUMBER) {
+        // a constant condition has no test: it always jumps or never does
+        if ((expr_table[4*root+1] != 0) == jump_if) {
+            gen_emitbyte(0xe9);   // jmp
+            gen_emitlabel(label);
         }
-        else
-            gen_expr(expr_table, expr_table[4*root+2], comma_count, flags & ~ADDR_ONLY, &dummy);
+        return;
     }
-    else if (type == NUMBER || type == STRING) {
-        // not an operator
-        gen_emitbyte(0x68);  // push
-        *expr_type = INT;
-        if (type != NUMBER) {
-            gen_add_backpatch(STRING, emit_pos);
-            *expr_type = POINTER | CHAR;
-        }
-
-        gen_emitdword(expr_table[4*root+1]);
+    if (gen_is_variable(root)) {
+        type = symbol_type[expr_table[4*root+1]];
+        if ((type & (ARRAY | POINTER)) || (type & 0xff) == INT)
+            gen_emitbyte(0x83);                 // cmp DWORD PTR [X],0
+        else
+            gen_emitbyte(0x80);                 // cmp BYTE PTR [X],0
+        gen_mem_node(7, root);
+        gen_emitbyte(0);
     }
     else {
-        // variable
-        int symidx, address;
-
-        symidx = expr_table[4*root+1];
-        address = symbol_address[symidx];
+        gen_expr(root, FOR_BRANCH);
+        if (gen_branch_cc >= 0)
+            cc = gen_branch_cc;
+        else
+            gen_emitbytes(2, 0x85, 0xc0, 0, 0);  // test eax,eax
+    }
 
-        if (!(symbol_type[symidx] & PARAM) && symbol_type[symidx] & ARRAY)
-            flags |= ADDR_ONLY;  // array name is the address if it's not a parameter
+    if (!jump_if)
+        cc = cc ^ 1;                            // the opposite condition
+    gen_emitbytes(2, 0x0f, 0x80 | cc, 0, 0);   // jcc
+    gen_emitlabel(label);
+}
 
-        *expr_type = symbol_type[symidx];
-        if (type & LOCAL || type & PARAM) {
-            if (type & LOCAL)
-                address = -address;
+void gen_branch_push(int node, int label, int jump_if)
+{
+    stack_push(branch_stack, node);
+    stack_push(branch_stack, label);
+    stack_push(branch_stack, jump_if);
+}
 
-            if (flags & ADDR_ONLY) {
-                gen_emitbytes(2, 0x8d, 0x85, 0, 0);   // lea eax, dword ptr [ebp+X]
-                gen_emitdword(address);
-                gen_emitbyte(0x50);                  // push eax
-            }
-            else if (symbol_size[symidx] >= 4) {
-                gen_emitbytes(2, 0xff, 0xb5, 0, 0);  // push dword ptr [ebp+X]
-                gen_emitdword(address);
-            }
-            else {
-                gen_emitbytes(3, 0x0f, 0xb6, 0x85, 0);  // movzx eax, byte ptr[ebp+X]
-                gen_emitdword(address);
-                gen_emitbyte(0x50);                     // push eax
-            }
+void gen_branch(int root, int label, int jump_if)
+{
+    int op, skip;
+
+    // && || and ! never make a value here: each operand jumps straight to the target or
+    // falls through to the next one, ! swaps the targets. a work list instead of recursion
+    // keeps long chains flat, node -1 places a label
+    branch_stack = stack_reserve(branch_stack, &branch_capacity, 3);
+    branch_stack[0] = 0;
+    gen_branch_push(root, label, jump_if);
+    while (!stack_empty(branch_stack)) {
+        jump_if = stack_pop(branch_stack);
+        label = stack_pop(branch_stack);
+        root = stack_pop(branch_stack);
+        op = 0;
+        if (root >= 0 && expr_table[4*root+0] == OPERATOR)
+            op = expr_table[4*root+1];
+
+        branch_stack = stack_reserve(branch_stack, &branch_capacity, 9);
+        if (root < 0)
+            gen_place_label(label);
+        else if (op == (UNARY | '!'))
+            gen_branch_push(expr_table[4*root+2], label, !jump_if);
+        else if ((op == LOGAND && jump_if) || (op == LOGOR && !jump_if)) {
+            // the left operand decides against the jump: it skips the right one
+            skip = gen_new_label(0);
+            gen_branch_push(-1, skip, 0);
+            gen_branch_push(expr_table[4*root+3], label, jump_if);
+            gen_branch_push(expr_table[4*root+2], skip, !jump_if);
         }
-        else {
-            // global variable
-            if (flags & ADDR_ONLY) {
-                gen_emitbyte(0x68);  // push absolute
-                gen_add_backpatch(GLOBAL, emit_pos);
-                gen_emitdword(address);
-            }
-            else if (symbol_size[symidx] >= 4) {
-                gen_emitbytes(2, 0xff, 0x35, 0, 0);  // push ds:[X]
-                gen_add_backpatch(GLOBAL, emit_pos);
-                gen_emitdword(address);
-            }
-            else {
-                gen_emitbytes(3, 0x0f, 0xb6, 0x05, 0);  // movzx  eax,BYTE PTR ds:X
-                gen_add_backpatch(GLOBAL, emit_pos);
-                gen_emitdword(address);
-                gen_emitbyte(0x50);                  // push eax
-            }
+        else if (op == LOGAND || op == LOGOR) {
+            gen_branch_push(expr_table[4*root+3], label, jump_if);
+            gen_branch_push(expr_table[4*root+2], label, jump_if);
         }
+        else
+            gen_branch_leaf(root, label, jump_if);
     }
 }
 
 int parse_calcexpr(int tok, int is_const, int *retval, int delim)
 {
-    int operator_stack[EXPR_STACK_SIZE];
-    int arg_stack[EXPR_STACK_SIZE];
-    int expr_table[4*(1+EXPR_STACK_SIZE)];  // 4 integers per entry 0:type, 1:value, 2:child1, 3:child2
     int last_sym, assoc, dummy;
 
     last_sym = 0;
+    operator_stack = stack_reserve(operator_stack, &operator_capacity, 0);
+    arg_stack = stack_reserve(arg_stack, &arg_capacity, 0);
     arg_stack[0] = 0;           // stack empty
     operator_stack[0] = 0;      // stack_empty
 
+    // the nodes of the previous expression are not needed any more
+    parse_reserve_nodes(1);
     expr_table[0] = 0;  // root
     expr_table[1] = 1;  // nextfree
     expr_table[2] = 0;  // unused
     expr_table[3] = 0;  // unused
 
     while (1) {
+        // each round pushes at most two entries
+        operator_stack = stack_reserve(operator_stack, &operator_capacity, 2);
+        arg_stack = stack_reserve(arg_stack, &arg_capacity, 2);
         if (tok == NUMBER || tok == STRING) {
             if (tok == STRING)
                 token_value = parse_add_string(token_text, token_text_len);
-            stack_push(arg_stack, parse_add_elem(expr_table, tok, token_value));
+            stack_push(arg_stack, parse_add_elem(tok, token_value));
             last_sym = tok;
             tok = lex_next_token();
         }
         else if (tok == IDENTIFIER) {
             int symidx;
 
-            symidx = parse_lookup_symbol(token_text);
+            symidx = parse_lookup_name(token_name);
             if (symidx < num_keywords)
                 parse_error(E_UNDEFINED_IDENTIFIER);
 
-            stack_push(arg_stack, parse_add_elem(expr_table, symbol_type[symidx], symidx));
+            stack_push(arg_stack, parse_add_elem(symbol_type[symidx], symidx));
             if (symbol_type[symidx] & FUNCTION) {
                 stack_push(operator_stack, FUNCTION);
                 stack_push(arg_stack, -1);
@@ -1483,7 +4778,7 @@ int parse_calcexpr(int tok, int is_const, int *retval, int delim)
 
                 if (tok == ')' || tok == ']') {
                     while (!stack_empty(operator_stack) && '(' != stack_top(operator_stack, 0) && '[' != stack_top(operator_stack, 0))
-                        parse_reduce(expr_table, operator_stack, arg_stack);
+                        parse_reduce();
 
                     if (stack_empty(operator_stack)) {
                         parse_error(E_BAD_EXPRESSION);
@@ -1502,7 +4797,7 @@ int parse_calcexpr(int tok, int is_const, int *retval, int delim)
                         // function without parameters
                         stack_pop(operator_stack);
                         stack_push(operator_stack, FUNCTION | UNARY);
-                        parse_reduce(expr_table, operator_stack, arg_stack);
+                        parse_reduce();
                     }
 
                     last_sym = tok;
@@ -1528,7 +4823,7 @@ int parse_calcexpr(int tok, int is_const, int *retval, int delim)
                 }
                 else {
                     // reduce
-                    parse_reduce(expr_table, operator_stack, arg_stack);
+                    parse_reduce();
                 }
             }
             else
@@ -1537,10 +4832,10 @@ int parse_calcexpr(int tok, int is_const, int *retval, int delim)
     }
 
     while (!stack_empty(operator_stack)) {
-        parse_reduce(expr_table, operator_stack, arg_stack);
+        parse_reduce();
     }
 
-    parse_simplify_expression(expr_table, expr_table[0]);
+    parse_simplify_expression();
 
     if (is_const) {
         int root;
@@ -1550,30 +4845,27 @@ int parse_calcexpr(int tok, int is_const, int *retval, int delim)
         if (expr_table[4*root+0] != NUMBER)
             parse_error(E_EXPRESSION_NOT_CONST);
     }
-    else {
-        int dummy;
-
-        gen_expr(expr_table, expr_table[0], &dummy, 0, &dummy);
-    }
 
     return tok;
 }
 
-int parse_expr(int tok, int delim)
+// the value ends up in eax unless flags has FOR_EFFECT
+int parse_expr(int tok, int delim, int flags)
 {
-    int dummy, rc, b3, temp;
-    postfix_stack[0] = 0; // postfix stack empty
+    int dummy, rc;
 
     rc = parse_calcexpr(tok, 0, &dummy, delim);
+    gen_expr(expr_table[0], flags);
+    return rc;
+}
 
-    while (!stack_empty(postfix_stack)) {
-        temp = stack_pop(postfix_stack);
-        b3   = stack_pop(postfix_stack);
+// a condition: jumps to label if its value is jump_if (0 or 1)
+int parse_cond(int tok, int delim, int label, int jump_if)
+{
+    int dummy, rc;
 
-        gen_emitbytes(2, 0x8b, 0x85, 0, 0);  // mov eax,DWORD PTR [ebp+temp]
-        gen_emitdword(temp);
-        gen_emitbytes(3, 0x83, 0x00, b3, 0); // add  DWORD PTR [eax],b3
-    }
+    rc = parse_calcexpr(tok, 0, &dummy, delim);
+    gen_branch(expr_table[0], label, jump_if);
     return rc;
 }
 
@@ -1585,35 +4877,29 @@ int parse_stmt(int tok, int continue_label, int break_label)
         return parse_stmtblock(lex_next_token(), continue_label, break_label);
 
     if (tok == IF) {
-        int jz_pos;
+        int else_label, end_label;
 
         tok = lex_next_token();
         if (tok != '(')
             parse_error(E_IF_MISSING_OPENING_PARANTHESIS);
 
-        tok = parse_expr(tok, ')');
-        gen_emitbyte(0x58);  // pop eax
-        gen_emitbytes(2, 0x09, 0xc0, 0, 0);   // or     eax,eax
-        gen_emitbytes(2, 0x0f, 0x84, 0, 0);   // jz
-        jz_pos = emit_pos;
-        gen_emitdword(0);
+        else_label = gen_new_label(0);
+        tok = parse_cond(tok, ')', else_label, 0);
 
         // then
         tok = parse_stmt(tok, continue_label, break_label);
 
         if (tok == ELSE) {
             // else
-            int jmp_pos;
-
+            end_label = gen_new_label(0);
             gen_emitbyte(0xe9);   // jmp
-            jmp_pos = emit_pos;
-            gen_emitdword(0);
-            gen_write_dword_into_buffer(emit_buffer, jz_pos, emit_pos - (jz_pos + 4));
+            gen_emitlabel(end_label);
+            gen_place_label(else_label);
             tok = parse_stmt(lex_next_token(), continue_label, break_label);
-            gen_write_dword_into_buffer(emit_buffer, jmp_pos, emit_pos - (jmp_pos + 4));
+            gen_place_label(end_label);
         }
         else
-            gen_write_dword_into_buffer(emit_buffer, jz_pos, emit_pos - (jz_pos + 4));
+            gen_place_label(else_label);
     }
     else if (tok == WHILE) {
         int new_break_label, new_continue_label;
@@ -1622,47 +4908,36 @@ int parse_stmt(int tok, int continue_label, int break_label)
         if (tok != '(')
             parse_error(E_WHILE_MISSING_OPENING_PARANTHESIS);
 
-        new_continue_label = parse_add_internal_label();
-        symbol_address[new_continue_label] = emit_pos;  // jump to this position on continue;
-        new_break_label = parse_add_internal_label();
+        new_continue_label = gen_new_label(0);
+        gen_place_label(new_continue_label);  // jump to this position on continue;
+        new_break_label = gen_new_label(0);
 
-        tok = parse_expr(tok, ')');
-        gen_emitbyte(0x58);  // pop eax
-        gen_emitbytes(2, 0x09, 0xc0, 0, 0);  // or     eax,eax
-        gen_emitbytes(2, 0x0f, 0x84, 0, 0);  // jz
-        gen_add_backpatch(0, emit_pos);
-        gen_emitdword(new_break_label);
+        tok = parse_cond(tok, ')', new_break_label, 0);
 
         tok = parse_stmt(tok, new_continue_label, new_break_label);
         gen_emitbyte(0xe9);   // jmp
-        gen_add_backpatch(0, emit_pos);
-        gen_emitdword(new_continue_label);
-        symbol_address[new_break_label] = emit_pos; // jump to this position on break;
+        gen_emitlabel(new_continue_label);
+        gen_place_label(new_break_label); // jump to this position on break;
     }
     else if (tok == DO) {
         int new_break_label, new_continue_label, start_label;
 
-        new_continue_label = parse_add_internal_label();
-        new_break_label = parse_add_internal_label();
-        start_label = parse_add_internal_label();
-        symbol_address[start_label] = emit_pos;  // jump to this position for loop iteration
+        new_continue_label = gen_new_label(0);
+        new_break_label = gen_new_label(0);
+        start_label = gen_new_label(0);
+        gen_place_label(start_label);  // jump to this position for loop iteration
 
         tok = parse_stmt(lex_next_token(), new_continue_label, new_break_label);
 
         if (tok != WHILE)
             parse_error(E_DO_MISSING_WHILE);
 
-        symbol_address[new_continue_label] = emit_pos;  // jump to this position on continue;
-        tok = parse_expr(lex_next_token(), 0);
+        gen_place_label(new_continue_label);  // jump to this position on continue;
+        tok = parse_cond(lex_next_token(), 0, start_label, 1);
         if (tok != ';')
             parse_error(E_MISSING_SEMICOLON);
         tok = lex_next_token();
-        gen_emitbyte(0x58);  // pop eax
-        gen_emitbytes(2, 0x09, 0xc0, 0, 0);  // or     eax,eax
-        gen_emitbytes(2, 0x0f, 0x85, 0, 0);  // jnz
-        gen_add_backpatch(0, emit_pos);
-        gen_emitdword(start_label);
-        symbol_address[new_break_label] = emit_pos; // jump to this position on break;
+        gen_place_label(new_break_label); // jump to this position on break;
     }
     else if (tok == CONTINUE) {
         tok = lex_next_token();
@@ -1674,8 +4949,7 @@ int parse_stmt(int tok, int continue_label, int break_label)
             parse_error(E_CONTINUE_OUTSIDE_LOOP);
 
         gen_emitbyte(0xe9);   // jmp
-        gen_add_backpatch(0, emit_pos);
-        gen_emitdword(continue_label);
+        gen_emitlabel(continue_label);
     }
     else if (tok == BREAK) {
         tok = lex_next_token();
@@ -1687,25 +4961,15 @@ int parse_stmt(int tok, int continue_label, int break_label)
             parse_error(E_BREAK_OUTSIDE_LOOP);
 
         gen_emitbyte(0xe9);   // jmp
-        gen_add_backpatch(0, emit_pos);
-        gen_emitdword(break_label);
+        gen_emitlabel(break_label);
     }
     else if (tok == GOTO) {
-        int symidx;
-
         tok = lex_next_token();
         if (tok != IDENTIFIER)
             parse_error(E_GOTO_MISSING_IDENTIFIER);
 
-        symidx = parse_lookup_symbol(token_text);
-        if (symidx == 0) {
-            symidx = parse_add_symbol(token_text);
-            symbol_type[symidx] = GOTO | GLOBAL;
-        }
-
         gen_emitbyte(0xe9);   // jmp
-        gen_add_backpatch(0, emit_pos);
-        gen_emitdword(symidx);
+        gen_emitlabel(parse_goto_label(token_name));
 
         tok = lex_next_token();
         if (tok != ';')
@@ -1713,28 +4977,29 @@ int parse_stmt(int tok, int continue_label, int break_label)
     }
     else {
         if (tok == RETURN) {
+            int dummy, tail;
+
             // next comes the expression
             tok = lex_next_token();
+            tail = 0;
             if (tok != ';') {
-                tok = parse_expr(tok, 0);
-                gen_emitbyte(0x58);  // pop eax
+                tok = parse_calcexpr(tok, 0, &dummy, 0);
+                if (gen_is_tail_call(expr_table[0]))
+                    tail = GEN_TAIL;
+                gen_expr(expr_table[0], tail);  // the value is returned in eax
             }
 
-            gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3); // mov esp, ebp  pop ebp  ret
+            if (!tail) {
+                gen_emitbyte(0xe9);   // jmp to the epilog
+                gen_emitlabel(gen_return_label);
+            }
         }
         else if (tok != ';') {
             if (tok == IDENTIFIER) {
                 tok = lex_next_token();
                 if (tok == ':') {
                     // labeled statement
-                    int symidx;
-
-                    symidx = parse_lookup_symbol(token_text);
-                    if (symidx == 0)
-                        symidx = parse_add_symbol(token_text);
-
-                    symbol_type[symidx] = GOTO | GLOBAL;
-                    symbol_address[symidx] = emit_pos;
+                    gen_place_label(parse_goto_label(token_name));
                     return parse_stmt(lex_next_token(), continue_label, break_label);
                 }
                 else {
@@ -1742,42 +5007,816 @@ int parse_stmt(int tok, int continue_label, int break_label)
                     tok = IDENTIFIER;
                 }
             }
-            tok = parse_expr(tok, 0);
-            gen_emitbytes(3, 0x83, 0xc4, 0x04, 0);   // add esp, 4 ;  remove from stack
+            tok = parse_expr(tok, 0, FOR_EFFECT);
+        }
+
+        if (tok != ';')
+            parse_error(E_MISSING_SEMICOLON);
+        tok = lex_next_token();
+    }
+    return tok;
+}
+
+int parse_stmtblock(int tok, int continue_label, int break_label)
+{
+    int symidx_old;
+    symidx_old = symbol_count;
+
+    while (tok != '}') {
+        if (tok == INT || tok == CHAR || tok == VOID || tok == ENUM)
+            tok = parse_vardecl(tok);
+        else
+            tok = parse_stmt(tok, continue_label, break_label);
+    }
+
+    parse_pop_scope(symidx_old);  // forget all symbols that belong to that block only
+    return lex_next_token();
+}
+
+void parse_register_candidate(int nameid, int type)
+{
+    int i;
+
+    // an int or a pointer can live in a register, unless the function has more than one
+    // variable with its name
+    i = 1;
+    while (i <= reg_candidate[0] && reg_candidate[i] != nameid)
+        ++i;
+    if (i > reg_candidate[0]) {
+        reg_candidate = stack_reserve(reg_candidate, &reg_candidate_capacity, 1);
+        stack_push(reg_candidate, nameid);
+    }
+    else
+        name_register[nameid] = -1;
+    if ((type & ARRAY) || (!(type & POINTER) && (type & 0xff) != INT))
+        name_register[nameid] = -1;
+}
+
+void parse_choose_registers(void)
+{
+    int i, j, tok, prev, nameid, type, depth, pending, nest, weight, max_regs, best, address_of, reg;
+
+    // the variables of the function that are used the most and whose address is never
+    // taken go to esi, edi and ebx. the body is in the replay buffer: a use counts 8 times
+    // as much as one in the loop around it. name_register counts the uses, -1 excludes a name.
+    // a local array or the address of a variable of the function rules out tail calls
+    reg_candidate = stack_reserve(reg_candidate, &reg_candidate_capacity, 0);
+    reg_candidate[0] = 0;
+    reg_loop = stack_reserve(reg_loop, &reg_loop_capacity, 0);
+    reg_loop[0] = 0;
+    i = symbol_count - 1;
+    while (i > 0 && (symbol_type[i] & PARAM)) {
+        parse_register_candidate(symbol_name_id[i], symbol_type[i]);
+        --i;
+    }
+
+    max_regs = 3;
+    gen_frame_escapes = 0;
+    depth = 0;
+    pending = 0;  // while and do whose statement has not begun
+    address_of = 0;
+    prev = '{';
+    i = replay_pos;
+    while (i < replay_count) {
+        tok = replay_token[i];
+        if (tok == IDENTIFIER) {
+            nameid = replay_value[i];
+            nest = reg_loop[0] + pending;
+            weight = 1;
+            while (nest > 0 && weight < 4096) {
+                weight *= 8;
+                --nest;
+            }
+            if (address_of) {
+                name_register[nameid] = -1;
+                j = 1;
+                while (j <= reg_candidate[0] && reg_candidate[j] != nameid)
+                    ++j;
+                if (j <= reg_candidate[0])
+                    gen_frame_escapes = 1;
+            }
+            else if (name_register[nameid] >= 0 && name_register[nameid] < 0x40000000)
+                name_register[nameid] += weight;
+        }
+        else if ((tok == INT || tok == CHAR || tok == VOID) && (prev == '{' || prev == '}' || prev == ';')) {
+            // a declaration, the names come again as identifiers
+            type = tok;
+            j = i + 1;
+            while (j + 1 < replay_count) {
+                if (replay_token[j] == '*') {
+                    type |= POINTER;
+                    ++j;
+                }
+                if (replay_token[j] != IDENTIFIER)
+                    break;
+                nameid = replay_value[j++];
+                if (replay_token[j] == '[') {
+                    type |= ARRAY;
+                    gen_frame_escapes = 1;
+                }
+                parse_register_candidate(nameid, type);
+                while (j < replay_count && replay_token[j] != ',' && replay_token[j] != ';')
+                    ++j;
+                if (j == replay_count || replay_token[j] == ';')
+                    break;
+                type = tok;
+                ++j;
+            }
+        }
+        else if (tok == WHILE || tok == DO)
+            ++pending;
+        else if (tok == '{') {
+            ++depth;
+            while (pending > 0) {
+                reg_loop = stack_reserve(reg_loop, &reg_loop_capacity, 1);
+                stack_push(reg_loop, depth);
+                --pending;
+            }
+        }
+        else if (tok == '}') {
+            while (!stack_empty(reg_loop) && stack_top(reg_loop, 0) == depth)
+                stack_pop(reg_loop);
+            --depth;
+        }
+        else if (tok == ';')
+            pending = 0;  // the statement of the loop has ended
+        else if (tok == MULASSIGN || tok == DIVASSIGN || tok == MODASSIGN)
+            max_regs = 1;  // they take eax, edx and three more registers
+
+        if (tok == '&' && parse_check_unary(tok, prev) == UNARY)
+            address_of = 1;
+        else if (tok != '(')
+            address_of = 0;
+        prev = tok;
+        ++i;
+    }
+
+    reg_chosen_count = 0;
+    while (reg_chosen_count < max_regs) {
+        best = 0;
+        j = 1;
+        while (j <= reg_candidate[0]) {
+            nameid = reg_candidate[j];
+            if (name_register[nameid] >= 4 && (best == 0 || name_register[nameid] > name_register[best]))
+                best = nameid;
+            ++j;
+        }
+        if (best == 0)
+            break;
+        name_register[best] = -1;
+        reg_chosen[reg_chosen_count++] = best;
+    }
+
+    // the counts are done with. esi and edi go first, ebx is the one with a byte register
+    i = replay_pos;
+    while (i < replay_count) {
+        if (replay_token[i] == IDENTIFIER)
+            name_register[replay_value[i]] = 0;
+        ++i;
+    }
+    j = 1;
+    while (j <= reg_candidate[0])
+        name_register[reg_candidate[j++]] = 0;
+    gen_reg_vars = 0;
+    i = 0;
+    while (i < reg_chosen_count) {
+        reg = ESI;
+        if (i == 1)
+            reg = EDI;
+        if (i == 2)
+            reg = EBX;
+        name_register[reg_chosen[i]] = reg;
+        gen_reg_vars |= 1 << reg;
+        ++i;
+    }
+}
+
+int parse_function_body(int symidx)
+{
+    int link, tok, saves, reg, n, i, site;
+
+    local_variable_space = 4;  // minimum 4 bytes
+    symbol_type[symidx] |= DEFINED;
+    symbol_address[symidx] = emit_pos;
+    gen_peep_barrier();
+    gen_emitbytes(3, 0x55, 0x89, 0xe5, 0);  // function prolog
+    gen_emitbytes(2, 0x81, 0xec, 0, 0);     // sub esp
+    link = emit_pos;
+    gen_emitdword(0);
+    saves = emit_pos;
+
+    // the body is read ahead for the choice of the register variables. the parameters
+    // among them are loaded, the locals have no place in the frame
+    if (replay_count == 0)
+        lex_record_block();
+    parse_choose_registers();
+    gen_function = symidx;
+    gen_regs_used = gen_reg_vars;
+    gen_return_label = gen_new_label(0);
+    gen_body_label = gen_new_label(0);
+    gen_place_label(gen_body_label);
+    gen_tail_calls = stack_reserve(gen_tail_calls, &gen_tail_call_capacity, 0);
+    gen_tail_calls[0] = 0;
+    gen_param_count = 0;
+    i = symbol_count - 1;
+    while (i > 0 && (symbol_type[i] & PARAM)) {
+        reg = name_register[symbol_name_id[i]];
+        if (reg > 0) {
+            symbol_register[i] = reg;
+            gen_emitbyte(0x8b);                 // mov reg,DWORD PTR [ebp+X]
+            gen_mem(reg, MEM_FRAME, 0, symbol_address[i]);
+        }
+        ++gen_param_count;
+        --i;
+    }
+
+    tok = parse_stmtblock(lex_next_token(), 0, 0);
+    gen_patch_code(link, local_variable_space);
+
+    // the returns jump to the epilog. it restores the callee-saved registers the body used
+    gen_place_label(gen_return_label);
+    n = 0;
+    reg = EDI;
+    while (reg >= EBX) {
+        if (gen_regs_used & REG_SAVED & (1 << reg)) {
+            gen_emitbyte(0x58 + reg);           // pop reg
+            ++n;
+        }
+        --reg;
+    }
+    gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3); // function epilog
+
+    // the tail calls leave with the same pops, the last one first so that the places
+    // of the others stay
+    while (n > 0 && !stack_empty(gen_tail_calls)) {
+        site = stack_pop(gen_tail_calls);
+        gen_insert_code(site, n);
+        i = 0;
+        while (i < n) {
+            emit_buffer[site + i - emit_base] = emit_buffer[emit_pos - 4 - n + i - emit_base];
+            ++i;
+        }
+    }
+    gen_resolve_labels();
+
+    if (n > 0) {
+        // and the prolog saves them: the body moves up to make room for the pushes
+        gen_insert_code(saves, n);
+        reg = EBX;
+        while (reg <= EDI) {
+            if (gen_regs_used & REG_SAVED & (1 << reg))
+                emit_buffer[saves++ - emit_base] = 0x50 + reg;  // push reg
+            ++reg;
+        }
+    }
+
+    // the register variables go with the function
+    i = 0;
+    while (i < reg_chosen_count)
+        name_register[reg_chosen[i++]] = 0;
+    gen_reg_vars = 0;
+    return tok;
+}
+
+int parse_is_assignment(int op)
+{
+    // the operators that write their left operand, and &
+    if ((op & 0xff) == PLUSPLUS || (op & 0xff) == MINUSMINUS || op == (UNARY | '&') || op == '=')
+        return 1;
+    return op == PLUSASSIGN || op == MINUSASSIGN || op == MULASSIGN || op == DIVASSIGN || op == MODASSIGN
+        || op == ORASSIGN || op == XORASSIGN || op == ANDASSIGN || op == LSHASSIGN || op == RSHASSIGN;
+}
+
+void parse_record_inline(int symidx, int symidx_old)
+{
+    int pos, line, first, i, tok, dummy, count, node, type, value, child1, start, size;
+
+    // the body of a function is read ahead. a parallel compile reads only a short one,
+    // the scout skips the bodies without making tokens
+    if (job_count > 1) {
+        pos = lex_tell();
+        line = lineno;
+        i = lex_skip_block();
+        count = lex_tell() - pos;
+        lex_seek(pos);
+        lineno = line;
+        if (i != 0 || count > INLINE_SOURCE_SIZE)
+            return;
+    }
+    lex_record_block();
+
+    // return and an expression, or an expression alone in a void function
+    first = 0;
+    type = symbol_type[symidx] & ~(FUNCTION | DEFINED | GLOBAL);
+    if (type != VOID) {
+        if (replay_token[0] != RETURN)
+            return;
+        first = 1;
+    }
+    if (replay_count < first + 3 || replay_count > INLINE_TOKENS)
+        return;
+    if (replay_token[replay_count - 2] != ';' || replay_token[replay_count - 1] != '}')
+        return;
+    i = first;
+    while (i < replay_count - 2) {
+        tok = replay_token[i];
+        if (tok <= GOTO || tok == ';' || tok == '{' || tok == '}' || tok == ':' || tok == STRING)
+            return;  // a keyword, more statements, a label, or a string of its own
+        ++i;
+    }
+
+    replay_pos = first;
+    tok = parse_calcexpr(lex_next_token(), 0, &dummy, 0);
+    replay_pos = 0;
+    lineno = replay_lineno;
+    count = expr_table[1] - 1;
+    if (tok != ';' || count > INLINE_NODES)
+        return;
+
+    // the parameters may only be read, and the function may not call itself
+    node = 1;
+    while (node <= count) {
+        type = expr_table[4*node+0];
+        value = expr_table[4*node+1];
+        child1 = expr_table[4*node+2];
+        if (type == OPERATOR && parse_is_assignment(value)
+                && expr_table[4*child1+0] != OPERATOR && (expr_table[4*child1+0] & PARAM))
+            return;
+        if (type != OPERATOR && type != NUMBER && (type & FUNCTION) && value == symidx)
+            return;
+        ++node;
+    }
+
+    if (inline_node_count == 0)
+        inline_node_count = 1;  // 0 is no tree
+    if (inline_node_count + count + 1 > inline_node_capacity) {
+        size = arena_size(inline_node_capacity, inline_node_count + count + 1, INLINE_NODES_INITIAL);
+        inline_node = arena_grow(inline_node, 16 * inline_node_capacity, 16 * size);
+        inline_node_capacity = size;
+    }
+    start = inline_node_count;
+    inline_node[4*start+0] = expr_table[0];
+    inline_node[4*start+1] = count;
+    inline_node[4*start+2] = symbol_count - symidx_old;
+    inline_node[4*start+3] = 0;
+    node = 1;
+    while (node <= count) {
+        i = 0;
+        while (i < 4) {
+            inline_node[4*(start+node)+i] = expr_table[4*node+i];
+            ++i;
+        }
+        type = expr_table[4*node+0];
+        if (type != OPERATOR && type != NUMBER && (type & PARAM)) {
+            // a parameter by its number, and its type
+            inline_node[4*(start+node)+0] = ARG_VALUE;
+            inline_node[4*(start+node)+1] = expr_table[4*node+1] - symidx_old;
+            inline_node[4*(start+node)+2] = type;
+        }
+        ++node;
+    }
+    inline_node_count += count + 1;
+    symbol_inline[symidx] = start;
+}
+
+void cache_mix(int x)
+{
+    cache_key1 = cache_key1 * 33 + x;
+    cache_key2 = (cache_key2 ^ x) * 0x01000193;
+}
+
+void cache_mix_inline(int symidx, int depth)
+{
+    int start, node, type, value;
+
+    // the tree of an inlined function and of the ones inlined into it, with names
+    // instead of symbols
+    start = symbol_inline[symidx];
+    cache_mix(start != 0);
+    if (start == 0 || depth == INLINE_DEPTH)
+        return;
+    node = start;
+    while (node <= start + inline_node[4*start+1]) {
+        type = inline_node[4*node+0];
+        value = inline_node[4*node+1];
+        cache_mix(type);
+        if (node == start || type == OPERATOR || type == NUMBER || type == ARG_VALUE)
+            cache_mix(value);
+        else {
+            cache_mix(name_hash_value[symbol_name_id[value]]);
+            cache_mix(symbol_size[value]);
+            if (type & FUNCTION)
+                cache_mix_inline(value, depth + 1);
+        }
+        cache_mix(inline_node[4*node+2]);
+        cache_mix(inline_node[4*node+3]);
+        ++node;
+    }
+}
+
+void cache_mix_symbol(int symidx)
+{
+    // the parts of a declaration the code of a function depends on. addresses of
+    // functions and global variables are not among them: they are relocated.
+    cache_mix(symbol_type[symidx] & ~DEFINED);
+    cache_mix(symbol_size[symidx]);
+    if (symbol_type[symidx] & PARAM || symbol_type[symidx] == ENUM)
+        cache_mix(symbol_address[symidx]);
+    if (symbol_type[symidx] & FUNCTION)
+        cache_mix_inline(symidx, 0);
+}
+
+void cache_hash_function(int symidx, int symidx_old)
+{
+    int i, tok, pos, n, nameid;
+
+    cache_key1 = 5381;
+    cache_key2 = 0x811c9dc5;
+    cache_mix(symbol_type[symidx] & ~DEFINED);
+    while (symidx_old < symbol_count) {
+        // parameters
+        cache_mix(name_hash_value[symbol_name_id[symidx_old]]);
+        cache_mix_symbol(symidx_old++);
+    }
+
+    i = 0;
+    while (i < replay_count) {
+        tok = replay_token[i];
+        cache_mix(tok);
+        if (tok == IDENTIFIER) {
+            nameid = replay_value[i];
+            cache_mix(name_hash_value[nameid]);
+            cache_mix(parse_lookup_name(nameid) != 0);
+            if (parse_lookup_name(nameid) != 0)
+                cache_mix_symbol(parse_lookup_name(nameid));
+        }
+        else if (tok == STRING) {
+            pos = replay_value[i];
+            n = 4 + gen_read_dword_from_buffer(replay_text, pos);
+            while (n-- > 0)
+                cache_mix(replay_text[pos++]);
+        }
+        else if (tok == NUMBER)
+            cache_mix(replay_value[i]);
+        ++i;
+    }
+}
+
+int cache_entry_size(char *entry)
+{
+    // key1, key2, code size, string size, relocation count, name size, then the
+    // code, the strings, the relocations (kind, offset, addend, name) and the names
+    return 24 + ((gen_read_dword_from_buffer(entry, 8) + 3) & ~3)
+        + ((gen_read_dword_from_buffer(entry, 12) + 3) & ~3)
+        + 16 * gen_read_dword_from_buffer(entry, 16)
+        + ((gen_read_dword_from_buffer(entry, 20) + 3) & ~3);
+}
+
+void cache_index(char *map, int size)
+{
+    int count, pos, slot;
+
+    // make the entries of a cache image available to cache_find
+    if (size < 8 || gen_read_dword_from_buffer(map, 0) != CACHE_MAGIC)
+        return;
+
+    count = gen_read_dword_from_buffer(map, 4);
+    if (count < 0 || count > size / 24)
+        count = size / 24;  // an entry has 24 bytes at least
+    slot = arena_size(cache_slot_capacity, 2 * count, CACHE_SLOTS_INITIAL);
+    if (slot > cache_slot_capacity) {
+        cache_slot = arena_grow(cache_slot, 4 * cache_slot_capacity, 4 * slot);
+        cache_old_entry = arena_grow(cache_old_entry, 4 * cache_slot_capacity, 4 * slot);
+        cache_slot_capacity = slot;
+    }
+    cache_map = map;
+    pos = 8;
+    while (count-- > 0 && pos + 24 <= size) {
+        if (pos + cache_entry_size(map + pos) > size)
+            break;
+        cache_old_entry[cache_old_count] = pos;
+
+        slot = gen_read_dword_from_buffer(map, pos) & (cache_slot_capacity - 1);
+        while (cache_slot[slot] != 0)
+            slot = (slot + 1) & (cache_slot_capacity - 1);
+        cache_slot[slot] = ++cache_old_count;
+
+        pos += cache_entry_size(map + pos);
+    }
+}
+
+void cache_open(char *path)
+{
+    int fd, size;
+
+    cache_path = path;
+    fd = _sys_open(path, OPEN_READ, 0);
+    if (fd < 0)
+        return;  // first build
+
+    size = _sys_lseek(fd, 0, LSEEK_END);
+    if (size > 0)
+        cache_index(_sys_mmap(fd, size), size);
+}
+
+char *cache_find(void)
+{
+    int slot;
+    char *entry;
+
+    if (cache_old_count == 0)
+        return 0;
+    slot = cache_key1 & (cache_slot_capacity - 1);
+    while (cache_slot[slot] != 0) {
+        entry = cache_map + cache_old_entry[cache_slot[slot] - 1];
+        if (gen_read_dword_from_buffer(entry, 0) == cache_key1 && gen_read_dword_from_buffer(entry, 4) == cache_key2)
+            return entry;
+        slot = (slot + 1) & (cache_slot_capacity - 1);
+    }
+    return 0;
+}
+
+void cache_reserve_functions(int need)
+{
+    int size, old;
+
+    // room in the tables of the functions of this build and of the workers' ones
+    if (need <= cache_function_capacity)
+        return;
+    size = arena_size(cache_function_capacity, need, FUNCTIONS_INITIAL);
+    old = 4 * cache_function_capacity;
+    cache_new_key1 = arena_grow(cache_new_key1, old, 4 * size);
+    cache_new_key2 = arena_grow(cache_new_key2, old, 4 * size);
+    cache_new_entry = arena_grow(cache_new_entry, old, 4 * size);
+    cache_new_job = arena_grow(cache_new_job, old, 4 * size);
+    cache_new_hit = arena_grow(cache_new_hit, old, 4 * size);
+    cache_new_code = arena_grow(cache_new_code, old, 4 * size);
+    cache_new_code_size = arena_grow(cache_new_code_size, old, 4 * size);
+    cache_new_string = arena_grow(cache_new_string, old, 4 * size);
+    cache_new_string_size = arena_grow(cache_new_string_size, old, 4 * size);
+    cache_new_reloc = arena_grow(cache_new_reloc, old, 4 * size);
+    cache_new_reloc_count = arena_grow(cache_new_reloc_count, old, 4 * size);
+    cache_new_name = arena_grow(cache_new_name, old, 4 * size);
+    job_entry = arena_grow(job_entry, old, 4 * size);
+    job_end = arena_grow(job_end, old, 4 * size);
+    job_line = arena_grow(job_line, old, 4 * size);
+    job_hit = arena_grow(job_hit, old, 4 * size);
+    job_begin = arena_grow(job_begin, old, 4 * size);
+    job_begin_line = arena_grow(job_begin_line, old, 4 * size);
+    job_stop = arena_grow(job_stop, old, 4 * size);
+    job_begin_file = arena_grow(job_begin_file, old, 4 * size);
+    job_scope = arena_grow(job_scope, old, 4 * size);
+    job_symbol = arena_grow(job_symbol, old, 4 * size);
+    job_declared = arena_grow(job_declared, old, 4 * size);
+    job_defines = arena_grow(job_defines, old, 4 * size);
+    job_ordinal = arena_grow(job_ordinal, old, 4 * size);
+    cache_function_capacity = size;
+}
+
+char *cache_new_entry_text(int n)
+{
+    // the entry the n-th function was copied from, 0: it was compiled here
+    if (cache_new_entry[n] == 0)
+        return 0;
+    if (cache_new_job[n])
+        return job_buffer + cache_new_entry[n] - 1;
+    return cache_map + cache_new_entry[n] - 1;
+}
+
+void cache_apply(char *entry, int symidx)
+{
+    int start, code_size, string_size, reloc_count, string_base;
+    int i, pos, kind, offset, addend, names, target;
+
+    // the function as it was compiled before, relocated to where it goes now
+    code_size = gen_read_dword_from_buffer(entry, 8);
+    string_size = gen_read_dword_from_buffer(entry, 12);
+    reloc_count = gen_read_dword_from_buffer(entry, 16);
+
+    start = emit_pos;
+    symbol_type[symidx] |= DEFINED;
+    symbol_address[symidx] = start;
+
+    pos = 24;
+    gen_reserve_code(code_size);
+    i = 0;
+    while (i < code_size)
+        emit_buffer[emit_pos++ - emit_base] = entry[pos + i++];
+    pos += (code_size + 3) & ~3;
+    string_base = parse_add_string(entry + pos, string_size);
+    pos += (string_size + 3) & ~3;
+
+    names = pos + 16 * reloc_count;
+    i = 0;
+    while (i < reloc_count) {
+        kind = gen_read_dword_from_buffer(entry, pos);
+        offset = start + gen_read_dword_from_buffer(entry, pos + 4);
+        addend = gen_read_dword_from_buffer(entry, pos + 8);
+        target = parse_lookup_symbol(entry + names + gen_read_dword_from_buffer(entry, pos + 12));
+        if (kind == OBJ_STRING) {
+            gen_patch_code(offset, string_base + addend);
+            gen_add_backpatch(STRING, offset);
+        }
+        else if (kind == OBJ_CALL) {
+            gen_patch_code(offset, target);
+            gen_add_backpatch(0, offset);
+        }
+        else {
+            gen_patch_code(offset, symbol_address[target] + addend);
+            gen_add_global_backpatch(offset, target);
+        }
+        pos += 16;
+        ++i;
+    }
+}
+
+void cache_add_relocations(int first, int start, int string_start)
+{
+    int i, offset, value, symidx, size, old;
+
+    // the backpatch records of the function, its jumps have none
+    if (cache_reloc_count + backpatch_count - first > cache_reloc_capacity) {
+        size = arena_size(cache_reloc_capacity, cache_reloc_count + backpatch_count - first, CACHE_RELOCS_INITIAL);
+        old = 4 * cache_reloc_capacity;
+        cache_reloc_kind = arena_grow(cache_reloc_kind, old, 4 * size);
+        cache_reloc_offset = arena_grow(cache_reloc_offset, old, 4 * size);
+        cache_reloc_addend = arena_grow(cache_reloc_addend, old, 4 * size);
+        cache_reloc_name = arena_grow(cache_reloc_name, old, 4 * size);
+        cache_reloc_capacity = size;
+    }
+    i = first;
+    while (i < backpatch_count) {
+        offset = backpatch[i];
+        value = gen_read_code(offset);
+        cache_reloc_offset[cache_reloc_count] = offset - start;
+        cache_reloc_addend[cache_reloc_count] = 0;
+        cache_reloc_name[cache_reloc_count] = 0;
+        if (backpatch_type[i] == STRING) {
+            cache_reloc_kind[cache_reloc_count] = OBJ_STRING;
+            cache_reloc_addend[cache_reloc_count++] = value - string_start;
+        }
+        else if (backpatch_type[i] == GLOBAL) {
+            symidx = backpatch_symbol[i];
+            cache_reloc_kind[cache_reloc_count] = OBJ_DATA;
+            cache_reloc_addend[cache_reloc_count] = value - symbol_address[symidx];
+            cache_reloc_name[cache_reloc_count++] = symbol_name_id[symidx];
+        }
+        else if (symbol_type[value] & FUNCTION) {
+            cache_reloc_kind[cache_reloc_count] = OBJ_CALL;
+            cache_reloc_name[cache_reloc_count++] = symbol_name_id[value];
+        }
+        ++i;
+    }
+}
+
+int job_function(int symidx)
+{
+    int n, ordinal;
+    char *entry;
+
+    // the parent: take the function from the worker that compiled it and
+    // continue after its body. -1 if there is none.
+    ordinal = job_next;
+    ++job_next;
+    if (ordinal >= cache_function_capacity || job_entry[ordinal] == 0)
+        return -1;
+    if (job_end[ordinal] < 0)
+        return -1;
+
+    entry = job_buffer + job_entry[ordinal] - 1;
+    n = cache_new_count++;
+    cache_new_key1[n] = gen_read_dword_from_buffer(entry, 0);
+    cache_new_key2[n] = gen_read_dword_from_buffer(entry, 4);
+    cache_new_name[n] = symbol_name_id[symidx];
+    cache_new_entry[n] = job_entry[ordinal];
+    cache_new_job[n] = 1;
+    cache_new_hit[n] = job_hit[ordinal];
+    cache_hits += job_hit[ordinal];
+    cache_apply(entry, symidx);
+
+    replay_count = 0;
+    lex_seek(job_end[ordinal]);
+    lineno = job_line[ordinal];
+    return lex_next_token();
+}
+
+int cache_function(int symidx, int symidx_old)
+{
+    int n, tok, first, pos, line, directives;
+    char *entry;
+
+    if (job_scout) {
+        // note where the function is for the workers and skip its body
+        n = job_bodies++;
+        cache_reserve_functions(job_bodies);
+        job_begin[n] = job_header;
+        job_begin_line[n] = job_header_line;
+        job_begin_file[n] = pp_file;
+        job_scope[n] = symidx_old;
+        job_symbol[n] = symidx;
+        job_declared[n] = job_header_declared;
+        job_defines[n] = pp_defines;
+        if (replay_count > 0)
+            replay_pos = replay_count;  // read ahead already, see parse_record_inline
+        else {
+            pos = lex_tell();
+            line = lineno;
+            if (lex_skip_block() != 0) {
+                lex_seek(pos);
+                lineno = line;
+                job_begin[n] = -1;
+                return parse_function_body(symidx);  // for the directives in it
+            }
         }
+        job_stop[n] = lex_tell();
+        if (pp_directives != job_header_directives)
+            job_begin[n] = -1;  // directives in the parameters
+        return lex_next_token();
+    }
+    else if (job_count > 1 && !job_worker) {
+        tok = job_function(symidx);
+        if (tok >= 0)
+            return tok;
+    }
 
-        if (tok != ';')
-            parse_error(E_MISSING_SEMICOLON);
-        tok = lex_next_token();
+    // the body is read ahead to compute the key
+    directives = pp_directives;
+    if (replay_count == 0)
+        lex_record_block();
+    cache_reserve_functions(cache_new_count + 1);
+    n = cache_new_count++;
+    cache_new_name[n] = symbol_name_id[symidx];
+    cache_new_entry[n] = 0;
+    cache_new_job[n] = 0;
+    cache_new_hit[n] = 0;
+    job_end[n] = lex_tell();
+    job_line[n] = lineno;
+    if (pp_directives != directives)
+        job_end[n] = -1;  // the parent has to read the directives itself
+
+    entry = 0;
+    if (cache_path) {
+        cache_hash_function(symidx, symidx_old);
+        entry = cache_find();
+    }
+    cache_new_key1[n] = cache_key1;
+    cache_new_key2[n] = cache_key2;
+    if (entry != 0) {
+        cache_new_entry[n] = 1 + (entry - cache_map);
+        cache_new_hit[n] = 1;
+        ++cache_hits;
+        cache_apply(entry, symidx);
+        replay_pos = replay_count;
+        return lex_next_token();
     }
+
+    // a miss: compile the recorded tokens and keep what the cache needs
+    first = backpatch_count;
+    cache_new_code[n] = emit_pos;
+    cache_new_string[n] = string_table_size;
+    cache_new_reloc[n] = cache_reloc_count;
+    tok = parse_function_body(symidx);
+    cache_new_code_size[n] = emit_pos - cache_new_code[n];
+    cache_new_string_size[n] = string_table_size - cache_new_string[n];
+    cache_add_relocations(first, cache_new_code[n], cache_new_string[n]);
+    cache_new_reloc_count[n] = cache_reloc_count - cache_new_reloc[n];
     return tok;
 }
 
-int parse_stmtblock(int tok, int continue_label, int break_label)
+int parse_function(int symidx, int declared, int tok)
 {
-    int symidx_old;
+    int symidx_old, first;
+
+    // function declaration, from the parenthesis on
     symidx_old = symbol_count;
+    symbol_type[symidx] |= FUNCTION;
 
-    while (tok != '}') {
-        if (tok == INT || tok == CHAR || tok == VOID || tok == ENUM)
-            tok = parse_vardecl(tok);
-        else
-            tok = parse_stmt(tok, continue_label, break_label);
+    tok = parse_args(tok);
+    if (tok == ';') {
+        // only a function definition
+        tok = lex_next_token();
     }
-
-    while (symidx_old < symbol_count) {
-        // forget all symbols that belong to that block only
-        if (!(symbol_type[symidx_old] & GLOBAL))
-            symbol_name[symidx_old] = 0;
-        ++symidx_old;
+    else if (tok == '{') {
+        first = backpatch_count;
+        if (!declared)
+            parse_record_inline(symidx, symidx_old);  // not for the ones called from other objects
+        if (cache_path || job_count > 1)
+            tok = cache_function(symidx, symidx_old);
+        else
+            tok = parse_function_body(symidx);
+        gen_backpatch_local(first);
+        gen_flush_code();
     }
+    else
+        parse_error(E_MISSING_FUNCTION_BLOCK);
 
-    return lex_next_token();
+    parse_pop_scope(symidx_old);  // the parameters
+    return tok;
 }
 
 void parse(void)
 {
-    int tok, type, symidx;
+    int tok, type, symidx, declared;
 
     type = 0;
 
@@ -1805,48 +5844,25 @@ void parse(void)
             if (tok != IDENTIFIER)
                 parse_error(E_MISSING_IDENTIFIER);
 
-            symidx = parse_lookup_symbol(token_text);
+            symidx = parse_lookup_name(token_name);
             if (symidx == 0)
-                symidx = parse_add_symbol(token_text);
-            symbol_type[symidx] = type | GLOBAL;
+                symidx = parse_bind_name(token_name);
+            declared = symbol_type[symidx] & FUNCTION;
+            symbol_type[symidx] = (symbol_type[symidx] & DEFINED) | type | GLOBAL;
+
+            if (job_scout) {
+                // a worker can start at the parenthesis if the name came from the input
+                job_header = -1;
+                if (pushed_token == 0 && replay_count == 0 && pp_expand_depth == 0)
+                    job_header = lex_tell();
+                job_header_line = lineno;
+                job_header_declared = declared;
+                job_header_directives = pp_directives;
+            }
 
             tok = lex_next_token();
-            if (tok == '(') {
-                int symidx_old;
-
-                symidx_old = symbol_count;
-
-                // function declaration
-                symbol_type[symidx] |= FUNCTION;
-
-                tok = parse_args(tok);
-                if (tok == ';') {
-                    // only a function definition
-                    tok = lex_next_token();
-                }
-                else if (tok == '{') {
-                    int link;
-
-                    local_variable_space = 4;  // minimum 4 bytes
-                    symbol_address[symidx] = emit_pos;
-                    gen_emitbytes(3, 0x55, 0x89, 0xe5, 0);  // function prolog
-                    gen_emitbytes(2, 0x81, 0xec, 0, 0);     // sub esp
-                    link = emit_pos;
-                    gen_emitdword(0);
-
-                    tok = parse_stmtblock(lex_next_token(), 0, 0);
-                    gen_write_dword_into_buffer(emit_buffer, link, local_variable_space);
-                    gen_emitbytes(4, 0x89, 0xec, 0x5d, 0xc3); // function epilog
-                }
-                else
-                    parse_error(E_MISSING_FUNCTION_BLOCK);
-
-                while (symidx_old < symbol_count) {
-                    // forget all symbols that belong to that function incl. parameters
-                    symbol_name[symidx_old] = 0;
-                    ++symidx_old;
-                }
-            }
+            if (tok == '(')
+                tok = parse_function(symidx, declared, tok);
             else {
                 // global variable declaration
                 tok = parse_vardecl2(tok, type | GLOBAL);
@@ -1859,23 +5875,746 @@ void parse(void)
     } while (tok != 0);
 }
 
+int gen_image_bytes(char *s, int n)
+{
+    int i;
+
+    gen_reserve_image(n);
+    i = 0;
+    while (i < n)
+        image_buffer[image_size++] = s[i++];
+    return n;
+}
+
+int gen_image_dword(int dword)
+{
+    gen_reserve_image(4);
+    gen_write_dword_into_buffer(image_buffer, image_size, dword);
+    image_size += 4;
+    return 4;
+}
+
 int gen_write_pad(int count)
 {
     int n;
-    char buffer[2];
-
-    buffer[0] = 0;
 
+    gen_reserve_image(count);
     n = count;
     while (n-- > 0)
-        _sys_write(1, buffer, 1);
+        image_buffer[image_size++] = 0;
 
     return count;
 }
 
-int main(void)
+void gen_image_flush(int fd)
 {
-    int mainidx, exitidx;
+    int offset;
+
+    // the image of a streamed compile goes around the code that is in the file already,
+    // and the file offset moves behind it for what is written after the output. anything
+    // else is written in sequence
+    if (fd != emit_stream || emit_stream == 0) {
+        gen_write_at(fd, image_buffer, image_size, -1);
+        return;
+    }
+    offset = emit_file_start + image_offset;
+    gen_write_at(fd, image_buffer, image_size, offset);
+    if (_sys_lseek(fd, offset + image_size, LSEEK_SET) < 0)
+        parse_error(E_WRITE_FAILED);
+}
+
+int gen_image_code(char *code, int size)
+{
+    // the code in the image. when it is streamed, the header written so far goes in
+    // front of the code in the file, and the image continues after it
+    if (emit_stream == 0)
+        return gen_image_bytes(code, size);
+    gen_image_flush(emit_stream);
+    image_offset += image_size + emit_base;
+    image_size = 0;
+    gen_image_bytes(code, size - emit_base);
+    return size;
+}
+
+void cache_report(void)
+{
+    char buffer[10];
+    int n;
+
+    // cache: 12 hits, 2 misses: parse gen_expr
+    _sys_write(2, "cache: ", 7);
+    myitoa(buffer, 8, cache_hits);
+    _sys_write(2, buffer, mystrlen(buffer));
+    _sys_write(2, " hits, ", 7);
+    myitoa(buffer, 8, cache_new_count - cache_hits);
+    _sys_write(2, buffer, mystrlen(buffer));
+    _sys_write(2, " misses:", 8);
+    n = 0;
+    while (n < cache_new_count) {
+        if (!cache_new_hit[n]) {
+            _sys_write(2, " ", 1);
+            _sys_write(2, parse_name(cache_new_name[n]), mystrlen(parse_name(cache_new_name[n])));
+        }
+        ++n;
+    }
+    _sys_write(2, "\n", 1);
+}
+
+void gen_peep_report(void)
+{
+    char buffer[10];
+
+    // peephole: 1234 bytes removed
+    _sys_write(2, "peephole: ", 10);
+    myitoa(buffer, 8, peep_removed);
+    _sys_write(2, buffer, mystrlen(buffer));
+    _sys_write(2, " bytes removed\n", 15);
+    _sys_write(2, "short jumps: ", 13);
+    myitoa(buffer, 8, relax_removed);
+    _sys_write(2, buffer, mystrlen(buffer));
+    _sys_write(2, " bytes removed\n", 15);
+}
+
+void cache_serialize_entry(int n)
+{
+    int i, names;
+    char *entry;
+
+    // entries of other processes are copied, the others made from the compiled code
+    entry = cache_new_entry_text(n);
+    if (entry != 0)
+        gen_image_bytes(entry, cache_entry_size(entry));
+    else {
+        names = 0;
+        i = cache_new_reloc[n];
+        while (i < cache_new_reloc[n] + cache_new_reloc_count[n])
+            names += mystrlen(parse_name(cache_reloc_name[i++])) + 1;
+
+        gen_image_dword(cache_new_key1[n]);
+        gen_image_dword(cache_new_key2[n]);
+        gen_image_dword(cache_new_code_size[n]);
+        gen_image_dword(cache_new_string_size[n]);
+        gen_image_dword(cache_new_reloc_count[n]);
+        gen_image_dword(names);
+        gen_image_bytes(emit_buffer + cache_new_code[n], cache_new_code_size[n]);
+        gen_write_pad((4 - cache_new_code_size[n] % 4) % 4);
+        gen_image_bytes(string_table_buffer + cache_new_string[n], cache_new_string_size[n]);
+        gen_write_pad((4 - cache_new_string_size[n] % 4) % 4);
+
+        names = 0;
+        i = cache_new_reloc[n];
+        while (i < cache_new_reloc[n] + cache_new_reloc_count[n]) {
+            gen_image_dword(cache_reloc_kind[i]);
+            gen_image_dword(cache_reloc_offset[i]);
+            gen_image_dword(cache_reloc_addend[i]);
+            gen_image_dword(names);
+            names += mystrlen(parse_name(cache_reloc_name[i++])) + 1;
+        }
+        i = cache_new_reloc[n];
+        while (i < cache_new_reloc[n] + cache_new_reloc_count[n]) {
+            gen_image_bytes(parse_name(cache_reloc_name[i]), mystrlen(parse_name(cache_reloc_name[i])) + 1);
+            ++i;
+        }
+        gen_write_pad((4 - names % 4) % 4);
+    }
+}
+
+void cache_write(void)
+{
+    int fd, n;
+
+    // the functions of this build as the new cache file
+    image_size = 0;
+    gen_image_dword(CACHE_MAGIC);
+    gen_image_dword(cache_new_count);
+    n = 0;
+    while (n < cache_new_count)
+        cache_serialize_entry(n++);
+
+    fd = _sys_open(cache_path, OPEN_WRITE, 420);  // 0644
+    if (fd < 0)
+        parse_error(E_OPEN_FAILED);
+    gen_image_flush(fd);
+    cache_report();
+}
+
+void job_send(int fd)
+{
+    int n;
+
+    // the worker's functions: the body, input position and line after it,
+    // whether it came from the cache file, then the entry
+    image_size = 0;
+    n = 0;
+    while (n < cache_new_count) {
+        gen_image_dword(job_ordinal[n]);
+        gen_image_dword(job_end[n]);
+        gen_image_dword(job_line[n]);
+        gen_image_dword(cache_new_hit[n]);
+        cache_serialize_entry(n++);
+    }
+    gen_image_flush(fd);
+}
+
+void job_receive(int start, int size)
+{
+    int pos, ordinal;
+    char *data;
+
+    // the functions of a worker by the number of their body in the input
+    data = job_buffer + start;
+    pos = 0;
+    while (pos + 40 <= size) {
+        if (pos + 16 + cache_entry_size(data + pos + 16) > size)
+            break;
+        ordinal = gen_read_dword_from_buffer(data, pos);
+        cache_reserve_functions(ordinal + 1);
+        job_end[ordinal] = gen_read_dword_from_buffer(data, pos + 4);
+        job_line[ordinal] = gen_read_dword_from_buffer(data, pos + 8);
+        job_hit[ordinal] = gen_read_dword_from_buffer(data, pos + 12);
+        job_entry[ordinal] = 1 + start + pos + 16;
+        pos += 16 + cache_entry_size(data + pos + 16);
+    }
+}
+
+void job_open_file(int file)
+{
+    // a worker: the file of the next body it compiles
+    if (file == job_file)
+        return;
+    input_size = job_file_size;
+    pp_release_file();
+    if (file >= 0)
+        pp_read_file(file);
+    else {
+        input_buffer = job_input;  // standard input
+        input_size = job_input_size;
+        input_mapped = 1;
+        pp_file = -1;
+    }
+    job_file = file;
+    job_file_size = input_size;
+}
+
+void job_compile(void)
+{
+    int n, count;
+
+    // a worker: seek to each of its functions and compile it, the last one first. the
+    // symbols declared after a function are popped then and the inline trees of the later
+    // functions dropped, so that it sees what the parent sees there. the input ends
+    // after the body, and functions behind a #define or #undef are left to the parent
+    job_file = -2;
+    job_file_size = 0;
+    n = job_bodies;
+    while (n-- > 0) {
+        if (n % job_count == job_index && job_begin[n] >= 0 && job_defines[n] == pp_defines) {
+            parse_pop_scope(job_scope[n]);
+            job_open_file(job_begin_file[n]);
+            lex_seek(job_begin[n]);
+            input_size = job_stop[n];
+            lineno = job_begin_line[n];
+            pushed_token = 0;
+            replay_count = 0;
+            pp_expand_depth = 0;
+            count = cache_new_count;
+            parse_function(job_symbol[n], job_declared[n], lex_next_token());
+            if (cache_new_count > count)
+                job_ordinal[count] = n;
+        }
+        symbol_inline[job_symbol[n]] = 0;
+    }
+    input_size = job_file_size;
+    pp_release_file();
+}
+
+void job_run(void)
+{
+    int k, pid, n, status, size;
+
+    // the workers seek in the input, so it has to be a file they can map
+    if (!input_mapped) {
+        job_count = 0;
+        return;
+    }
+    if (job_count > MAX_JOBS)
+        job_count = MAX_JOBS;
+
+    k = 0;
+    while (k < job_count) {
+        if (_sys_pipe(job_pipe) != 0)
+            break;
+        job_fd[k] = job_pipe[0];
+        job_write_fd[k++] = job_pipe[1];
+    }
+    job_input = input_buffer;
+    job_input_size = input_size;
+    pid = -1;
+    if (k > 1)
+        pid = _sys_fork();
+    if (pid == 0) {
+        // the scout: find the function bodies, then fork the other workers and be the first one
+        compile_quiet = 1;
+        n = 0;
+        while (n < k)
+            _sys_close(job_fd[n++]);
+        job_scout = 1;
+        parse();
+        job_scout = 0;
+        job_worker = 1;
+        job_count = k;
+        job_index = 1;
+        while (job_index < k && _sys_fork() != 0)
+            ++job_index;
+        if (job_index == k)
+            job_index = 0;
+        n = 0;
+        while (n < k) {
+            if (n != job_index)
+                _sys_close(job_write_fd[n]);
+            ++n;
+        }
+        job_compile();
+        job_send(job_write_fd[job_index]);
+        _sys_exit(0);
+    }
+    n = 0;
+    while (n < k)
+        _sys_close(job_write_fd[n++]);
+    if (pid < 0) {
+        n = 0;
+        while (n < k)
+            _sys_close(job_fd[n++]);
+        job_count = 0;
+        return;
+    }
+    job_count = k;
+
+    // collect in worker order. functions of a worker that failed are
+    // missing, the parent compiles them itself then.
+    job_start[0] = 0;
+    n = 0;
+    while (n < k) {
+        job_start[n + 1] = job_start[n];
+        status = 1;
+        while (status > 0) {
+            if (job_start[n + 1] + JOB_READ_SIZE > job_buffer_capacity) {
+                size = arena_size(job_buffer_capacity, job_start[n + 1] + JOB_READ_SIZE, JOB_READ_SIZE);
+                job_buffer = arena_grow(job_buffer, job_buffer_capacity, size);
+                job_buffer_capacity = size;
+            }
+            status = _sys_read(job_fd[n], job_buffer + job_start[n + 1], job_buffer_capacity - job_start[n + 1]);
+            if (status > 0)
+                job_start[n + 1] += status;
+        }
+        _sys_close(job_fd[n]);
+        ++n;
+    }
+    _sys_waitpid(pid, &status, 0);  // the workers it forked are reaped by init
+
+    n = 0;
+    while (n < k) {
+        job_receive(job_start[n], job_start[n + 1] - job_start[n]);
+        ++n;
+    }
+}
+
+void gen_object_tables(void)
+{
+    int i, n, symidx, offset, value;
+
+    // functions and global variables are visible to other objects
+    object_count = 0;
+    symidx = num_keywords;
+    while (symidx < symbol_count) {
+        if (symbol_name_id[symidx] != 0 && (symbol_type[symidx] & GLOBAL)) {
+            symbol_export[symidx] = object_count;
+            object_name[object_count] = symbol_name_id[symidx];
+            if (!(symbol_type[symidx] & FUNCTION)) {
+                object_kind[object_count] = OBJ_COMMON;
+                object_value[object_count] = (symbol_size[symidx] + 3) & ~3;
+            }
+            else if (symbol_type[symidx] & DEFINED) {
+                object_kind[object_count] = OBJ_FUNCTION;
+                object_value[object_count] = symbol_address[symidx];
+            }
+            else {
+                object_kind[object_count] = OBJ_UNDEFINED;
+                object_value[object_count] = 0;
+            }
+            ++object_count;
+        }
+        ++symidx;
+    }
+
+    // jumps and calls within the object are backpatched now, the rest become relocations
+    i = 0;
+    n = 0;
+    while (i < backpatch_count) {
+        offset = backpatch[i];
+        value = gen_read_code(offset);
+        if (backpatch_type[i] == STRING) {
+            backpatch_type[n] = OBJ_STRING;
+            backpatch_symbol[n] = 0;
+        }
+        else if (backpatch_type[i] == GLOBAL) {
+            symidx = backpatch_symbol[i];
+            value -= symbol_address[symidx];
+            backpatch_type[n] = OBJ_DATA;
+            backpatch_symbol[n] = symbol_export[symidx];
+        }
+        else if ((symbol_type[value] & (FUNCTION | DEFINED)) == FUNCTION) {
+            backpatch_type[n] = OBJ_CALL;
+            backpatch_symbol[n] = symbol_export[value];
+            value = -4;
+        }
+        else {
+            gen_patch_code(offset, symbol_address[value] - (offset + 4));
+            ++i;
+            continue;
+        }
+        gen_patch_code(offset, value);
+        backpatch[n] = offset;
+        ++n;
+        ++i;
+    }
+    backpatch_count = n;
+}
+
+void link_add_code(char *code, int code_size, char *strings, int strings_size)
+{
+    link_code_base = emit_pos;
+    while (code_size-- > 0)
+        gen_emitbyte(*code++);
+    link_string_base = parse_add_string(strings, strings_size);
+}
+
+void link_add_symbol(char *name, int kind, int value)
+{
+    int symidx;
+
+    symidx = parse_lookup_symbol(name);
+    if (symidx == 0)
+        symidx = parse_add_symbol(name);
+
+    if (kind == OBJ_FUNCTION) {
+        if (symbol_type[symidx] & DEFINED)
+            parse_error(E_DUPLICATE_SYMBOL);
+        symbol_type[symidx] = INT | GLOBAL | FUNCTION | DEFINED;
+        symbol_address[symidx] = link_code_base + value;
+    }
+    else if (kind == OBJ_COMMON) {
+        if (!(symbol_type[symidx] & GLOBAL)) {
+            // the first object that declares the variable allocates it
+            symbol_type[symidx] = INT | GLOBAL;
+            symbol_size[symidx] = value;
+            symbol_address[symidx] = global_variable_space;
+            global_variable_space += value;
+        }
+    }
+    else if (symbol_type[symidx] == 0)
+        symbol_type[symidx] = INT | GLOBAL | FUNCTION;
+}
+
+void link_add_relocation(int kind, int offset, char *name)
+{
+    int symidx, value;
+
+    // turn the relocation back into the backpatch record the compiler would have made
+    offset += link_code_base;
+    value = gen_read_code(offset);
+    if (kind == OBJ_STRING) {
+        gen_patch_code(offset, value + link_string_base);
+        gen_add_backpatch(STRING, offset);
+        return;
+    }
+
+    symidx = parse_lookup_symbol(name);
+    if (kind == OBJ_CALL && (symbol_type[symidx] & FUNCTION)) {
+        gen_patch_code(offset, symidx);
+        gen_add_backpatch(0, offset);
+    }
+    else if (kind == OBJ_DATA && (symbol_type[symidx] & (GLOBAL | FUNCTION)) == GLOBAL) {
+        gen_patch_code(offset, value + symbol_address[symidx]);
+        gen_add_global_backpatch(offset, symidx);
+    }
+    else
+        parse_error(E_BAD_OBJECT);
+}
+
+void link_file(char *path)
+{
+    int fd, size;
+    char *object;
+
+    fd = _sys_open(path, OPEN_READ, 0);
+    if (fd < 0)
+        parse_error(E_OPEN_FAILED);
+
+    size = _sys_lseek(fd, 0, LSEEK_END);
+    object = _sys_mmap(fd, size);
+    if (object == 0 || gen_read_object(object, size) != 0)
+        parse_error(E_BAD_OBJECT);
+}
+
+void link_check_undefined(void)
+{
+    int i, symidx;
+
+    i = 0;
+    while (i < backpatch_count) {
+        if (backpatch_type[i] == 0) {
+            symidx = gen_read_code(backpatch[i]);
+            if (symbol_address[symidx] == 0)
+                parse_error_name(E_UNDEFINED_IDENTIFIER, parse_name(symbol_name_id[symidx]));
+        }
+        ++i;
+    }
+}
+
+// the compiler proper, for main() and for the library in libnanocc.c. a compile
+// leaves the file image in image_buffer; errors end it in parse_error.
+
+void compile_reset(void)
+{
+    int i;
+
+    // a previous compile in this process: clear the tables as far as they were used
+    i = 0;
+    while (i < symbol_count) {
+        symbol_name_id[i] = 0;
+        symbol_shadow[i] = 0;
+        symbol_type[i] = 0;
+        symbol_address[i] = 0;
+        symbol_size[i] = 0;
+        symbol_register[i] = 0;
+        symbol_inline[i] = 0;
+        symbol_export[i] = 0;
+        ++i;
+    }
+    i = 0;
+    while (i <= name_count && i < name_capacity) {
+        name_symbol[i] = 0;
+        name_label[i] = 0;
+        name_register[i] = 0;
+        pp_name_macro[i] = 0;
+        ++i;
+    }
+    i = 0;
+    while (i < pp_macros)
+        pp_macro_active[i++] = 0;
+    i = 0;
+    while (i < 2 * name_capacity)
+        name_hash[i++] = 0;
+    i = 0;
+    while (i < cache_slot_capacity)
+        cache_slot[i++] = 0;
+    i = 0;
+    while (i < cache_function_capacity)
+        job_entry[i++] = 0;
+
+    symbol_count = 0;
+    name_count = 0;
+    symbol_name_buffer_size = 0;
+    parse_add_symbol_name("");
+    string_table_size = 0;
+    backpatch_count = 0;
+    label_count = 0;
+    label_fixups = 0;
+    object_count = 0;
+    link_code_base = 0;
+    link_string_base = 0;
+    emit_pos = 0;
+    emit_base = 0;
+    emit_stream = 0;
+    backpatch_kept = 0;
+    image_size = 0;
+    image_offset = 0;
+    global_variable_space = 0;
+    local_variable_space = 0;
+    gen_reg_vars = 0;
+    inline_node_count = 0;
+    pushed_token = 0;
+    current_char = 0;
+    previous_char = 0;
+    replay_count = 0;
+    replay_pos = 0;
+    cache_path = 0;
+    cache_old_count = 0;
+    cache_new_count = 0;
+    cache_hits = 0;
+    cache_reloc_count = 0;
+    job_count = 0;
+    job_next = 0;
+    job_bodies = 0;
+    pp_line_mode = 0;
+    pp_directives = 0;
+    pp_defines = 0;
+    pp_macros = 0;
+    pp_macro_tokens = 0;
+    pp_macro_text_size = 0;
+    pp_expand_depth = 0;
+    pp_cond_depth = 0;
+    pp_close_files();
+    pp_files = 0;
+    pp_file = -1;
+    pp_path_text_size = 0;
+    pp_guard_state = GUARD_NONE;
+    pp_sources = 0;
+    pp_source_next = 0;
+    compile_error = 0;
+}
+
+#ifdef NANOCC_LIB
+void *arena_free(void *p)
+{
+    free(p);
+    return 0;
+}
+
+void compile_free(void)
+{
+    int i;
+
+    // the tables of this thread back to the heap, when it is done compiling (see libnanocc.c).
+    // the thread can compile again, they grow from the start then
+    compile_reset();
+    input_chunk = arena_free(input_chunk);
+    token_text = arena_free(token_text);
+    token_text_capacity = 0;
+    pp_macro_first = arena_free(pp_macro_first);
+    pp_macro_count = arena_free(pp_macro_count);
+    pp_macro_active = arena_free(pp_macro_active);
+    pp_macro_capacity = 0;
+    pp_macro_token = arena_free(pp_macro_token);
+    pp_macro_value = arena_free(pp_macro_value);
+    pp_macro_token_capacity = 0;
+    pp_macro_text = arena_free(pp_macro_text);
+    pp_macro_text_capacity = 0;
+    pp_file_path = arena_free(pp_file_path);
+    pp_file_guard = arena_free(pp_file_guard);
+    pp_file_once = arena_free(pp_file_once);
+    pp_file_capacity = 0;
+    pp_path_text = arena_free(pp_path_text);
+    pp_path_text_capacity = 0;
+    i = 0;
+    while (i <= MAX_INCLUDE) {
+        pp_read_buffer[i] = arena_free(pp_read_buffer[i]);
+        pp_read_capacity[i++] = 0;
+    }
+    pp_source = arena_free(pp_source);
+    pp_source_capacity = 0;
+    replay_token = arena_free(replay_token);
+    replay_value = arena_free(replay_value);
+    replay_line = arena_free(replay_line);
+    replay_capacity = 0;
+    replay_text = arena_free(replay_text);
+    replay_text_capacity = 0;
+    string_table_buffer = arena_free(string_table_buffer);
+    string_table_capacity = 0;
+    symbol_name_buffer = arena_free(symbol_name_buffer);
+    symbol_name_buffer_size = 0;
+    symbol_name_buffer_capacity = 0;
+    name_hash = arena_free(name_hash);
+    name_hash_value = arena_free(name_hash_value);
+    name_offset = arena_free(name_offset);
+    name_symbol = arena_free(name_symbol);
+    name_label = arena_free(name_label);
+    name_register = arena_free(name_register);
+    pp_name_macro = arena_free(pp_name_macro);
+    name_capacity = 0;
+    symbol_name_id = arena_free(symbol_name_id);
+    symbol_shadow = arena_free(symbol_shadow);
+    symbol_type = arena_free(symbol_type);
+    symbol_address = arena_free(symbol_address);
+    symbol_size = arena_free(symbol_size);
+    symbol_register = arena_free(symbol_register);
+    symbol_inline = arena_free(symbol_inline);
+    symbol_export = arena_free(symbol_export);
+    object_name = arena_free(object_name);
+    object_kind = arena_free(object_kind);
+    object_value = arena_free(object_value);
+    symbol_capacity = 0;
+    backpatch = arena_free(backpatch);
+    backpatch_type = arena_free(backpatch_type);
+    backpatch_symbol = arena_free(backpatch_symbol);
+    backpatch_value = arena_free(backpatch_value);
+    backpatch_capacity = 0;
+    label_address = arena_free(label_address);
+    label_name = arena_free(label_name);
+    label_capacity = 0;
+    label_fixup = arena_free(label_fixup);
+    label_fixup_label = arena_free(label_fixup_label);
+    label_fixup_op = arena_free(label_fixup_op);
+    label_fixup_short = arena_free(label_fixup_short);
+    label_fixup_removed = arena_free(label_fixup_removed);
+    label_fixup_capacity = 0;
+    cache_slot = arena_free(cache_slot);
+    cache_old_entry = arena_free(cache_old_entry);
+    cache_slot_capacity = 0;
+    cache_new_key1 = arena_free(cache_new_key1);
+    cache_new_key2 = arena_free(cache_new_key2);
+    cache_new_entry = arena_free(cache_new_entry);
+    cache_new_job = arena_free(cache_new_job);
+    cache_new_hit = arena_free(cache_new_hit);
+    cache_new_code = arena_free(cache_new_code);
+    cache_new_code_size = arena_free(cache_new_code_size);
+    cache_new_string = arena_free(cache_new_string);
+    cache_new_string_size = arena_free(cache_new_string_size);
+    cache_new_reloc = arena_free(cache_new_reloc);
+    cache_new_reloc_count = arena_free(cache_new_reloc_count);
+    cache_new_name = arena_free(cache_new_name);
+    job_entry = arena_free(job_entry);
+    job_end = arena_free(job_end);
+    job_line = arena_free(job_line);
+    job_hit = arena_free(job_hit);
+    job_begin = arena_free(job_begin);
+    job_begin_line = arena_free(job_begin_line);
+    job_stop = arena_free(job_stop);
+    job_begin_file = arena_free(job_begin_file);
+    job_scope = arena_free(job_scope);
+    job_symbol = arena_free(job_symbol);
+    job_declared = arena_free(job_declared);
+    job_defines = arena_free(job_defines);
+    job_ordinal = arena_free(job_ordinal);
+    cache_function_capacity = 0;
+    cache_reloc_kind = arena_free(cache_reloc_kind);
+    cache_reloc_offset = arena_free(cache_reloc_offset);
+    cache_reloc_addend = arena_free(cache_reloc_addend);
+    cache_reloc_name = arena_free(cache_reloc_name);
+    cache_reloc_capacity = 0;
+    job_buffer = arena_free(job_buffer);
+    job_buffer_capacity = 0;
+    expr_table = arena_free(expr_table);
+    expr_capacity = 0;
+    operator_stack = arena_free(operator_stack);
+    operator_capacity = 0;
+    arg_stack = arena_free(arg_stack);
+    arg_capacity = 0;
+    branch_stack = arena_free(branch_stack);
+    branch_capacity = 0;
+    reg_candidate = arena_free(reg_candidate);
+    reg_candidate_capacity = 0;
+    reg_loop = arena_free(reg_loop);
+    reg_loop_capacity = 0;
+    inline_node = arena_free(inline_node);
+    inline_node_capacity = 0;
+    gen_frames = arena_free(gen_frames);
+    gen_frame_capacity = 0;
+    gen_value_reg = arena_free(gen_value_reg);
+    gen_value_capacity = 0;
+    gen_tail_calls = arena_free(gen_tail_calls);
+    gen_tail_call_capacity = 0;
+    emit_buffer = arena_free(emit_buffer);
+    emit_capacity = 0;
+    image_buffer = arena_free(image_buffer);
+    image_capacity = 0;
+}
+#endif
+
+void compile_init(void)
+{
+    compile_reset();
 
     parse_add_symbol("");
     if (CHAR != parse_add_symbol("char")) parse_error(E_BAD_INITIALIZATION);
@@ -1892,8 +6631,19 @@ int main(void)
     if (GOTO != parse_add_symbol("goto")) parse_error(E_BAD_INITIALIZATION);
 
     num_keywords = symbol_count;
+    pp_predefine("__NANOCC__", 1);
+
+    lineno = 1;
+    lex_init();
+    parse_init_precedence();
+}
+
+void compile_prolog(void)
+{
+    int mainidx, exitidx;
 
-    // generate prolog to call main and exit
+    // generate prolog to call main(argc, argv) and exit
+    gen_push_args();
     gen_emitbyte(0xe8);  // call main
     mainidx = parse_add_symbol("main");
     gen_add_backpatch(0, emit_pos);
@@ -1904,12 +6654,92 @@ int main(void)
     exitidx = parse_add_symbol("_sys_exit");
     gen_add_backpatch(0, emit_pos);
     gen_emitdword(exitidx);
+}
 
-    lineno = 1;
+void compile_source(int object)
+{
+    // the input is open already
+    if (object) {
+        // relocatable object: no prolog and no library, calls to other objects become relocations
+        parse();
+        gen_object_tables();
+        if (gen_write_object(emit_buffer, emit_pos, string_table_buffer, string_table_size,
+                             object_name, object_kind, object_value, object_count,
+                             backpatch, backpatch_type, backpatch_symbol, backpatch_count) != 0)
+            parse_error(E_NO_OBJECT_FORMAT);
+        return;
+    }
+
+    compile_prolog();
     parse();
+    gen_library(emit_pos, symbol_type, symbol_address, symbol_count);
+    gen_write_binary(emit_buffer, emit_pos, string_table_buffer, string_table_size);
+}
+
+void compile_link(char *path[], int first, int count)
+{
+    int i;
 
-    gen_library(emit_pos, symbol_name, symbol_type, symbol_address, symbol_count);
+    // link the objects path[first..count) in that order
+    compile_prolog();
+    lineno = 0;
+    i = first;
+    while (i < count)
+        link_file(path[i++]);
+    gen_library(emit_pos, symbol_type, symbol_address, symbol_count);
+    link_check_undefined();
     gen_write_binary(emit_buffer, emit_pos, string_table_buffer, string_table_size);
+}
+
+#ifndef NANOCC_LIB
+int main(int argc, char *argv[])
+{
+    int i, object, link, verbose;
+
+    compile_init();
+
+    // -c: object file, -i file: incremental build with a cache, -j n: n parallel jobs, -v: report
+    // what the peephole optimizer saved, -l objects...: link, any other name: a source file, read
+    // in that order instead of standard input
+    object = 0;
+    link = 0;
+    verbose = 0;
+    i = 1;
+    while (i < argc && link == 0) {
+        if (streq(argv[i], "-c"))
+            object = 1;
+        else if (streq(argv[i], "-i") && i + 1 < argc)
+            cache_open(argv[++i]);
+        else if (streq(argv[i], "-j") && i + 1 < argc)
+            job_count = myatoi(argv[++i]);
+        else if (streq(argv[i], "-v"))
+            verbose = 1;
+        else if (streq(argv[i], "-l"))
+            link = i + 1;
+        else if (*argv[i] != '-')
+            pp_add_source(argv[i]);
+        else
+            parse_error(E_UNKNOWN_OPTION);
+        ++i;
+    }
+
+    if (link)
+        compile_link(argv, link, argc);
+    else {
+        lex_open_input();
+        if (job_count > 1)
+            job_run();
+        else if (!object && cache_path == 0)
+            gen_stream_code(1);
+        compile_source(object);
+    }
+
+    gen_image_flush(1);
+    if (cache_path)
+        cache_write();
+    if (verbose)
+        gen_peep_report();
 
     return 0;
 }
+#endif
@@ -1,3 +1,4 @@
+#ifndef __NANOCC__
 #include <stdio.h>
 #include <stdlib.h>
 #ifdef _MSC_VER
@@ -6,12 +7,14 @@
 #else
 #include <unistd.h>
 #endif
+#endif
 
-// nanocc treats all # lines as comments
 #include "nanocc-itf.h"
+#ifndef __NANOCC__
 #define _sys_read  read
 #define _sys_write write
 #define _sys_exit  exit
+#endif
 
 // pe32 binary generator
 
@@ -23,9 +26,6 @@ enum PE32_SIZES {
     TEXT_SEG   = 0x001000,
 };
 
-int gen_write_pad(int count);
-void gen_backpatching(int string_base, int idata_base, int data_base);
-
 int write_bytes(int count, int b1, int b2, int b3, int b4)
 {
     char buffer[4];
@@ -33,8 +33,7 @@ int write_bytes(int count, int b1, int b2, int b3, int b4)
     buffer[1] = b2;
     buffer[2] = b3;
     buffer[3] = b4;
-    _sys_write(1, buffer, count);
-    return count;
+    return gen_image_bytes(buffer, count);
 }
 
 int write_opt_header(int SizeOfCode, int SizeOfInitializedData, int AddressOfEntryPoint, int BaseOfData, int ImageBase, int SizeOfImage)
@@ -56,33 +55,33 @@ int write_opt_header(int SizeOfCode, int SizeOfInitializedData, int AddressOfEnt
 
     n += write_bytes(2, 0x0b, 0x01, 0, 0);          // Magic (PE32)
     n += write_bytes(2, 0x08, 0x00, 0, 0);          // LinkerVersion UNUSED
-    n += _sys_write(1, &SizeOfCode, 4);             // SizeOfCode
-    n += _sys_write(1, &SizeOfInitializedData, 4);  // SizeOfInitializedData
+    n += gen_image_dword(SizeOfCode);             // SizeOfCode
+    n += gen_image_dword(SizeOfInitializedData);  // SizeOfInitializedData
     n += gen_write_pad(4);                          // SizeOfUninitializedData UNUSED
-    n += _sys_write(1, &AddressOfEntryPoint, 4);    // AddressOfEntryPoint
-    n += _sys_write(1, &AddressOfEntryPoint, 4);    // BaseOfCode UNUSED
-    n += _sys_write(1, &BaseOfData, 4);             // BaseOfData UNUSED
-    n += _sys_write(1, &ImageBase, 4);              // ImageBase
-    n += _sys_write(1, &SectionAlignment, 4);       // SectionAlignment
-    n += _sys_write(1, &FileAlignment, 4);          // FileAlignment
+    n += gen_image_dword(AddressOfEntryPoint);    // AddressOfEntryPoint
+    n += gen_image_dword(AddressOfEntryPoint);    // BaseOfCode UNUSED
+    n += gen_image_dword(BaseOfData);             // BaseOfData UNUSED
+    n += gen_image_dword(ImageBase);              // ImageBase
+    n += gen_image_dword(SectionAlignment);       // SectionAlignment
+    n += gen_image_dword(FileAlignment);          // FileAlignment
     n += write_bytes(4, 0x04, 0x00, 0x00, 0x00);    // OperatingSystemVersion UNUSED
     n += write_bytes(4, 0x00, 0x00, 0x00, 0x00);    // ImageVersion  UNUSED
     n += write_bytes(4, 0x04, 0x00, 0x00, 0x00);    // SubsystemVersion
     n += write_bytes(4, 0x00, 0x00, 0x00, 0x00);    // Win32VersionValue UNUSED
-    n += _sys_write(1, &SizeOfImage, 4);            // SizeOfImage  (incl 8MB bss)
-    n += _sys_write(1, &SizeOfHeaders, 4);          // SizeOfHeaders
+    n += gen_image_dword(SizeOfImage);            // SizeOfImage  (incl 8MB bss)
+    n += gen_image_dword(SizeOfHeaders);          // SizeOfHeaders
     n += write_bytes(4, 0x00, 0x00, 0x00, 0x00);    // CheckSum UNUSED
     n += write_bytes(2, 0x03, 0x00, 0x00, 0x00);    // Subsystem (02:Win32 GUI, 03:Console)
     n += write_bytes(2, 0x00, 0x00, 0x00, 0x00);    // DllCharacteristics UNUSED
-    n += _sys_write(1, &SizeOfStackReserve, 4);     // SizeOfStackReserve
-    n += _sys_write(1, &SizeOfStackCommit, 4);      // SizeOfStackCommit
-    n += _sys_write(1, &SizeOfHeapReserve, 4);      // SizeOfHeapReserve
-    n += _sys_write(1, &SizeOfHeapCommit, 4);       // SizeOfHeapCommit
+    n += gen_image_dword(SizeOfStackReserve);     // SizeOfStackReserve
+    n += gen_image_dword(SizeOfStackCommit);      // SizeOfStackCommit
+    n += gen_image_dword(SizeOfHeapReserve);      // SizeOfHeapReserve
+    n += gen_image_dword(SizeOfHeapCommit);       // SizeOfHeapCommit
     n += write_bytes(4, 0x00, 0x00, 0x00, 0x00);    // LoaderFlags  UNUSED
     n += write_bytes(4, 0x10, 0x00, 0x00, 0x00);    // NumberOfRvaAndSizes UNUSED
     n += gen_write_pad(8);                          // no export table
-    n += _sys_write(1, &BaseOfData, 4);             // import table
-    n += _sys_write(1, &import_table_size, 4);      // import_table_size
+    n += gen_image_dword(BaseOfData);             // import table
+    n += gen_image_dword(import_table_size);      // import_table_size
     n += gen_write_pad(112);                        // no other entries in the data directory
 
     return n;
@@ -95,21 +94,21 @@ int write_section(char *name,
     int n;
     n = 0;
 
-    n += _sys_write(1, name, 8);                 // name
-    n += _sys_write(1, &VirtualSize, 4);         // VirtualSize
-    n += _sys_write(1, &VirtualAddress, 4);      // VirtualAddress
-    n += _sys_write(1, &SizeOfRawData, 4);       // SizeOfRawData
-    n += _sys_write(1, &PointerToRawData, 4);    // PointerToRawData
+    n += gen_image_bytes(name, 8);                 // name
+    n += gen_image_dword(VirtualSize);         // VirtualSize
+    n += gen_image_dword(VirtualAddress);      // VirtualAddress
+    n += gen_image_dword(SizeOfRawData);       // SizeOfRawData
+    n += gen_image_dword(PointerToRawData);    // PointerToRawData
     n += write_bytes(4, 0x00, 0x00, 0x00, 0x00); // PointerToRelocations UNUSED
     n += write_bytes(4, 0x00, 0x00, 0x00, 0x00); // PointerToLinenumbers UNUSED
     n += write_bytes(2, 0x00, 0x00, 0x00, 0x00); // NumberOfRelocations UNUSED
     n += write_bytes(2, 0x00, 0x00, 0x00, 0x00); // NumberOfLinenumbers UNUSED
-    n += _sys_write(1, &Characteristics, 4);     // Characteristics
+    n += gen_image_dword(Characteristics);     // Characteristics
 
     return n;
 }
 
-void gen_library(int emit_pos, char *symbol_name[], int *symbol_type, int *symbol_address, int symbol_count)
+void gen_library(int emit_pos, int *symbol_type, int *symbol_address, int symbol_count)
 {
     int symidx;
 
@@ -181,6 +180,11 @@ void gen_library(int emit_pos, char *symbol_name[], int *symbol_type, int *symbo
         emit_pos += gen_emitbyte(0x50);                    // push   eax
         emit_pos += gen_emitbytes(3, 0x8b, 0x45, 0x0c, 0); // mov    eax,DWORD PTR [ebp+0x0c]
         emit_pos += gen_emitbyte(0x50);                    // push   eax
+
+        // fd 0 is standard input, any other fd a handle from _sys_open
+        emit_pos += gen_emitbytes(3, 0x8b, 0x45, 0x08, 0); // mov    eax,DWORD PTR [ebp+0x08]
+        emit_pos += gen_emitbytes(2, 0x09, 0xc0, 0, 0);    // or     eax,eax
+        emit_pos += gen_emitbytes(2, 0x75, 0x08, 0, 0);    // jne    +8
         emit_pos += gen_emitbytes(2, 0x6a, 0xf6, 0, 0);    // push   -10
         emit_pos += gen_emitbytes(2, 0xff, 0x15, 0, 0);    // call   DWORD PTR ds:0x202c
         temp = 0x2c;
@@ -198,6 +202,126 @@ void gen_library(int emit_pos, char *symbol_name[], int *symbol_type, int *symbo
         emit_pos += gen_emitbyte(0x5d);                    // pop    ebp
         emit_pos += gen_emitbyte(0xc3);                    // ret
     }
+
+    symidx = parse_lookup_symbol("_sys_lseek");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        int temp;
+
+        // stdin is not seekable here: the lexer reads it in chunks
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_emitbyte(0xb8);                    // mov    eax, -1
+        temp = -1;
+        emit_pos += gen_emitdword(temp);
+        emit_pos += gen_emitbyte(0xc3);                    // ret
+    }
+
+    symidx = parse_lookup_symbol("_sys_mmap");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_emitbytes(3, 0x31, 0xc0, 0xc3, 0); // xor eax,eax / ret  ; no mapping
+    }
+
+    symidx = parse_lookup_symbol("_sys_munmap");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_emitbytes(3, 0x31, 0xc0, 0xc3, 0); // xor eax,eax / ret
+    }
+
+    symidx = parse_lookup_symbol("_sys_open");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        int temp;
+
+        // opens existing files for reading, for #include. no objects to
+        // link or write on windows yet: other flags fail with -1
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_emitbyte(0x55);                    // push   ebp
+        emit_pos += gen_emitbytes(2, 0x89, 0xe5, 0, 0);    // mov    ebp,esp
+        emit_pos += gen_emitbyte(0xb8);                    // mov    eax, -1
+        temp = -1;
+        emit_pos += gen_emitdword(temp);
+        emit_pos += gen_emitbytes(4, 0x83, 0x7d, 0x0c, 0); // cmp    DWORD PTR [ebp+0x0c],0x0
+        emit_pos += gen_emitbytes(2, 0x75, 0x1b, 0, 0);    // jne    +27
+        emit_pos += gen_emitbytes(2, 0x6a, 0x00, 0, 0);    // push   0x0          template
+        emit_pos += gen_emitbyte(0x68);                    // push   0x80         FILE_ATTRIBUTE_NORMAL
+        emit_pos += gen_emitbytes(4, 0x80, 0x00, 0x00, 0x00);
+        emit_pos += gen_emitbytes(2, 0x6a, 0x03, 0, 0);    // push   0x3          OPEN_EXISTING
+        emit_pos += gen_emitbytes(2, 0x6a, 0x00, 0, 0);    // push   0x0          security
+        emit_pos += gen_emitbytes(2, 0x6a, 0x01, 0, 0);    // push   0x1          FILE_SHARE_READ
+        emit_pos += gen_emitbyte(0x68);                    // push   0x80000000   GENERIC_READ
+        emit_pos += gen_emitbytes(4, 0x00, 0x00, 0x00, 0x80);
+        emit_pos += gen_emitbytes(3, 0xff, 0x75, 0x08, 0); // push   DWORD PTR [ebp+0x08]
+        emit_pos += gen_emitbytes(2, 0xff, 0x15, 0, 0);    // call   DWORD PTR ds:0x2038   CreateFileA
+        temp = 0x38;
+        gen_add_backpatch(0x2800, emit_pos);
+        emit_pos += gen_emitdword(temp);
+        emit_pos += gen_emitbytes(2, 0x89, 0xec, 0, 0);    // mov    esp,ebp
+        emit_pos += gen_emitbyte(0x5d);                    // pop    ebp
+        emit_pos += gen_emitbyte(0xc3);                    // ret
+    }
+
+    symidx = parse_lookup_symbol("_sys_realloc");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        int temp;
+
+        // a new zeroed block from VirtualAlloc and the old contents copied into it.
+        // the old block is not given back
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_emitbyte(0x55);                    // push   ebp
+        emit_pos += gen_emitbytes(2, 0x89, 0xe5, 0, 0);    // mov    ebp,esp
+        emit_pos += gen_emitbytes(2, 0x56, 0x57, 0, 0);    // push   esi / push edi
+        emit_pos += gen_emitbytes(2, 0x6a, 0x04, 0, 0);    // push   0x4          PAGE_READWRITE
+        emit_pos += gen_emitbyte(0x68);                    // push   0x3000       MEM_COMMIT | MEM_RESERVE
+        emit_pos += gen_emitbytes(4, 0x00, 0x30, 0x00, 0x00);
+        emit_pos += gen_emitbytes(3, 0xff, 0x75, 0x10, 0); // push   DWORD PTR [ebp+0x10]
+        emit_pos += gen_emitbytes(2, 0x6a, 0x00, 0, 0);    // push   0x0
+        emit_pos += gen_emitbytes(2, 0xff, 0x15, 0, 0);    // call   DWORD PTR ds:0x203c   VirtualAlloc
+        temp = 0x3c;
+        gen_add_backpatch(0x2800, emit_pos);
+        emit_pos += gen_emitdword(temp);
+        emit_pos += gen_emitbytes(2, 0x09, 0xc0, 0, 0);    // or     eax,eax
+        emit_pos += gen_emitbytes(2, 0x74, 0x0a, 0, 0);    // je     +10
+        emit_pos += gen_emitbytes(3, 0x8b, 0x75, 0x08, 0); // mov    esi,DWORD PTR [ebp+0x08]
+        emit_pos += gen_emitbytes(2, 0x89, 0xc7, 0, 0);    // mov    edi,eax
+        emit_pos += gen_emitbytes(3, 0x8b, 0x4d, 0x0c, 0); // mov    ecx,DWORD PTR [ebp+0x0c]
+        emit_pos += gen_emitbytes(2, 0xf3, 0xa4, 0, 0);    // rep movsb
+        emit_pos += gen_emitbytes(2, 0x5f, 0x5e, 0, 0);    // pop    edi / pop esi
+        emit_pos += gen_emitbytes(2, 0x89, 0xec, 0, 0);    // mov    esp,ebp
+        emit_pos += gen_emitbyte(0x5d);                    // pop    ebp
+        emit_pos += gen_emitbyte(0xc3);                    // ret
+    }
+
+    symidx = parse_lookup_symbol("_sys_fork");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        int temp;
+
+        // no worker processes: -j compiles serially. _sys_pipe, _sys_waitpid
+        // and _sys_close are never reached then and share the stub.
+        symbol_address[symidx] = emit_pos;
+        symbol_address[parse_lookup_symbol("_sys_pipe")] = emit_pos;
+        symbol_address[parse_lookup_symbol("_sys_waitpid")] = emit_pos;
+        symbol_address[parse_lookup_symbol("_sys_close")] = emit_pos;
+        emit_pos += gen_emitbyte(0xb8);                    // mov    eax, -1
+        temp = -1;
+        emit_pos += gen_emitdword(temp);
+        emit_pos += gen_emitbyte(0xc3);                    // ret
+    }
+
+    symidx = parse_lookup_symbol("_sys_pwrite");
+    if (symidx > 0 && symbol_address[symidx] == 0) {
+        int temp;
+
+        // never reached: output goes through _sys_write as _sys_lseek fails
+        symbol_address[symidx] = emit_pos;
+        emit_pos += gen_emitbyte(0xb8);                    // mov    eax, -1
+        temp = -1;
+        emit_pos += gen_emitdword(temp);
+        emit_pos += gen_emitbyte(0xc3);                    // ret
+    }
+}
+
+int gen_code_offset(void)
+{
+    return HEADER_SIZE;
 }
 
 void gen_write_binary(char *emit_buffer, int emit_pos, char *string_table_buffer, int string_table_size)
@@ -217,7 +341,7 @@ void gen_write_binary(char *emit_buffer, int emit_pos, char *string_table_buffer
     n += gen_write_pad(26);
     n += gen_write_pad(32);
     e_lfanew = n + 4;
-    n += _sys_write(1, &e_lfanew, 4);             // e_lfanew
+    n += gen_image_dword(e_lfanew);             // e_lfanew
     n += write_bytes(4, 'P', 'E', 0, 0);          // "PE"
     n += write_bytes(2, 0x4c, 0x01, 0, 0);        // Machine (Intel 386)
     n += write_bytes(2, 0x03, 0x00, 0, 0);        // NumberOfSections
@@ -264,8 +388,8 @@ void gen_write_binary(char *emit_buffer, int emit_pos, char *string_table_buffer
 
     string_base = IMAGE_BASE + TEXT_SEG + code_size - string_table_size;
     gen_backpatching(string_base, IMAGE_BASE+TEXT_SEG+padded_code_size, IMAGE_BASE+TEXT_SEG+padded_code_size+padded_data_size);
-    n += _sys_write(1, emit_buffer, emit_pos);
-    n += _sys_write(1, string_table_buffer, string_table_size);
+    n += gen_image_code(emit_buffer, emit_pos);
+    n += gen_image_bytes(string_table_buffer, string_table_size);
 
     n += gen_write_pad(512 - n%512);  // align
 
@@ -276,39 +400,67 @@ void gen_write_binary(char *emit_buffer, int emit_pos, char *string_table_buffer
     /* offs   4 */ n += write_bytes(4, 0x00, 0x00, 0x00, 0x00); // [UNUSED] timestamp
     /* offs   8 */ n += write_bytes(4, 0x00, 0x00, 0x00, 0x00); // [UNUSED] forwarder chain
 
-    offset = TEXT_SEG+padded_code_size + 64;
-    /* offs  12 */ n += _sys_write(1, &offset, 4);              // kernel32 library name
+    offset = TEXT_SEG+padded_code_size + 72;
+    /* offs  12 */ n += gen_image_dword(offset);              // kernel32 library name
 
     offset = TEXT_SEG+padded_code_size + IMPORT_TABLE_SIZE;
-    /* offs  16 */ n += _sys_write(1, &offset, 4);              // kernel32 IAT  pointer
+    /* offs  16 */ n += gen_image_dword(offset);              // kernel32 IAT  pointer
     /* offs  20 */ n += gen_write_pad(20);                      // terminator (empty item)
 
     // kernel32 IAT
-    offset = TEXT_SEG+padded_code_size + 78;
-    /* offs  40 */ n += _sys_write(1, &offset, 4);              // pointer to ExitProcess
-    offset = TEXT_SEG+padded_code_size + 94;
-    /* offs  44 */ n += _sys_write(1, &offset, 4);              // pointer to GetStdHandle
-    offset = TEXT_SEG+padded_code_size + 110;
-    /* offs  48 */ n += _sys_write(1, &offset, 4);              // pointer to WriteFile
-    offset = TEXT_SEG+padded_code_size + 124;
-    /* offs  52 */ n += _sys_write(1, &offset, 4);              // pointer to ReadFile
-    /* offs  56 */ n += write_bytes(4, 0x00, 0x00, 0x00, 0x00); // end of IAT
-
-    /* offs  60 */ n += gen_write_pad(4 - n%4);      // align to 4 byte boundary
-    /* offs  64 */ n += _sys_write(1, "kernel32.dll", 13);
-
-    /* offs  77 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
-    /* offs  78 */ n += _sys_write(1, "\0\0ExitProcess", 14);
-
-    /* offs  92 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
-    /* offs  94 */ n += _sys_write(1, "\0\0GetStdHandle", 15);
+    offset = TEXT_SEG+padded_code_size + 86;
+    /* offs  40 */ n += gen_image_dword(offset);              // pointer to ExitProcess
+    offset = TEXT_SEG+padded_code_size + 102;
+    /* offs  44 */ n += gen_image_dword(offset);              // pointer to GetStdHandle
+    offset = TEXT_SEG+padded_code_size + 118;
+    /* offs  48 */ n += gen_image_dword(offset);              // pointer to WriteFile
+    offset = TEXT_SEG+padded_code_size + 132;
+    /* offs  52 */ n += gen_image_dword(offset);              // pointer to ReadFile
+    offset = TEXT_SEG+padded_code_size + 144;
+    /* offs  56 */ n += gen_image_dword(offset);              // pointer to CreateFileA
+    offset = TEXT_SEG+padded_code_size + 160;
+    /* offs  60 */ n += gen_image_dword(offset);              // pointer to VirtualAlloc
+    /* offs  64 */ n += write_bytes(4, 0x00, 0x00, 0x00, 0x00); // end of IAT
+
+    /* offs  68 */ n += gen_write_pad(4 - n%4);      // align to 4 byte boundary
+    /* offs  72 */ n += gen_image_bytes("kernel32.dll", 13);
+
+    /* offs  85 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
+    /* offs  86 */ n += gen_image_bytes("\0\0ExitProcess", 14);
+
+    /* offs 100 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
+    /* offs 102 */ n += gen_image_bytes("\0\0GetStdHandle", 15);
+
+    /* offs 117 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
+    /* offs 118 */ n += gen_image_bytes("\0\0WriteFile", 12);
+
+    /* offs 130 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
+    /* offs 132 */ n += gen_image_bytes("\0\0ReadFile", 11);
+
+    /* offs 143 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
+    /* offs 144 */ n += gen_image_bytes("\0\0CreateFileA", 14);
+
+    /* offs 158 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
+    /* offs 160 */ n += gen_image_bytes("\0\0VirtualAlloc", 15);
+
+    /* offs 175 */ n += gen_write_pad(512 - n%512);  // align to 512 byte boundary
+    /* offs 512 */
+}
 
-    /* offs 109 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
-    /* offs 110 */ n += _sys_write(1, "\0\0WriteFile", 12);
+int gen_write_object(char *emit_buffer, int emit_pos, char *string_table_buffer, int string_table_size,
+                     int *object_name, int *object_kind, int *object_value, int object_count,
+                     int *backpatch, int *backpatch_type, int *backpatch_symbol, int backpatch_count)
+{
+    return -1;  // no COFF objects
+}
 
-    /* offs 122 */ n += gen_write_pad(2 - n%2);      // align to 2 byte boundary
-    /* offs 124 */ n += _sys_write(1, "\0\0ReadFile", 11);
+int gen_read_object(char *object, int size)
+{
+    return -1;
+}
 
-    /* offs 135 */ n += gen_write_pad(512 - n%512);  // align to 512 byte boundary
-    /* offs 512 */
+int gen_push_args(void)
+{
+    // no argc and argv on the stack of a windows process
+    return gen_emitbytes(4, 0x6a, 0x00, 0x6a, 0x00);      // push 0 / push 0
 }